@@ -0,0 +1,386 @@
+/*
+ * mcached queue benchmark.
+ *
+ * Runs producers and consumers against one mcached_queue_t and prints one
+ * JSON object per run on stdout, so results of two releases can be diffed
+ * or loaded by a script:
+ *
+ *   scenario    throughput - producers add as fast as they can
+ *               wake       - one item at a time into an empty queue, the
+ *                            consumer is parked in mcached_queue_pop, this
+ *                            measures the embed_ready_event_* wake path
+ *               full       - capacity far below the offered load, this
+ *                            measures the IS_IDLE_LIST_EMPTY back-off path
+ *
+ * Latency is enqueue-to-dequeue: the producer stamps the item right before
+ * add, the consumer reads the clock right after taking it.
+ */
+#include "mcachedqueue.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <getopt.h>
+
+typedef struct
+{
+    struct list_head node;
+    uint64 stamp;
+}bench_item_t;
+
+typedef struct
+{
+    const char *scenario;
+    mcached_queue_mode_t mode;
+    int producers;
+    int consumers;
+    int item_size;
+    int batch;
+    int capacity;
+    long ops;
+    int wake_gap_us;
+}bench_conf_t;
+
+typedef struct
+{
+    pthread_t tid;
+    int id;
+
+    uint64 *lat;
+    long lat_cnt;
+
+    long full_hits;
+    long empty_polls;
+}bench_worker_t;
+
+static bench_conf_t conf = {
+    .scenario = "throughput",
+    .mode = MCACHED_QUEUE_MODE_LIST,
+    .producers = 1,
+    .consumers = 1,
+    .item_size = 64,
+    .batch = 1,
+    .capacity = 4096,
+    .ops = 1000000,
+    .wake_gap_us = 50,
+};
+
+static mcached_queue_t queue;
+static long consumed;
+static long total_ops;
+
+static inline uint64 bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const char *bench_mode_name(mcached_queue_mode_t mode)
+{
+    switch(mode)
+    {
+        case MCACHED_QUEUE_MODE_MPMC_RING:
+            return "ring";
+        case MCACHED_QUEUE_MODE_SPSC:
+            return "spsc";
+        default:
+            return "list";
+    }
+}
+
+static void bench_record(bench_worker_t *w, struct list_head *item)
+{
+    bench_item_t *bi = (bench_item_t *)item;
+
+    if(w->lat_cnt < total_ops)
+        w->lat[w->lat_cnt++] = bench_now_ns() - bi->stamp;
+}
+
+static void *bench_producer(void *arg)
+{
+    bench_worker_t *w = (bench_worker_t *)arg;
+    long share = conf.ops / conf.producers + (w->id < conf.ops % conf.producers);
+    long i = 0;
+
+    while(i < share)
+    {
+        if(conf.batch > 1)
+        {
+            struct list_head *pos;
+            LIST_HEAD(batch);
+            int want = share - i < conf.batch ? share - i : conf.batch;
+            int n = mcached_queue_get_idle_items(&queue, want, &batch);
+
+            if(n == 0)
+            {
+                w->full_hits++;
+                sched_yield();
+                continue;
+            }
+
+            list_for_each(pos, &batch)
+                ((bench_item_t *)pos)->stamp = bench_now_ns();
+            mcached_queue_add_batch(&queue, &batch);
+            i += n;
+        }
+        else
+        {
+            struct list_head *item;
+
+            if(mcached_queue_get_idle_item(&queue, &item) != EMBED_SUCCESS)
+            {
+                w->full_hits++;
+                sched_yield();
+                continue;
+            }
+
+            ((bench_item_t *)item)->stamp = bench_now_ns();
+            mcached_queue_add(&queue, item);
+            i++;
+        }
+
+        if(conf.wake_gap_us > 0 && strcmp(conf.scenario, "wake") == 0)
+            usleep(conf.wake_gap_us);
+    }
+
+    return NULL;
+}
+
+static void *bench_consumer(void *arg)
+{
+    bench_worker_t *w = (bench_worker_t *)arg;
+
+    while(__atomic_load_n(&consumed, __ATOMIC_RELAXED) < total_ops)
+    {
+        if(conf.batch > 1)
+        {
+            struct list_head *pos;
+            LIST_HEAD(out);
+            int n = mcached_queue_pop_batch(&queue, conf.batch, &out);
+
+            if(n == 0)
+            {
+                w->empty_polls++;
+                sched_yield();
+                continue;
+            }
+
+            list_for_each(pos, &out)
+                bench_record(w, pos);
+            mcached_queue_put_idle_items(&queue, &out);
+            __atomic_add_fetch(&consumed, n, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            struct list_head *item;
+            struct timespec deadline;
+            uint64 dl = bench_now_ns() + 10000000ULL;
+
+            if(mcached_queue_trypop(&queue, &item) != EMBED_SUCCESS)
+            {
+                /*park, with a deadline so the last consumers see the end*/
+                w->empty_polls++;
+                deadline.tv_sec = dl / 1000000000ULL;
+                deadline.tv_nsec = dl % 1000000000ULL;
+                if(mcached_queue_timedpop(&queue, &item, &deadline) != EMBED_SUCCESS)
+                    continue;
+            }
+
+            bench_record(w, item);
+            mcached_queue_del(&queue, item);
+            __atomic_add_fetch(&consumed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+    uint64 x = *(const uint64 *)a, y = *(const uint64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint64 bench_pct(uint64 *v, long cnt, double pct)
+{
+    long i;
+
+    if(cnt == 0)
+        return 0;
+
+    i = (long)(pct / 100.0 * (cnt - 1) + 0.5);
+
+    return v[i];
+}
+
+static void bench_usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-S throughput|wake|full] [-m list|ring|spsc] [-p producers]\n"
+            "          [-c consumers] [-s item_size] [-b batch] [-n capacity] [-o ops]\n"
+            "          [-g wake_gap_us]\n", prog);
+}
+
+static int bench_parse(int argc, char **argv)
+{
+    int opt;
+
+    while((opt = getopt(argc, argv, "S:m:p:c:s:b:n:o:g:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'S':
+                conf.scenario = optarg;
+                break;
+            case 'm':
+                if(strcmp(optarg, "ring") == 0)
+                    conf.mode = MCACHED_QUEUE_MODE_MPMC_RING;
+                else if(strcmp(optarg, "spsc") == 0)
+                    conf.mode = MCACHED_QUEUE_MODE_SPSC;
+                else
+                    conf.mode = MCACHED_QUEUE_MODE_LIST;
+                break;
+            case 'p':
+                conf.producers = atoi(optarg);
+                break;
+            case 'c':
+                conf.consumers = atoi(optarg);
+                break;
+            case 's':
+                conf.item_size = atoi(optarg);
+                break;
+            case 'b':
+                conf.batch = atoi(optarg);
+                break;
+            case 'n':
+                conf.capacity = atoi(optarg);
+                break;
+            case 'o':
+                conf.ops = atol(optarg);
+                break;
+            case 'g':
+                conf.wake_gap_us = atoi(optarg);
+                break;
+            default:
+                bench_usage(argv[0]);
+                return EMBED_FAILD;
+        }
+    }
+
+    if(strcmp(conf.scenario, "wake") == 0)
+    {
+        conf.producers = 1;
+        conf.batch = 1;
+    }
+    else if(strcmp(conf.scenario, "full") == 0 && conf.capacity > 64)
+    {
+        conf.capacity = 64;
+    }
+    else if(strcmp(conf.scenario, "throughput") != 0)
+    {
+        bench_usage(argv[0]);
+        return EMBED_FAILD;
+    }
+
+    if(conf.mode == MCACHED_QUEUE_MODE_SPSC)
+        conf.producers = conf.consumers = 1;
+
+    if(conf.item_size < (int)sizeof(bench_item_t))
+        conf.item_size = sizeof(bench_item_t);
+
+    if(conf.producers <= 0 || conf.consumers <= 0 || conf.batch <= 0
+            || conf.capacity <= 0 || conf.ops <= 0)
+    {
+        bench_usage(argv[0]);
+        return EMBED_FAILD;
+    }
+
+    return EMBED_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    bench_worker_t *prod, *cons;
+    mcached_queue_attr_t attr;
+    uint64 start, elapsed, *lat;
+    long lat_cnt = 0, full_hits = 0, empty_polls = 0;
+    int i;
+
+    if(bench_parse(argc, argv) != EMBED_SUCCESS)
+        return 1;
+
+    mcached_queue_attr_init(&attr);
+    attr.mode = conf.mode;
+    if(mcached_queue_init_ex(&queue, conf.item_size, conf.capacity, &attr) != EMBED_SUCCESS)
+    {
+        fprintf(stderr, "mcached_queue_init_ex failed\n");
+        return 1;
+    }
+
+    total_ops = conf.ops;
+    prod = (bench_worker_t *)calloc(conf.producers, sizeof(bench_worker_t));
+    cons = (bench_worker_t *)calloc(conf.consumers, sizeof(bench_worker_t));
+    lat = (uint64 *)malloc(total_ops * sizeof(uint64));
+    if(prod == NULL || cons == NULL || lat == NULL)
+        return 1;
+
+    for(i = 0; i < conf.consumers; i++)
+    {
+        cons[i].id = i;
+        cons[i].lat = (uint64 *)malloc(total_ops * sizeof(uint64));
+        if(cons[i].lat == NULL)
+            return 1;
+    }
+
+    start = bench_now_ns();
+
+    for(i = 0; i < conf.consumers; i++)
+        pthread_create(&cons[i].tid, NULL, bench_consumer, &cons[i]);
+    for(i = 0; i < conf.producers; i++)
+    {
+        prod[i].id = i;
+        pthread_create(&prod[i].tid, NULL, bench_producer, &prod[i]);
+    }
+
+    for(i = 0; i < conf.producers; i++)
+    {
+        pthread_join(prod[i].tid, NULL);
+        full_hits += prod[i].full_hits;
+    }
+    for(i = 0; i < conf.consumers; i++)
+    {
+        pthread_join(cons[i].tid, NULL);
+        memcpy(lat + lat_cnt, cons[i].lat, cons[i].lat_cnt * sizeof(uint64));
+        lat_cnt += cons[i].lat_cnt;
+        empty_polls += cons[i].empty_polls;
+        Free(cons[i].lat);
+    }
+
+    elapsed = bench_now_ns() - start;
+
+    qsort(lat, lat_cnt, sizeof(uint64), bench_cmp_u64);
+
+    printf("{\"scenario\":\"%s\",\"mode\":\"%s\",\"producers\":%d,\"consumers\":%d,"
+            "\"item_size\":%d,\"batch\":%d,\"capacity\":%d,\"ops\":%ld,"
+            "\"secs\":%.6f,\"ops_per_sec\":%.0f,"
+            "\"lat_ns\":{\"p50\":%llu,\"p99\":%llu,\"p99.9\":%llu,\"max\":%llu},"
+            "\"full_hits\":%ld,\"empty_polls\":%ld}\n",
+            conf.scenario, bench_mode_name(conf.mode), conf.producers, conf.consumers,
+            conf.item_size, conf.batch, conf.capacity, conf.ops,
+            elapsed / 1e9, conf.ops / (elapsed / 1e9),
+            bench_pct(lat, lat_cnt, 50), bench_pct(lat, lat_cnt, 99),
+            bench_pct(lat, lat_cnt, 99.9), lat_cnt ? lat[lat_cnt - 1] : 0,
+            full_hits, empty_polls);
+
+    mcached_queue_destroy(&queue);
+    Free(prod);
+    Free(cons);
+    Free(lat);
+
+    return 0;
+}
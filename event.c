@@ -0,0 +1,472 @@
+#include "event.h"
+#include "embed_assert.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/**
+ * @defgroup EMBED_HAS_REDAY_NOTIFY_OBJ
+ * @{
+ */
+
+static inline void ready_event_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/*Private futex ops unless the event lives in memory shared between processes*/
+static inline int ready_event_futex_op(embed_ready_event_t *ready_event, int op)
+{
+    return ready_event->shared ? op : op | FUTEX_PRIVATE_FLAG;
+}
+
+static inline int ready_event_futex_wait(embed_ready_event_t *ready_event, uint32 val)
+{
+    return syscall(SYS_futex, &ready_event->nready,
+            ready_event_futex_op(ready_event, FUTEX_WAIT), val, NULL, NULL, 0);
+}
+
+/*Absolute CLOCK_MONOTONIC timeout, FUTEX_WAIT_BITSET is the absolute form*/
+static inline int ready_event_futex_wait_until(embed_ready_event_t *ready_event, uint32 val,
+        const struct timespec *deadline)
+{
+    return syscall(SYS_futex, &ready_event->nready,
+            ready_event_futex_op(ready_event, FUTEX_WAIT_BITSET), val, deadline, NULL,
+            FUTEX_BITSET_MATCH_ANY);
+}
+
+static inline void ready_event_futex_wake(embed_ready_event_t *ready_event, uint32 cnt)
+{
+    syscall(SYS_futex, &ready_event->nready,
+            ready_event_futex_op(ready_event, FUTEX_WAKE), cnt > INT_MAX ? INT_MAX : (int)cnt,
+            NULL, NULL, 0);
+}
+
+/*Take one ready item if there is any*/
+static inline embed_bool_t ready_event_try_take(embed_ready_event_t *ready_event)
+{
+    uint32 n = __atomic_load_n(&ready_event->nready, __ATOMIC_ACQUIRE);
+
+    while(n > 0)
+    {
+        if(__atomic_compare_exchange_n(&ready_event->nready, &n, n - 1,
+                    true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            return true;
+    }
+
+    return false;
+}
+
+embed_status_t embed_ready_event_create(embed_ready_event_t **ready_event)
+{
+    embed_ready_event_t *event;
+
+    EMBED_ASSERT_RETURN(ready_event != NULL, EMBED_FAILD);
+
+    event = (embed_ready_event_t *)malloc(sizeof(embed_ready_event_t));
+    if(event == NULL)
+        return EMBED_FAILD;
+
+    embed_ready_event_init(event, false);
+    *ready_event = event;
+
+    return EMBED_SUCCESS;
+}
+
+embed_status_t embed_ready_event_init(embed_ready_event_t *ready_event, embed_bool_t shared)
+{
+    EMBED_ASSERT_RETURN(ready_event != NULL, EMBED_FAILD);
+
+    ready_event->nready = 0;
+    ready_event->waiters = 0;
+    ready_event->spin = EMBED_READY_EVENT_SPIN;
+    ready_event->shared = shared;
+
+    return EMBED_SUCCESS;
+}
+
+/*Block until at least one item is ready, then consume it*/
+embed_status_t embed_ready_event_wait(embed_ready_event_t *ready_event)
+{
+    uint32 spin;
+
+    EMBED_ASSERT_RETURN(ready_event != NULL, EMBED_FAILD);
+
+    for(spin = ready_event->spin; spin > 0; spin--)
+    {
+        if(ready_event_try_take(ready_event))
+            return EMBED_SUCCESS;
+        ready_event_cpu_relax();
+    }
+
+    while(!ready_event_try_take(ready_event))
+    {
+        /*
+         * Publishing waiters before the futex re-checks nready == 0 pairs
+         * with active's nready increment before it reads waiters, so one
+         * of the two always sees the other.
+         */
+        __atomic_add_fetch(&ready_event->waiters, 1, __ATOMIC_SEQ_CST);
+        ready_event_futex_wait(ready_event, 0);
+        __atomic_sub_fetch(&ready_event->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+
+    return EMBED_SUCCESS;
+}
+
+embed_status_t embed_ready_event_timedwait(embed_ready_event_t *ready_event,
+        const struct timespec *deadline)
+{
+    uint32 spin;
+
+    EMBED_ASSERT_RETURN(ready_event != NULL && deadline != NULL, EMBED_FAILD);
+
+    for(spin = ready_event->spin; spin > 0; spin--)
+    {
+        if(ready_event_try_take(ready_event))
+            return EMBED_SUCCESS;
+        ready_event_cpu_relax();
+    }
+
+    while(!ready_event_try_take(ready_event))
+    {
+        int ret;
+
+        __atomic_add_fetch(&ready_event->waiters, 1, __ATOMIC_SEQ_CST);
+        ret = ready_event_futex_wait_until(ready_event, 0, deadline);
+        __atomic_sub_fetch(&ready_event->waiters, 1, __ATOMIC_SEQ_CST);
+
+        if(ret < 0 && errno == ETIMEDOUT)
+            return ready_event_try_take(ready_event) ? EMBED_SUCCESS : EMBED_FAILD;
+    }
+
+    return EMBED_SUCCESS;
+}
+
+/*Consume one ready item if there is any, EMBED_FAILD otherwise*/
+embed_status_t embed_ready_event_trywait(embed_ready_event_t *ready_event)
+{
+    EMBED_ASSERT_RETURN(ready_event != NULL, EMBED_FAILD);
+
+    return ready_event_try_take(ready_event) ? EMBED_SUCCESS : EMBED_FAILD;
+}
+
+embed_status_t embed_ready_event_pop(embed_ready_event_t *ready_event, embed_ready_take_cb take,
+        void *queue, void *item, const struct timespec *deadline, embed_bool_t *blocked)
+{
+    embed_status_t status;
+
+    EMBED_ASSERT_RETURN(ready_event != NULL && take != NULL, EMBED_FAILD);
+
+    if(blocked)
+        *blocked = false;
+
+    for(;;)
+    {
+        if(!ready_event_try_take(ready_event))
+        {
+            if(blocked)
+                *blocked = true;
+
+            if(deadline)
+                status = embed_ready_event_timedwait(ready_event, deadline);
+            else
+                status = embed_ready_event_wait(ready_event);
+            if(status != EMBED_SUCCESS)
+                return EMBED_FAILD;
+        }
+
+        /*a miss means the token was left by a consumer that did not pop*/
+        if(take(queue, item))
+            return EMBED_SUCCESS;
+    }
+}
+
+embed_status_t embed_ready_event_trypop(embed_ready_event_t *ready_event, embed_ready_take_cb take,
+        void *queue, void *item)
+{
+    EMBED_ASSERT_RETURN(ready_event != NULL && take != NULL, EMBED_FAILD);
+
+    if(!take(queue, item))
+        return EMBED_FAILD;
+
+    /*keep one token per queued item for the blocking poppers*/
+    ready_event_try_take(ready_event);
+
+    return EMBED_SUCCESS;
+}
+
+/*Announce one more ready item and wake a waiter*/
+embed_status_t embed_ready_event_active(embed_ready_event_t *ready_event)
+{
+    return embed_ready_event_active_n(ready_event, 1);
+}
+
+/*Announce cnt ready items, the syscall is skipped when nobody is parked*/
+embed_status_t embed_ready_event_active_n(embed_ready_event_t *ready_event, uint32 cnt)
+{
+    EMBED_ASSERT_RETURN(ready_event != NULL, EMBED_FAILD);
+
+    if(cnt == 0)
+        return EMBED_SUCCESS;
+
+    __atomic_add_fetch(&ready_event->nready, cnt, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ready_event->waiters, __ATOMIC_SEQ_CST) > 0)
+        ready_event_futex_wake(ready_event, cnt);
+
+    return EMBED_SUCCESS;
+}
+
+/*Consume one ready item without blocking, if there is any*/
+embed_status_t embed_ready_event_update(embed_ready_event_t *ready_event)
+{
+    EMBED_ASSERT_RETURN(ready_event != NULL, EMBED_FAILD);
+
+    ready_event_try_take(ready_event);
+
+    return EMBED_SUCCESS;
+}
+
+embed_status_t embed_ready_event_set_spin(embed_ready_event_t *ready_event, uint32 spin)
+{
+    EMBED_ASSERT_RETURN(ready_event != NULL, EMBED_FAILD);
+
+    ready_event->spin = spin;
+
+    return EMBED_SUCCESS;
+}
+
+embed_status_t embed_ready_event_destroy(embed_ready_event_t *ready_event)
+{
+    EMBED_ASSERT_RETURN(ready_event != NULL, EMBED_FAILD);
+
+    Free(ready_event);
+
+    return EMBED_SUCCESS;
+}
+
+/**
+ * @}
+ */
+
+
+/**
+ * @defgroup EMBED_HAS_EVENT_OBJ
+ * @{
+ */
+
+embed_status_t embed_event_create(embed_event_t **event,
+        embed_bool_t manual_reset, embed_bool_t initial)
+{
+    embed_event_t *ev;
+
+    EMBED_ASSERT_RETURN(event != NULL, EMBED_FAILD);
+
+    ev = (embed_event_t *)malloc(sizeof(embed_event_t));
+    if(ev == NULL)
+        return EMBED_FAILD;
+
+    if(pthread_mutex_init(&ev->mutex, NULL) != 0)
+    {
+        Free(ev);
+        return EMBED_FAILD;
+    }
+
+    if(pthread_cond_init(&ev->cond, NULL) != 0)
+    {
+        pthread_mutex_destroy(&ev->mutex);
+        Free(ev);
+        return EMBED_FAILD;
+    }
+
+    ev->auto_reset = !manual_reset;
+    ev->threads_waiting = 0;
+    ev->threads_to_release = 0;
+    ev->state = initial ? EV_STATE_SET : EV_STATE_OFF;
+
+    *event = ev;
+
+    return EMBED_SUCCESS;
+}
+
+embed_status_t embed_evnet_wait(embed_event_t *event)
+{
+    EMBED_ASSERT_RETURN(event != NULL, EMBED_FAILD);
+
+    pthread_mutex_lock(&event->mutex);
+    event->threads_waiting++;
+
+    while(event->state == EV_STATE_OFF)
+        pthread_cond_wait(&event->cond, &event->mutex);
+
+    if(event->state == EV_STATE_PULSED)
+    {
+        if(--event->threads_to_release == 0)
+            event->state = EV_STATE_OFF;
+    }
+    else if(event->auto_reset)
+    {
+        event->state = EV_STATE_OFF;
+    }
+
+    event->threads_waiting--;
+    pthread_mutex_unlock(&event->mutex);
+
+    return EMBED_SUCCESS;
+}
+
+embed_status_t embed_event_trywait(embed_event_t *event)
+{
+    embed_status_t status = EMBED_FAILD;
+
+    EMBED_ASSERT_RETURN(event != NULL, EMBED_FAILD);
+
+    pthread_mutex_lock(&event->mutex);
+    if(event->state == EV_STATE_SET)
+    {
+        if(event->auto_reset)
+            event->state = EV_STATE_OFF;
+        status = EMBED_SUCCESS;
+    }
+    pthread_mutex_unlock(&event->mutex);
+
+    return status;
+}
+
+embed_status_t embed_event_set(embed_event_t *event)
+{
+    EMBED_ASSERT_RETURN(event != NULL, EMBED_FAILD);
+
+    pthread_mutex_lock(&event->mutex);
+    event->threads_to_release = 1;
+    event->state = EV_STATE_SET;
+    if(event->auto_reset)
+        pthread_cond_signal(&event->cond);
+    else
+        pthread_cond_broadcast(&event->cond);
+    pthread_mutex_unlock(&event->mutex);
+
+    return EMBED_SUCCESS;
+}
+
+/*Release waiting threads (one for auto reset, all for manual) and reset*/
+embed_status_t embed_event_pulse(embed_event_t *event)
+{
+    EMBED_ASSERT_RETURN(event != NULL, EMBED_FAILD);
+
+    pthread_mutex_lock(&event->mutex);
+    if(event->threads_waiting)
+    {
+        event->threads_to_release = event->auto_reset ? 1 : event->threads_waiting;
+        event->state = EV_STATE_PULSED;
+        if(event->threads_to_release == 1)
+            pthread_cond_signal(&event->cond);
+        else
+            pthread_cond_broadcast(&event->cond);
+    }
+    pthread_mutex_unlock(&event->mutex);
+
+    return EMBED_SUCCESS;
+}
+
+embed_status_t embed_event_reset(embed_event_t *event)
+{
+    EMBED_ASSERT_RETURN(event != NULL, EMBED_FAILD);
+
+    pthread_mutex_lock(&event->mutex);
+    event->state = EV_STATE_OFF;
+    event->threads_to_release = 0;
+    pthread_mutex_unlock(&event->mutex);
+
+    return EMBED_SUCCESS;
+}
+
+embed_status_t embed_event_destroy(embed_event_t *event)
+{
+    EMBED_ASSERT_RETURN(event != NULL, EMBED_FAILD);
+
+    pthread_cond_destroy(&event->cond);
+    pthread_mutex_destroy(&event->mutex);
+    Free(event);
+
+    return EMBED_SUCCESS;
+}
+
+/**
+ * @}
+ */
+
+
+/**
+ * @defgroup EMBED_HAS_RWLOCK_OBJ
+ * @{
+ */
+
+embed_status_t embed_rwlock_create(embed_rwlock_t **rw_mutex)
+{
+    embed_rwlock_t *rwlock;
+
+    EMBED_ASSERT_RETURN(rw_mutex != NULL, EMBED_FAILD);
+
+    rwlock = (embed_rwlock_t *)malloc(sizeof(embed_rwlock_t));
+    if(rwlock == NULL)
+        return EMBED_FAILD;
+
+    if(pthread_rwlock_init(&rwlock->rwlock, NULL) != 0)
+    {
+        Free(rwlock);
+        return EMBED_FAILD;
+    }
+
+    *rw_mutex = rwlock;
+
+    return EMBED_SUCCESS;
+}
+
+embed_status_t embed_rwlock_lock_read(embed_rwlock_t *rw_mutex)
+{
+    EMBED_ASSERT_RETURN(rw_mutex != NULL, EMBED_FAILD);
+
+    return pthread_rwlock_rdlock(&rw_mutex->rwlock) == 0 ? EMBED_SUCCESS : EMBED_FAILD;
+}
+
+embed_status_t embed_rwlock_lock_write(embed_rwlock_t *rw_mutex)
+{
+    EMBED_ASSERT_RETURN(rw_mutex != NULL, EMBED_FAILD);
+
+    return pthread_rwlock_wrlock(&rw_mutex->rwlock) == 0 ? EMBED_SUCCESS : EMBED_FAILD;
+}
+
+embed_status_t embed_rwlock_unlock_read(embed_rwlock_t *rw_mutex)
+{
+    EMBED_ASSERT_RETURN(rw_mutex != NULL, EMBED_FAILD);
+
+    return pthread_rwlock_unlock(&rw_mutex->rwlock) == 0 ? EMBED_SUCCESS : EMBED_FAILD;
+}
+
+embed_status_t embed_rwlock_unlock_write(embed_rwlock_t *rw_mutex)
+{
+    EMBED_ASSERT_RETURN(rw_mutex != NULL, EMBED_FAILD);
+
+    return pthread_rwlock_unlock(&rw_mutex->rwlock) == 0 ? EMBED_SUCCESS : EMBED_FAILD;
+}
+
+embed_status_t embed_rwlock_lock_destroy(embed_rwlock_t *rw_mutex)
+{
+    EMBED_ASSERT_RETURN(rw_mutex != NULL, EMBED_FAILD);
+
+    pthread_rwlock_destroy(&rw_mutex->rwlock);
+    Free(rw_mutex);
+
+    return EMBED_SUCCESS;
+}
+
+/**
+ * @}
+ */
@@ -1,118 +1,157 @@
-#ifndef _OS_H_
-#define _OS_H_
-
-#include "type.h"
-
-#include <pthread.h>
-
-/**
- * @defgroup EMBED_HAS_REDAY_NOTIFY_OBJ
- * @{
- *
- */
-
-/**
- * This moudle provides abstraction to Reday event mechanism
- * Ready event obj can be used for synchronizatino among (queue list
- * and so on)
- */
-    
-#define Free(ptr) \
-    do {\
-        if(ptr){ \
-            free(ptr);\
-            ptr = NULL;\
-        }\
-    }while(0)\
-
-typedef struct{
-    pthread_mutex_t mutex;
-    pthread_cond_t  cond;
-
-    uint16 nready;
-}embed_ready_event_t;
-
-embed_status_t embed_ready_event_create(embed_ready_event_t **ready_event);
-
-embed_status_t embed_ready_event_wait(embed_ready_event_t *ready_event);
-
-embed_status_t embed_ready_event_active(embed_ready_event_t *ready_event);
-
-embed_status_t embed_ready_event_update(embed_ready_event_t *ready_event);
-
-embed_status_t embed_ready_event_destroy(embed_ready_event_t *ready_event);
-/**
- *
- * @}
- */
-
-
-/**
- * @defgroup EMBED_HAS_EVENT_OBJ
- * @{
- */
-
-/**
- *  This moudle provides abstraction to event object(Linux).
- *  Event object can be used for synchronization among threads
- */
-
-typedef enum 
-{
-    EV_STATE_OFF,
-    EV_STATE_SET,
-    EV_STATE_PULSED
-}embed_event_state;
-
-typedef struct 
-{
-    pthread_mutex_t mutex;
-    pthread_cond_t  cond;
-    embed_event_state state;
-
-    bool auto_reset;    
-    uint16 threads_waiting;
-    uint16 threads_to_release;
-}embed_event_t;
-
-embed_status_t embed_event_create(embed_event_t **event, 
-        embed_bool_t manual_reset, embed_bool_t initial);
-
-embed_status_t embed_evnet_wait(embed_event_t *event);
-
-embed_status_t embed_event_trywait(embed_event_t *event);
-
-embed_status_t embed_event_set(embed_event_t *event);
-
-embed_status_t embed_event_pulse(embed_event_t *event);
-
-embed_status_t embed_event_reset(embed_event_t *event);
-
-embed_status_t embed_event_destroy(embed_event_t *event);
-
-/**
- * @defgroup EMBED_HAS_RWLOCK_OBJ
- * @{
- *
- */
-
-/**
- * This moudle provides abstraction to POSIX rwlock
- */
-typedef struct {
-    pthread_rwlock_t rwlock;
-}embed_rwlock_t;
-
-embed_status_t embed_rwlock_create(embed_rwlock_t **rw_mutex);
-
-embed_status_t embed_rwlock_lock_read(embed_rwlock_t *rw_mutex);
-
-embed_status_t embed_rwlock_lock_write(embed_rwlock_t *rw_mutex);
-
-embed_status_t embed_rwlock_unlock_read(embed_rwlock_t *rw_mutex);
-
-embed_status_t embed_rwlock_unlock_write(embed_rwlock_t *rw_mutex);
-
-embed_status_t embed_rwlock_lock_destroy(embed_rwlock_t *rw_mutex);
-
-#endif
+#ifndef _OS_H_
+#define _OS_H_
+
+#include "type.h"
+
+#include <pthread.h>
+#include <time.h>
+
+/**
+ * @defgroup EMBED_HAS_REDAY_NOTIFY_OBJ
+ * @{
+ *
+ */
+
+/**
+ * This moudle provides abstraction to Reday event mechanism
+ * Ready event obj can be used for synchronizatino among (queue list
+ * and so on)
+ */
+    
+#define Free(ptr) \
+    do {\
+        if(ptr){ \
+            free(ptr);\
+            ptr = NULL;\
+        }\
+    }while(0)\
+
+/*Default number of polls embed_ready_event_wait makes before parking*/
+#define EMBED_READY_EVENT_SPIN  128
+
+/*
+ * nready is also the futex word: waiters spin on it for a while and then
+ * park in FUTEX_WAIT while it is 0. Producers only issue FUTEX_WAKE when
+ * waiters says someone is (about to be) parked. A shared event uses the
+ * non-private futex ops, so it works from a MAP_SHARED mapping in several
+ * processes at once.
+ */
+typedef struct{
+    uint32 nready;
+    uint32 waiters;
+    uint32 spin;
+    uint32 shared;
+}embed_ready_event_t;
+
+embed_status_t embed_ready_event_create(embed_ready_event_t **ready_event);
+
+/*Initialize an event in caller provided (e.g. shared) memory*/
+embed_status_t embed_ready_event_init(embed_ready_event_t *ready_event, embed_bool_t shared);
+
+embed_status_t embed_ready_event_wait(embed_ready_event_t *ready_event);
+
+/*deadline is absolute CLOCK_MONOTONIC, EMBED_FAILD once it has passed*/
+embed_status_t embed_ready_event_timedwait(embed_ready_event_t *ready_event,
+        const struct timespec *deadline);
+
+embed_status_t embed_ready_event_trywait(embed_ready_event_t *ready_event);
+
+/*Move the head of a queue to *item, false if it is empty*/
+typedef embed_bool_t (*embed_ready_take_cb)(void *queue, void *item);
+
+/*
+ * Pop for a queue that keeps one token per queued item: wait for a token
+ * (until deadline if it is not NULL), then take the head. trypop takes the
+ * head first and drops its token after. *blocked, when given, is set if pop
+ * found no token and had to wait.
+ */
+embed_status_t embed_ready_event_pop(embed_ready_event_t *ready_event, embed_ready_take_cb take,
+        void *queue, void *item, const struct timespec *deadline, embed_bool_t *blocked);
+
+embed_status_t embed_ready_event_trypop(embed_ready_event_t *ready_event, embed_ready_take_cb take,
+        void *queue, void *item);
+
+embed_status_t embed_ready_event_active(embed_ready_event_t *ready_event);
+
+embed_status_t embed_ready_event_active_n(embed_ready_event_t *ready_event, uint32 cnt);
+
+embed_status_t embed_ready_event_update(embed_ready_event_t *ready_event);
+
+embed_status_t embed_ready_event_set_spin(embed_ready_event_t *ready_event, uint32 spin);
+
+embed_status_t embed_ready_event_destroy(embed_ready_event_t *ready_event);
+/**
+ *
+ * @}
+ */
+
+
+/**
+ * @defgroup EMBED_HAS_EVENT_OBJ
+ * @{
+ */
+
+/**
+ *  This moudle provides abstraction to event object(Linux).
+ *  Event object can be used for synchronization among threads
+ */
+
+typedef enum 
+{
+    EV_STATE_OFF,
+    EV_STATE_SET,
+    EV_STATE_PULSED
+}embed_event_state;
+
+typedef struct 
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    embed_event_state state;
+
+    bool auto_reset;    
+    uint16 threads_waiting;
+    uint16 threads_to_release;
+}embed_event_t;
+
+embed_status_t embed_event_create(embed_event_t **event, 
+        embed_bool_t manual_reset, embed_bool_t initial);
+
+embed_status_t embed_evnet_wait(embed_event_t *event);
+
+embed_status_t embed_event_trywait(embed_event_t *event);
+
+embed_status_t embed_event_set(embed_event_t *event);
+
+embed_status_t embed_event_pulse(embed_event_t *event);
+
+embed_status_t embed_event_reset(embed_event_t *event);
+
+embed_status_t embed_event_destroy(embed_event_t *event);
+
+/**
+ * @defgroup EMBED_HAS_RWLOCK_OBJ
+ * @{
+ *
+ */
+
+/**
+ * This moudle provides abstraction to POSIX rwlock
+ */
+typedef struct {
+    pthread_rwlock_t rwlock;
+}embed_rwlock_t;
+
+embed_status_t embed_rwlock_create(embed_rwlock_t **rw_mutex);
+
+embed_status_t embed_rwlock_lock_read(embed_rwlock_t *rw_mutex);
+
+embed_status_t embed_rwlock_lock_write(embed_rwlock_t *rw_mutex);
+
+embed_status_t embed_rwlock_unlock_read(embed_rwlock_t *rw_mutex);
+
+embed_status_t embed_rwlock_unlock_write(embed_rwlock_t *rw_mutex);
+
+embed_status_t embed_rwlock_lock_destroy(embed_rwlock_t *rw_mutex);
+
+#endif
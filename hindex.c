@@ -0,0 +1,166 @@
+#include "hindex.h"
+#include "event.h"
+#include "embed_assert.h"
+
+#include <stdlib.h>
+
+/**
+ * @defgroup EMBED_HAS_HASH_INDEX
+ * @{
+ */
+
+embed_status_t mcached_hindex_create(mcached_hindex_t **index, uint32 slot_cnt)
+{
+    mcached_hindex_t *idx;
+    uint32 i;
+
+    EMBED_ASSERT_RETURN(index != NULL && slot_cnt > 0, EMBED_FAILD);
+
+    idx = (mcached_hindex_t *)calloc(1, sizeof(mcached_hindex_t));
+    if(idx == NULL)
+        return EMBED_FAILD;
+
+    idx->max_buckets = MCACHED_HINDEX_MIN_BUCKETS;
+    while(idx->max_buckets < slot_cnt)
+        idx->max_buckets <<= 1;
+
+    idx->tab[0] = (struct hlist_head *)calloc(MCACHED_HINDEX_MIN_BUCKETS, sizeof(struct hlist_head));
+    idx->nodes = (struct hlist_node *)malloc(slot_cnt * sizeof(struct hlist_node));
+    idx->hashes = (uint32 *)malloc(slot_cnt * sizeof(uint32));
+    if(idx->tab[0] == NULL || idx->nodes == NULL || idx->hashes == NULL)
+    {
+        Free(idx->tab[0]);
+        Free(idx->nodes);
+        Free(idx->hashes);
+        Free(idx);
+        return EMBED_FAILD;
+    }
+
+    for(i = 0; i < slot_cnt; i++)
+        INIT_HLIST_NODE(&idx->nodes[i]);
+
+    idx->mask[0] = MCACHED_HINDEX_MIN_BUCKETS - 1;
+
+    *index = idx;
+
+    return EMBED_SUCCESS;
+}
+
+embed_status_t mcached_hindex_destroy(mcached_hindex_t *index)
+{
+    EMBED_ASSERT_RETURN(index != NULL, EMBED_FAILD);
+
+    Free(index->tab[0]);
+    Free(index->tab[1]);
+    Free(index->nodes);
+    Free(index->hashes);
+    Free(index);
+
+    return EMBED_SUCCESS;
+}
+
+/*Move up to MCACHED_HINDEX_REHASH_STEP old buckets into the new table*/
+static void hindex_rehash_step(mcached_hindex_t *index)
+{
+    int step = MCACHED_HINDEX_REHASH_STEP;
+
+    if(index->tab[1] == NULL)
+        return;
+
+    while(step-- > 0 && index->rehash_pos <= index->mask[0])
+    {
+        struct hlist_head *old = &index->tab[0][index->rehash_pos++];
+
+        while(!hlist_empty(old))
+        {
+            struct hlist_node *node = old->first;
+            uint32 slot = node - index->nodes;
+
+            __hlist_del(node);
+            hlist_add_head(node, &index->tab[1][index->hashes[slot] & index->mask[1]]);
+        }
+    }
+
+    if(index->rehash_pos > index->mask[0])
+    {
+        Free(index->tab[0]);
+        index->tab[0] = index->tab[1];
+        index->mask[0] = index->mask[1];
+        index->tab[1] = NULL;
+    }
+}
+
+static void hindex_grow(mcached_hindex_t *index)
+{
+    uint32 size = (index->mask[0] + 1) << 1;
+
+    if(index->tab[1] != NULL || index->cnt <= index->mask[0] + 1
+            || size > index->max_buckets)
+        return;
+
+    /*a failed grow only costs longer chains*/
+    index->tab[1] = (struct hlist_head *)calloc(size, sizeof(struct hlist_head));
+    if(index->tab[1] == NULL)
+        return;
+
+    index->mask[1] = size - 1;
+    index->rehash_pos = 0;
+}
+
+void mcached_hindex_insert(mcached_hindex_t *index, uint32 slot, uint32 hash)
+{
+    struct hlist_node *node = &index->nodes[slot];
+
+    if(!hlist_unhashed(node))
+        return;
+
+    hindex_rehash_step(index);
+
+    index->hashes[slot] = hash;
+    if(index->tab[1])
+        hlist_add_head(node, &index->tab[1][hash & index->mask[1]]);
+    else
+        hlist_add_head(node, &index->tab[0][hash & index->mask[0]]);
+    index->cnt++;
+
+    hindex_grow(index);
+}
+
+void mcached_hindex_remove(mcached_hindex_t *index, uint32 slot)
+{
+    struct hlist_node *node = &index->nodes[slot];
+
+    if(hlist_unhashed(node))
+        return;
+
+    hlist_del_init(node);
+    index->cnt--;
+
+    hindex_rehash_step(index);
+}
+
+int32 mcached_hindex_lookup(mcached_hindex_t *index, uint32 hash,
+        mcached_hindex_match_cb match, void *arg)
+{
+    struct hlist_node *node;
+    int t;
+
+    hindex_rehash_step(index);
+
+    for(t = 0; t < 2 && index->tab[t]; t++)
+    {
+        hlist_for_each(node, &index->tab[t][hash & index->mask[t]])
+        {
+            uint32 slot = node - index->nodes;
+
+            if(index->hashes[slot] == hash && match(slot, arg))
+                return slot;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,60 @@
+#ifndef _MCACHED_HINDEX_H_
+#define _MCACHED_HINDEX_H_
+
+#include "type.h"
+#include "list.h"
+
+/**
+ * @defgroup EMBED_HAS_HASH_INDEX
+ * @{
+ */
+
+/**
+ * Chained hash index over slot numbers of a fixed size slab.
+ *
+ * Every slot owns one hlist_node and its cached hash, so the index never
+ * allocates per insert. When the load factor passes 1 a table twice the
+ * size is installed and buckets of the old one are migrated a few at a
+ * time by every following insert/remove/lookup, so no single call pays
+ * for a whole resize. Lookups check both tables while a rehash runs.
+ *
+ * Callers serialize all calls themselves.
+ */
+
+#define MCACHED_HINDEX_MIN_BUCKETS     16
+#define MCACHED_HINDEX_REHASH_STEP     4
+
+typedef struct
+{
+    struct hlist_head *tab[2];
+    uint32 mask[2];
+
+    /*next tab[0] bucket to migrate, meaningful while tab[1] != NULL*/
+    uint32 rehash_pos;
+
+    uint32 cnt;
+    uint32 max_buckets;
+
+    struct hlist_node *nodes;
+    uint32 *hashes;
+}mcached_hindex_t;
+
+typedef embed_bool_t (*mcached_hindex_match_cb)(uint32 slot, void *arg);
+
+embed_status_t mcached_hindex_create(mcached_hindex_t **index, uint32 slot_cnt);
+
+embed_status_t mcached_hindex_destroy(mcached_hindex_t *index);
+
+void mcached_hindex_insert(mcached_hindex_t *index, uint32 slot, uint32 hash);
+
+void mcached_hindex_remove(mcached_hindex_t *index, uint32 slot);
+
+/*First indexed slot with this hash accepted by match, or -1*/
+int32 mcached_hindex_lookup(mcached_hindex_t *index, uint32 hash,
+        mcached_hindex_match_cb match, void *arg);
+
+/**
+ * @}
+ */
+
+#endif
@@ -0,0 +1,80 @@
+#include "hist.h"
+
+#include <string.h>
+
+/**
+ * @defgroup EMBED_HAS_HISTOGRAM
+ * @{
+ */
+
+uint64 mcached_hist_bucket_low(int index)
+{
+    int e;
+
+    if(index < MCACHED_HIST_SUB)
+        return index;
+
+    e = index / MCACHED_HIST_SUB + MCACHED_HIST_SUB_BITS - 1;
+
+    return (uint64)(index % MCACHED_HIST_SUB + MCACHED_HIST_SUB) << (e - MCACHED_HIST_SUB_BITS);
+}
+
+void mcached_hist_reset(mcached_hist_t *hist)
+{
+    int i;
+
+    for(i = 0; i < MCACHED_HIST_BUCKETS; i++)
+        __atomic_store_n(&hist->buckets[i], 0, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&hist->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->sum, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->max, 0, __ATOMIC_RELAXED);
+}
+
+void mcached_hist_snapshot(mcached_hist_t *hist, mcached_hist_t *out)
+{
+    int i;
+
+    out->count = 0;
+    for(i = 0; i < MCACHED_HIST_BUCKETS; i++)
+    {
+        out->buckets[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        out->count += out->buckets[i];
+    }
+
+    out->sum = __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+    out->max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+}
+
+uint64 mcached_hist_percentile(const mcached_hist_t *snap, double pct)
+{
+    uint64 rank, seen = 0;
+    int i;
+
+    if(snap->count == 0)
+        return 0;
+
+    rank = (uint64)(pct / 100.0 * snap->count + 0.5);
+    if(rank == 0)
+        rank = 1;
+    if(rank > snap->count)
+        rank = snap->count;
+
+    for(i = 0; i < MCACHED_HIST_BUCKETS; i++)
+    {
+        seen += snap->buckets[i];
+        if(seen >= rank)
+        {
+            uint64 high = i + 1 < MCACHED_HIST_BUCKETS
+                ? mcached_hist_bucket_low(i + 1) - 1 : ~0ULL;
+
+            return high < snap->max ? high : snap->max;
+        }
+    }
+
+    return snap->max;
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,77 @@
+#ifndef _MCACHED_HIST_H_
+#define _MCACHED_HIST_H_
+
+#include "type.h"
+
+/**
+ * @defgroup EMBED_HAS_HISTOGRAM
+ * @{
+ */
+
+/**
+ * Log-linear (HDR style) histogram of 64-bit values, e.g. nanoseconds.
+ *
+ * Values below MCACHED_HIST_SUB get a bucket each; above that every power
+ * of two is split into MCACHED_HIST_SUB linear buckets, so any recorded
+ * value is known to within 1/MCACHED_HIST_SUB (~6%) over the full range.
+ * Recording is a relaxed atomic add, so any number of threads can record
+ * while another one takes a snapshot or resets it.
+ */
+
+#define MCACHED_HIST_SUB_BITS  4
+#define MCACHED_HIST_SUB       (1 << MCACHED_HIST_SUB_BITS)
+#define MCACHED_HIST_BUCKETS   ((64 - MCACHED_HIST_SUB_BITS + 1) * MCACHED_HIST_SUB)
+
+typedef struct
+{
+    uint64 count;
+    uint64 sum;
+    uint64 max;
+    uint64 buckets[MCACHED_HIST_BUCKETS];
+}mcached_hist_t;
+
+static inline int mcached_hist_index(uint64 v)
+{
+    int e;
+
+    if(v < MCACHED_HIST_SUB)
+        return (int)v;
+
+    e = 63 - __builtin_clzll(v);
+
+    return (e - MCACHED_HIST_SUB_BITS + 1) * MCACHED_HIST_SUB
+        + (int)((v >> (e - MCACHED_HIST_SUB_BITS)) - MCACHED_HIST_SUB);
+}
+
+static inline void mcached_hist_record(mcached_hist_t *hist, uint64 v)
+{
+    uint64 max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&hist->buckets[mcached_hist_index(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, v, __ATOMIC_RELAXED);
+
+    while(v > max && !__atomic_compare_exchange_n(&hist->max, &max, v,
+                true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*Smallest value that lands in bucket index*/
+uint64 mcached_hist_bucket_low(int index);
+
+void mcached_hist_reset(mcached_hist_t *hist);
+
+/*
+ * Copy hist into out. count is recomputed from the copied buckets, so a
+ * snapshot taken while others record or reset is still self-consistent.
+ */
+void mcached_hist_snapshot(mcached_hist_t *hist, mcached_hist_t *out);
+
+/*Value at percentile pct (0-100) of a snapshot, the bucket's upper end*/
+uint64 mcached_hist_percentile(const mcached_hist_t *snap, double pct);
+
+/**
+ * @}
+ */
+
+#endif
@@ -0,0 +1,313 @@
+#include "mcachedcompact.h"
+#include "embed_assert.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static inline void
+compact_list_init(mcached_compact_queue_t *queue, uint32 i)
+{
+    queue->next[i] = queue->prev[i] = i;
+}
+
+static inline embed_bool_t
+compact_list_empty(mcached_compact_queue_t *queue, uint32 head)
+{
+    return queue->next[head] == head;
+}
+
+static inline void
+compact_list_add_tail(mcached_compact_queue_t *queue, uint32 i, uint32 head)
+{
+    uint32 tail = queue->prev[head];
+
+    queue->next[i] = head;
+    queue->prev[i] = tail;
+    queue->next[tail] = i;
+    queue->prev[head] = i;
+}
+
+/*Unlink and self-link, like list_del_init*/
+static inline void
+compact_list_del_init(mcached_compact_queue_t *queue, uint32 i)
+{
+    queue->next[queue->prev[i]] = queue->next[i];
+    queue->prev[queue->next[i]] = queue->prev[i];
+    compact_list_init(queue, i);
+}
+
+/*Is item the start of a carved slot*/
+static inline embed_bool_t
+compact_valid_item(mcached_compact_queue_t *queue, void *item)
+{
+    char *p = (char *)item;
+
+    return p >= queue->mem_cached
+        && p < queue->mem_cached + (size_t)queue->item_stride * queue->used_item_cnt
+        && (p - queue->mem_cached) % queue->item_stride == 0;
+}
+
+int
+mcached_compact_queue_init(mcached_compact_queue_t *queue, int item_size, int item_cnt,
+        int meta_size)
+{
+    pthread_mutexattr_t mlattr;
+    uint32 links;
+
+    EMBED_ASSERT_RETURN(queue != NULL && item_size > 0 && meta_size >= 0, EMBED_FAILD);
+    /*the two list heads and the self links must stay apart from slot numbers*/
+    EMBED_ASSERT_RETURN(item_cnt > 0 && item_cnt < 0x7ffffffe, EMBED_FAILD);
+
+    memset(queue, 0, sizeof(*queue));
+
+    queue->item_size = item_size;
+    queue->item_stride = EMBED_ALIGN_UP(item_size, (int)sizeof(void *));
+    queue->max_item_cnt = item_cnt;
+    queue->used_head = item_cnt;
+    queue->idle_head = item_cnt + 1;
+    queue->meta_size = meta_size;
+    links = item_cnt + 2;
+
+    /*slots are carved lazily, so only the pages in use are ever touched*/
+    queue->mem_cached = (char *)malloc((size_t)queue->item_stride * item_cnt);
+    queue->next = (uint32 *)malloc(links * sizeof(uint32));
+    queue->prev = (uint32 *)malloc(links * sizeof(uint32));
+    if(meta_size)
+        queue->meta = (char *)malloc((size_t)meta_size * item_cnt);
+    if(queue->mem_cached == NULL || queue->next == NULL || queue->prev == NULL
+            || (meta_size && queue->meta == NULL))
+        goto err_mem;
+
+    compact_list_init(queue, queue->used_head);
+    compact_list_init(queue, queue->idle_head);
+
+    if(pthread_mutexattr_init(&mlattr) != 0)
+        goto err_mem;
+    pthread_mutexattr_settype(&mlattr, PTHREAD_MUTEX_RECURSIVE);
+    if(pthread_mutex_init(&queue->mlock, &mlattr) != 0)
+    {
+        pthread_mutexattr_destroy(&mlattr);
+        goto err_mem;
+    }
+    pthread_mutexattr_destroy(&mlattr);
+
+    if(embed_ready_event_create(&queue->ready_event) != EMBED_SUCCESS)
+        goto err_lock;
+
+    return EMBED_SUCCESS;
+
+err_lock:
+    pthread_mutex_destroy(&queue->mlock);
+err_mem:
+    Free(queue->mem_cached);
+    Free(queue->next);
+    Free(queue->prev);
+    Free(queue->meta);
+    return EMBED_FAILD;
+}
+
+int
+mcached_compact_queue_destroy(mcached_compact_queue_t *queue)
+{
+    EMBED_ASSERT_RETURN(queue != NULL, EMBED_FAILD);
+
+    embed_ready_event_destroy(queue->ready_event);
+    pthread_mutex_destroy(&queue->mlock);
+
+    Free(queue->mem_cached);
+    Free(queue->next);
+    Free(queue->prev);
+    Free(queue->meta);
+    queue->max_item_cnt = 0;
+    queue->used_item_cnt = 0;
+
+    return EMBED_SUCCESS;
+}
+
+int
+mcached_compact_queue_get_idle_item(mcached_compact_queue_t *queue, void **item)
+{
+    int status = EMBED_SUCCESS;
+    uint32 slot;
+
+    EMBED_ASSERT_RETURN(queue != NULL && item != NULL, EMBED_FAILD);
+
+    pthread_mutex_lock(&queue->mlock);
+    if(!compact_list_empty(queue, queue->idle_head))
+    {
+        slot = queue->next[queue->idle_head];
+        compact_list_del_init(queue, slot);
+        *item = MCACHED_COMPACT_ITEM(queue, slot);
+    }
+    else if(queue->used_item_cnt < queue->max_item_cnt)
+    {
+        slot = queue->used_item_cnt++;
+        compact_list_init(queue, slot);
+        *item = MCACHED_COMPACT_ITEM(queue, slot);
+    }
+    else
+    {
+        status = EMBED_FAILD;
+    }
+    pthread_mutex_unlock(&queue->mlock);
+
+    return status;
+}
+
+int
+mcached_compact_queue_add(mcached_compact_queue_t *queue, void *new_item)
+{
+    EMBED_ASSERT_RETURN(queue != NULL && new_item != NULL, EMBED_FAILD);
+
+    if(!compact_valid_item(queue, new_item))
+        return EMBED_FAILD;
+
+    pthread_mutex_lock(&queue->mlock);
+    compact_list_add_tail(queue, MCACHED_COMPACT_SLOT(queue, new_item), queue->used_head);
+    queue->queued_cnt++;
+    pthread_mutex_unlock(&queue->mlock);
+
+    embed_ready_event_active(queue->ready_event);
+
+    return EMBED_SUCCESS;
+}
+
+void
+mcached_compact_queue_del(mcached_compact_queue_t *queue, void *del_item)
+{
+    uint32 slot;
+
+    if(!compact_valid_item(queue, del_item))
+        return;
+
+    slot = MCACHED_COMPACT_SLOT(queue, del_item);
+
+    pthread_mutex_lock(&queue->mlock);
+    /*popped and idle items are self linked*/
+    if(!compact_list_empty(queue, slot))
+    {
+        compact_list_del_init(queue, slot);
+        queue->queued_cnt--;
+    }
+    compact_list_add_tail(queue, slot, queue->idle_head);
+    pthread_mutex_unlock(&queue->mlock);
+}
+
+static embed_bool_t
+compact_queue_take_head(void *compact_queue, void *item)
+{
+    mcached_compact_queue_t *queue = (mcached_compact_queue_t *)compact_queue;
+    uint32 slot = queue->used_head;
+
+    pthread_mutex_lock(&queue->mlock);
+    if(!compact_list_empty(queue, queue->used_head))
+    {
+        slot = queue->next[queue->used_head];
+        compact_list_del_init(queue, slot);
+        queue->queued_cnt--;
+    }
+    pthread_mutex_unlock(&queue->mlock);
+
+    if(slot == queue->used_head)
+        return false;
+
+    *(void **)item = MCACHED_COMPACT_ITEM(queue, slot);
+
+    return true;
+}
+
+int
+mcached_compact_queue_pop(mcached_compact_queue_t *queue, void **item)
+{
+    EMBED_ASSERT_RETURN(queue != NULL && item != NULL, EMBED_FAILD);
+
+    return embed_ready_event_pop(queue->ready_event, compact_queue_take_head, queue, item, NULL, NULL);
+}
+
+int
+mcached_compact_queue_trypop(mcached_compact_queue_t *queue, void **item)
+{
+    EMBED_ASSERT_RETURN(queue != NULL && item != NULL, EMBED_FAILD);
+
+    return embed_ready_event_trypop(queue->ready_event, compact_queue_take_head, queue, item);
+}
+
+int
+mcached_compact_queue_timedpop(mcached_compact_queue_t *queue, void **item,
+        const struct timespec *deadline)
+{
+    EMBED_ASSERT_RETURN(queue != NULL && item != NULL && deadline != NULL, EMBED_FAILD);
+
+    return embed_ready_event_pop(queue->ready_event, compact_queue_take_head, queue, item, deadline, NULL);
+}
+
+int
+mcached_compact_queue_pop_batch(mcached_compact_queue_t *queue, int cnt, void **items)
+{
+    uint32 slot, last = queue->used_head;
+    int n = 0, i;
+
+    EMBED_ASSERT_RETURN(queue != NULL && items != NULL, 0);
+
+    pthread_mutex_lock(&queue->mlock);
+    for(slot = queue->next[queue->used_head]; n < cnt && slot != queue->used_head; slot = queue->next[slot])
+    {
+        items[n++] = MCACHED_COMPACT_ITEM(queue, slot);
+        last = slot;
+    }
+
+    if(n > 0)
+    {
+        /*cut the run off in one step, then self-link what was taken*/
+        queue->next[queue->used_head] = queue->next[last];
+        queue->prev[queue->next[last]] = queue->used_head;
+        queue->queued_cnt -= n;
+        for(i = 0; i < n; i++)
+            compact_list_init(queue, MCACHED_COMPACT_SLOT(queue, items[i]));
+    }
+    pthread_mutex_unlock(&queue->mlock);
+
+    for(i = 0; i < n; i++)
+        embed_ready_event_trywait(queue->ready_event);
+
+    return n;
+}
+
+void
+mcached_compact_queue_traverse(mcached_compact_queue_t *queue, compact_traverse_item_cb item_handler)
+{
+    uint32 pos, n;
+
+    pthread_mutex_lock(&queue->mlock);
+    for(pos = queue->next[queue->used_head], n = queue->next[pos];
+            pos != queue->used_head;
+            pos = n, n = queue->next[pos])
+    {
+        item_handler(queue, MCACHED_COMPACT_ITEM(queue, pos));
+    }
+    pthread_mutex_unlock(&queue->mlock);
+}
+
+int
+mcached_compact_queue_find(mcached_compact_queue_t *queue, void *find_index,
+        compact_find_compared_cb compared, void **find_item)
+{
+    int status = EMBED_FAILD;
+    uint32 pos;
+
+    EMBED_ASSERT_RETURN(queue != NULL && compared != NULL && find_item != NULL, EMBED_FAILD);
+
+    pthread_mutex_lock(&queue->mlock);
+    for(pos = queue->next[queue->used_head]; pos != queue->used_head; pos = queue->next[pos])
+    {
+        if(compared(queue, MCACHED_COMPACT_ITEM(queue, pos), find_index))
+        {
+            *find_item = MCACHED_COMPACT_ITEM(queue, pos);
+            status = EMBED_SUCCESS;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&queue->mlock);
+
+    return status;
+}
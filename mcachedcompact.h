@@ -0,0 +1,104 @@
+#ifndef __MCACHEDCOMPACT_H_
+#define __MCACHEDCOMPACT_H_
+
+#include "type.h"
+#include "event.h"
+
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * A queue whose items carry no links.
+ *
+ * mcached_queue_t embeds a 16-byte list_head in every slot. Here the slots
+ * hold payload only, and the FIFO and idle lists are 32-bit slot numbers
+ * in next[] and prev[], two dense arrays beside the slab. That is 8 bytes
+ * of links per item, and a walk reads next[] 16 entries per cache line
+ * instead of loading one payload line per step. Optional per-slot metadata
+ * (meta_size bytes, e.g. a key or an expiry stamp) sits in a third array,
+ * so scans that only look at metadata never touch the payloads.
+ *
+ * Items are payload pointers (void *); MCACHED_COMPACT_SLOT turns one into
+ * its slot number. The lock, ready event and token contract are those of
+ * mcached_queue_t.
+ */
+
+typedef struct
+{
+    char   *mem_cached;
+    int    item_size;
+    int    item_stride;
+    int    max_item_cnt;
+    int    used_item_cnt;
+
+    /*
+     * Links of slot i are next[i] and prev[i]. Index max_item_cnt is the
+     * used list head and max_item_cnt + 1 the idle list head; a slot that
+     * is on neither list links to itself.
+     */
+    uint32 *next;
+    uint32 *prev;
+    uint32 used_head;
+    uint32 idle_head;
+    uint32 queued_cnt;
+
+    char   *meta;
+    int    meta_size;
+
+    pthread_mutex_t mlock;
+
+    embed_ready_event_t *ready_event;
+}mcached_compact_queue_t;
+
+typedef void (*compact_traverse_item_cb)(mcached_compact_queue_t *queue, void *item);
+typedef bool (*compact_find_compared_cb)(mcached_compact_queue_t *queue, void *item, void *find_item);
+
+int
+mcached_compact_queue_init(mcached_compact_queue_t *queue, int item_size, int item_cnt,
+        int meta_size);
+
+int
+mcached_compact_queue_destroy(mcached_compact_queue_t *queue);
+
+int
+mcached_compact_queue_get_idle_item(mcached_compact_queue_t *queue, void **item);
+
+int
+mcached_compact_queue_add(mcached_compact_queue_t *queue, void *new_item);
+
+/*Give item back to the idle list, unlinking it first if still queued*/
+void
+mcached_compact_queue_del(mcached_compact_queue_t *queue, void *del_item);
+
+int
+mcached_compact_queue_pop(mcached_compact_queue_t *queue, void **item);
+
+int
+mcached_compact_queue_trypop(mcached_compact_queue_t *queue, void **item);
+
+int
+mcached_compact_queue_timedpop(mcached_compact_queue_t *queue, void **item,
+        const struct timespec *deadline);
+
+/*Up to cnt items from the head into items[], returns how many*/
+int
+mcached_compact_queue_pop_batch(mcached_compact_queue_t *queue, int cnt, void **items);
+
+void
+mcached_compact_queue_traverse(mcached_compact_queue_t *queue, compact_traverse_item_cb item_handler);
+
+int
+mcached_compact_queue_find(mcached_compact_queue_t *queue, void *find_index,
+        compact_find_compared_cb compared, void **find_item);
+
+#define MCACHED_COMPACT_ITEM(queue, slot) \
+    ((void *)((queue)->mem_cached + (size_t)(slot) * (queue)->item_stride))
+
+#define MCACHED_COMPACT_SLOT(queue, item) \
+    ((uint32)(((char *)(item) - (queue)->mem_cached) / (queue)->item_stride))
+
+/*meta_size bytes of per-slot metadata, NULL without meta_size*/
+#define MCACHED_COMPACT_META(queue, slot) \
+    ((queue)->meta ? (void *)((queue)->meta + (size_t)(slot) * (queue)->meta_size) : NULL)
+
+#endif
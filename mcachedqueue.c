@@ -0,0 +1,3111 @@
+#define _GNU_SOURCE
+#include "mcachedqueue.h"
+#include "embed_assert.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#if MCACHED_QUEUE_KEY_SIMD && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*from numaif.h, which only ships with libnuma*/
+#define MCACHED_QUEUE_MPOL_BIND     2
+
+void
+mcached_queue_attr_init(mcached_queue_attr_t *attr)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->mode = MCACHED_QUEUE_MODE_LIST;
+}
+
+static int
+mcached_queue_init_lock(mcached_queue_t *queue)
+{
+    queue->mlattr = &queue->_mlattr;
+    if(pthread_mutexattr_init(queue->mlattr) != 0)
+        return EMBED_FAILD;
+
+    /*traverse callbacks are allowed to del the item they are given*/
+    pthread_mutexattr_settype(queue->mlattr, PTHREAD_MUTEX_RECURSIVE);
+
+    queue->mlock = &queue->_mlock;
+    if(pthread_mutex_init(queue->mlock, queue->mlattr) != 0)
+    {
+        pthread_mutexattr_destroy(queue->mlattr);
+        return EMBED_FAILD;
+    }
+
+    return EMBED_SUCCESS;
+}
+
+static int
+mcached_queue_init_rings(mcached_queue_t *queue)
+{
+    if(queue->mode == MCACHED_QUEUE_MODE_SPSC)
+    {
+        if(mcached_spsc_ring_create(&queue->used_spsc, queue->max_item_cnt) != EMBED_SUCCESS)
+            return EMBED_FAILD;
+
+        if(mcached_spsc_ring_create(&queue->idle_spsc, queue->max_item_cnt) != EMBED_SUCCESS)
+        {
+            mcached_spsc_ring_destroy(queue->used_spsc);
+            queue->used_spsc = NULL;
+            return EMBED_FAILD;
+        }
+
+        return EMBED_SUCCESS;
+    }
+
+    if(mcached_ring_create(&queue->used_ring, queue->max_item_cnt) != EMBED_SUCCESS)
+        return EMBED_FAILD;
+
+    if(mcached_ring_create(&queue->idle_ring, queue->max_item_cnt) != EMBED_SUCCESS)
+    {
+        mcached_ring_destroy(queue->used_ring);
+        queue->used_ring = NULL;
+        return EMBED_FAILD;
+    }
+
+    return EMBED_SUCCESS;
+}
+
+static void
+mcached_queue_destroy_rings(mcached_queue_t *queue)
+{
+    if(queue->used_ring)
+        mcached_ring_destroy(queue->used_ring);
+    if(queue->idle_ring)
+        mcached_ring_destroy(queue->idle_ring);
+    if(queue->used_spsc)
+        mcached_spsc_ring_destroy(queue->used_spsc);
+    if(queue->idle_spsc)
+        mcached_spsc_ring_destroy(queue->idle_spsc);
+
+    queue->used_ring = queue->idle_ring = NULL;
+    queue->used_spsc = queue->idle_spsc = NULL;
+}
+
+/*CLOCK_MONOTONIC in ns, for the stats and the residency stamps alike*/
+static inline uint64
+mcached_queue_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if MCACHED_QUEUE_STATS
+/*Owner-only update that other threads may read at any time*/
+#define MCACHED_QUEUE_STAT_BUMP(counter, n) \
+    __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+#define MCACHED_QUEUE_STAT_ADD(queue, field, n) \
+do \
+{\
+    mcached_queue_thread_stats_t *_ts = mcached_queue_thread_stats(queue);\
+    if(_ts)\
+        MCACHED_QUEUE_STAT_BUMP(_ts->c.field, n);\
+}while(0)
+
+static void
+mcached_queue_stats_sum(mcached_queue_stats_t *sum, mcached_queue_stats_t *c)
+{
+    sum->enqueue += __atomic_load_n(&c->enqueue, __ATOMIC_RELAXED);
+    sum->dequeue += __atomic_load_n(&c->dequeue, __ATOMIC_RELAXED);
+    sum->full += __atomic_load_n(&c->full, __ATOMIC_RELAXED);
+    sum->empty += __atomic_load_n(&c->empty, __ATOMIC_RELAXED);
+    sum->blocked_pops += __atomic_load_n(&c->blocked_pops, __ATOMIC_RELAXED);
+    sum->lock_acquired += __atomic_load_n(&c->lock_acquired, __ATOMIC_RELAXED);
+    sum->lock_contended += __atomic_load_n(&c->lock_contended, __ATOMIC_RELAXED);
+    sum->lock_wait_ns += __atomic_load_n(&c->lock_wait_ns, __ATOMIC_RELAXED);
+    sum->lock_hold_ns += __atomic_load_n(&c->lock_hold_ns, __ATOMIC_RELAXED);
+}
+
+/*Thread exit: fold the counters into stats_retired and drop the block*/
+static void
+mcached_queue_stats_release(void *arg)
+{
+    mcached_queue_thread_stats_t *ts = (mcached_queue_thread_stats_t *)arg;
+    mcached_queue_t *queue = (mcached_queue_t *)ts->queue;
+
+    pthread_mutex_lock(queue->mlock);
+    mcached_queue_stats_sum(&queue->stats_retired, &ts->c);
+    list_del(&ts->node);
+    pthread_mutex_unlock(queue->mlock);
+
+    Free(ts);
+}
+
+static void
+mcached_queue_init_stats(mcached_queue_t *queue)
+{
+    INIT_LIST_HEAD(&queue->stats_threads);
+
+    /*out of keys only costs the statistics, not the queue*/
+    queue->stats_enabled = pthread_key_create(&queue->stats_key, mcached_queue_stats_release) == 0;
+}
+
+static void
+mcached_queue_destroy_stats(mcached_queue_t *queue)
+{
+    mcached_queue_thread_stats_t *ts, *n;
+
+    if(!queue->stats_enabled)
+        return;
+
+    pthread_key_delete(queue->stats_key);
+
+    list_for_each_entry_safe(ts, n, &queue->stats_threads, node)
+    {
+        list_del(&ts->node);
+        Free(ts);
+    }
+
+    queue->stats_enabled = 0;
+}
+
+/*Calling thread's counters, created on first use*/
+static mcached_queue_thread_stats_t *
+mcached_queue_thread_stats(mcached_queue_t *queue)
+{
+    mcached_queue_thread_stats_t *ts;
+
+    if(!queue->stats_enabled)
+        return NULL;
+
+    ts = (mcached_queue_thread_stats_t *)pthread_getspecific(queue->stats_key);
+    if(ts)
+        return ts;
+
+    if(posix_memalign((void **)&ts, EMBED_CACHE_LINE_SIZE, sizeof(*ts)) != 0)
+        return NULL;
+
+    memset(ts, 0, sizeof(*ts));
+    ts->queue = queue;
+
+    if(pthread_setspecific(queue->stats_key, ts) != 0)
+    {
+        Free(ts);
+        return NULL;
+    }
+
+    /*raw lock, MCACHED_QUEUE_LOCK would come back here*/
+    pthread_mutex_lock(queue->mlock);
+    list_add_tail(&ts->node, &queue->stats_threads);
+    pthread_mutex_unlock(queue->mlock);
+
+    return ts;
+}
+
+void
+mcached_queue_stats_lock(mcached_queue_t *queue)
+{
+    mcached_queue_thread_stats_t *ts = mcached_queue_thread_stats(queue);
+    uint64 start;
+
+    if(ts == NULL)
+    {
+        pthread_mutex_lock(queue->mlock);
+        return;
+    }
+
+    /*only a contended acquisition pays for reading the clock*/
+    if(pthread_mutex_trylock(queue->mlock) != 0)
+    {
+        start = mcached_queue_now_ns();
+        pthread_mutex_lock(queue->mlock);
+        MCACHED_QUEUE_STAT_BUMP(ts->c.lock_wait_ns, mcached_queue_now_ns() - start);
+        MCACHED_QUEUE_STAT_BUMP(ts->c.lock_contended, 1);
+    }
+
+    /*mlock is recursive, only the outermost acquisition counts*/
+    if(ts->lock_depth++ > 0)
+        return;
+
+    MCACHED_QUEUE_STAT_BUMP(ts->c.lock_acquired, 1);
+    ts->hold_start = ts->c.lock_acquired % MCACHED_QUEUE_STATS_HOLD_SAMPLE == 0
+        ? mcached_queue_now_ns() : 0;
+}
+
+void
+mcached_queue_stats_unlock(mcached_queue_t *queue)
+{
+    mcached_queue_thread_stats_t *ts = queue->stats_enabled
+        ? (mcached_queue_thread_stats_t *)pthread_getspecific(queue->stats_key) : NULL;
+
+    if(ts && ts->lock_depth > 0 && --ts->lock_depth == 0 && ts->hold_start)
+    {
+        MCACHED_QUEUE_STAT_BUMP(ts->c.lock_hold_ns,
+                (mcached_queue_now_ns() - ts->hold_start) * MCACHED_QUEUE_STATS_HOLD_SAMPLE);
+        ts->hold_start = 0;
+    }
+
+    pthread_mutex_unlock(queue->mlock);
+}
+#else
+#define MCACHED_QUEUE_STAT_ADD(queue, field, n) do {} while(0)
+#endif
+
+int
+mcached_queue_get_stats(mcached_queue_t *queue, mcached_queue_stats_t *stats)
+{
+#if MCACHED_QUEUE_STATS
+    mcached_queue_thread_stats_t *ts;
+
+    EMBED_ASSERT_RETURN(queue != NULL && stats != NULL, EMBED_FAILD);
+
+    memset(stats, 0, sizeof(*stats));
+
+    if(!queue->stats_enabled)
+        return EMBED_FAILD;
+
+    pthread_mutex_lock(queue->mlock);
+    mcached_queue_stats_sum(stats, &queue->stats_retired);
+    list_for_each_entry(ts, &queue->stats_threads, node)
+    {
+        mcached_queue_stats_sum(stats, &ts->c);
+        stats->threads++;
+    }
+    pthread_mutex_unlock(queue->mlock);
+
+    stats->queued = stats->enqueue > stats->dequeue ? stats->enqueue - stats->dequeue : 0;
+    stats->used_item_hwm = __atomic_load_n(&queue->used_item_cnt, __ATOMIC_RELAXED);
+    stats->max_item_cnt = queue->max_item_cnt;
+
+    return EMBED_SUCCESS;
+#else
+    (void)queue;
+    (void)stats;
+
+    return EMBED_FAILD;
+#endif
+}
+
+/*Thread exit: drop the reader record, it is outside any read section*/
+static void
+mcached_queue_reader_release(void *arg)
+{
+    mcached_queue_reader_t *r = (mcached_queue_reader_t *)arg;
+    mcached_queue_t *queue = (mcached_queue_t *)r->queue;
+
+    pthread_mutex_lock(queue->mlock);
+    list_del(&r->node);
+    pthread_mutex_unlock(queue->mlock);
+
+    Free(r);
+}
+
+static int
+mcached_queue_init_epoch(mcached_queue_t *queue)
+{
+    INIT_LIST_HEAD(&queue->epoch_readers);
+
+    queue->limbo_slot = (uint32 *)malloc(queue->slot_cap * sizeof(uint32));
+    queue->limbo_epoch = (uint64 *)malloc(queue->slot_cap * sizeof(uint64));
+    if(queue->limbo_slot == NULL || queue->limbo_epoch == NULL
+            || pthread_key_create(&queue->epoch_key, mcached_queue_reader_release) != 0)
+    {
+        Free(queue->limbo_slot);
+        Free(queue->limbo_epoch);
+        return EMBED_FAILD;
+    }
+
+    queue->epoch = 1;
+    queue->epoch_enabled = 1;
+
+    return EMBED_SUCCESS;
+}
+
+static void
+mcached_queue_destroy_epoch(mcached_queue_t *queue)
+{
+    mcached_queue_reader_t *r, *n;
+
+    if(!queue->epoch_enabled)
+        return;
+
+    pthread_key_delete(queue->epoch_key);
+
+    list_for_each_entry_safe(r, n, &queue->epoch_readers, node)
+    {
+        list_del(&r->node);
+        Free(r);
+    }
+
+    Free(queue->limbo_slot);
+    Free(queue->limbo_epoch);
+    queue->limbo_cnt = 0;
+    queue->epoch_enabled = 0;
+}
+
+/*Calling thread's reader record, created on first use*/
+static mcached_queue_reader_t *
+mcached_queue_reader(mcached_queue_t *queue)
+{
+    mcached_queue_reader_t *r;
+
+    r = (mcached_queue_reader_t *)pthread_getspecific(queue->epoch_key);
+    if(r)
+        return r;
+
+    if(posix_memalign((void **)&r, EMBED_CACHE_LINE_SIZE, sizeof(*r)) != 0)
+        return NULL;
+
+    memset(r, 0, sizeof(*r));
+    r->queue = queue;
+
+    if(pthread_setspecific(queue->epoch_key, r) != 0)
+    {
+        Free(r);
+        return NULL;
+    }
+
+    pthread_mutex_lock(queue->mlock);
+    list_add_tail(&r->node, &queue->epoch_readers);
+    pthread_mutex_unlock(queue->mlock);
+
+    return r;
+}
+
+void
+mcached_queue_read_lock(mcached_queue_t *queue)
+{
+    mcached_queue_reader_t *r;
+
+    if(!queue->epoch_enabled || (r = mcached_queue_reader(queue)) == NULL)
+    {
+        MCACHED_QUEUE_LOCK(queue);
+        return;
+    }
+
+    if(r->depth++ > 0)
+        return;
+
+    /*
+     * Pairs with the fence in the epoch bump of a writer: either it sees
+     * us active, or we see the list as it left it.
+     */
+    __atomic_store_n(&r->active, __atomic_load_n(&queue->epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+mcached_queue_read_unlock(mcached_queue_t *queue)
+{
+    mcached_queue_reader_t *r = queue->epoch_enabled
+        ? (mcached_queue_reader_t *)pthread_getspecific(queue->epoch_key) : NULL;
+
+    if(r == NULL)
+    {
+        MCACHED_QUEUE_UNLOCK(queue);
+        return;
+    }
+
+    if(--r->depth == 0)
+        __atomic_store_n(&r->active, 0, __ATOMIC_RELEASE);
+}
+
+/*Oldest epoch a reader still runs in, (uint64)-1 when none; under mlock*/
+static uint64
+mcached_queue_epoch_oldest(mcached_queue_t *queue)
+{
+    mcached_queue_reader_t *r;
+    uint64 oldest = (uint64)-1, active;
+
+    list_for_each_entry(r, &queue->epoch_readers, node)
+    {
+        active = __atomic_load_n(&r->active, __ATOMIC_ACQUIRE);
+        if(active && active < oldest)
+            oldest = active;
+    }
+
+    return oldest;
+}
+
+/*Wait, without mlock, until no reader that could see the list before now is left*/
+static void
+mcached_queue_epoch_synchronize(mcached_queue_t *queue)
+{
+    uint64 epoch = __atomic_fetch_add(&queue->epoch, 1, __ATOMIC_SEQ_CST);
+    uint64 oldest;
+
+    for(;;)
+    {
+        MCACHED_QUEUE_LOCK(queue);
+        oldest = mcached_queue_epoch_oldest(queue);
+        MCACHED_QUEUE_UNLOCK(queue);
+
+        if(oldest > epoch)
+            return;
+
+        sched_yield();
+    }
+}
+
+/*Thread exit: hand the rounds back to idle_list and drop the magazine*/
+static void
+mcached_queue_magazine_release(void *arg)
+{
+    mcached_queue_magazine_t *mag = (mcached_queue_magazine_t *)arg;
+    mcached_queue_t *queue = (mcached_queue_t *)mag->queue;
+
+    MCACHED_QUEUE_LOCK(queue);
+    while(mag->cnt > 0)
+        list_add(mag->rounds[--mag->cnt], queue->idle_list);
+    list_del(&mag->node);
+    MCACHED_QUEUE_UNLOCK(queue);
+
+    Free(mag);
+}
+
+static int
+mcached_queue_init_magazines(mcached_queue_t *queue, int magazine_size)
+{
+    INIT_LIST_HEAD(&queue->magazines);
+
+    if(pthread_key_create(&queue->magazine_key, mcached_queue_magazine_release) != 0)
+        return EMBED_FAILD;
+
+    queue->magazine_size = magazine_size;
+
+    return EMBED_SUCCESS;
+}
+
+static void
+mcached_queue_destroy_magazines(mcached_queue_t *queue)
+{
+    mcached_queue_magazine_t *mag, *n;
+
+    if(queue->magazine_size == 0)
+        return;
+
+    /*no destructor may run against this queue from now on*/
+    pthread_key_delete(queue->magazine_key);
+
+    list_for_each_entry_safe(mag, n, &queue->magazines, node)
+    {
+        list_del(&mag->node);
+        Free(mag);
+    }
+
+    queue->magazine_size = 0;
+}
+
+/*Map len bytes aligned to a huge page boundary, trimming the slack*/
+static char *
+mcached_queue_slab_map_aligned(size_t len)
+{
+    size_t map_len = len + EMBED_HUGE_PAGE_SIZE;
+    char *p, *start;
+
+    p = (char *)mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+        return NULL;
+
+    start = (char *)EMBED_ALIGN_UP((uintptr_t)p, EMBED_HUGE_PAGE_SIZE);
+    if(start > p)
+        munmap(p, start - p);
+    if(p + map_len > start + len)
+        munmap(start + len, p + map_len - (start + len));
+
+    return start;
+}
+
+static inline char *
+mcached_queue_page_down(char *p)
+{
+    return (char *)((uintptr_t)p & ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1));
+}
+
+static inline char *
+mcached_queue_page_up(char *p)
+{
+    return (char *)EMBED_ALIGN_UP((uintptr_t)p, (uintptr_t)sysconf(_SC_PAGESIZE));
+}
+
+/*Reserve address space for slot_cap slots, commit the first max_item_cnt*/
+static int
+mcached_queue_elastic_reserve(mcached_queue_t *queue, size_t len)
+{
+    char *p, *end;
+    int chunks = (queue->slot_cap + queue->elastic_chunk_cnt - 1) / queue->elastic_chunk_cnt;
+
+    queue->chunk_idle = (int *)calloc(chunks, sizeof(int));
+    queue->chunk_idle_since = (uint64 *)calloc(chunks, sizeof(uint64));
+    if(queue->chunk_idle == NULL || queue->chunk_idle_since == NULL)
+    {
+        Free(queue->chunk_idle);
+        Free(queue->chunk_idle_since);
+        return EMBED_FAILD;
+    }
+
+    len = EMBED_ALIGN_UP(len, (size_t)sysconf(_SC_PAGESIZE));
+    p = (char *)mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(p == MAP_FAILED)
+    {
+        Free(queue->chunk_idle);
+        Free(queue->chunk_idle_since);
+        return EMBED_FAILD;
+    }
+
+    end = mcached_queue_page_up(p + (size_t)queue->item_stride * queue->max_item_cnt);
+    if(mprotect(p, end - p, PROT_READ | PROT_WRITE) != 0)
+    {
+        munmap(p, len);
+        Free(queue->chunk_idle);
+        Free(queue->chunk_idle_since);
+        return EMBED_FAILD;
+    }
+
+    queue->mem_cached = p;
+    queue->slab_size = len;
+
+    return EMBED_SUCCESS;
+}
+
+/*
+ * Bind the whole slab to numa_node. Slots are carved lazily, so no page
+ * has been touched yet and every page faults in on that node. A kernel
+ * built without NUMA has nothing to bind to.
+ */
+static int
+mcached_queue_slab_bind(mcached_queue_t *queue)
+{
+    unsigned long mask[MCACHED_QUEUE_NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+    int bits = 8 * sizeof(unsigned long);
+
+    memset(mask, 0, sizeof(mask));
+    mask[queue->numa_node / bits] = 1UL << (queue->numa_node % bits);
+
+    if(syscall(SYS_mbind, queue->mem_cached,
+                EMBED_ALIGN_UP(queue->slab_size, (size_t)sysconf(_SC_PAGESIZE)),
+                MCACHED_QUEUE_MPOL_BIND, mask, (unsigned long)MCACHED_QUEUE_NUMA_MAX_NODES, 0) != 0
+            && errno != ENOSYS)
+        return EMBED_FAILD;
+
+    return EMBED_SUCCESS;
+}
+
+static int
+mcached_queue_slab_alloc(mcached_queue_t *queue, int slot_align)
+{
+    size_t len = (size_t)queue->item_stride * queue->slot_cap;
+
+    if(queue->elastic_chunk_cnt)
+        return mcached_queue_elastic_reserve(queue, len);
+
+    if(queue->slab_flags & (MCACHED_QUEUE_SLAB_THP | MCACHED_QUEUE_SLAB_HUGETLB))
+    {
+        len = EMBED_ALIGN_UP(len, EMBED_HUGE_PAGE_SIZE);
+
+        if(queue->slab_flags & MCACHED_QUEUE_SLAB_HUGETLB)
+        {
+            queue->mem_cached = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if(queue->mem_cached == MAP_FAILED)
+                queue->mem_cached = NULL;
+        }
+        else
+        {
+            queue->mem_cached = mcached_queue_slab_map_aligned(len);
+            if(queue->mem_cached)
+                madvise(queue->mem_cached, len, MADV_HUGEPAGE);
+        }
+    }
+    else if(queue->slab_flags & MCACHED_QUEUE_SLAB_NUMA)
+    {
+        /*mbind wants whole pages of our own, not a malloc arena*/
+        queue->mem_cached = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(queue->mem_cached == MAP_FAILED)
+            queue->mem_cached = NULL;
+    }
+    else if(slot_align > 0)
+    {
+        if(slot_align < (int)sizeof(void *))
+            slot_align = sizeof(void *);
+        if(posix_memalign((void **)&queue->mem_cached, slot_align, len) != 0)
+            queue->mem_cached = NULL;
+    }
+    else
+    {
+        queue->mem_cached = (char *)malloc(len);
+    }
+
+    if(queue->mem_cached == NULL)
+        return EMBED_FAILD;
+
+    queue->slab_size = len;
+
+    return EMBED_SUCCESS;
+}
+
+/*Open (or create) the persist_path file and map header, next[] and slab*/
+static int
+mcached_queue_persist_open(mcached_queue_t *queue, const mcached_queue_attr_t *attr)
+{
+    mcached_queue_persist_hdr_t *hdr;
+    uint64 page = sysconf(_SC_PAGESIZE);
+    uint64 next_off = page, slab_off, size;
+    struct stat st;
+    char *map;
+    int fd;
+
+    slab_off = EMBED_ALIGN_UP(next_off + (uint64)queue->max_item_cnt * sizeof(uint32), page);
+    size = slab_off + (uint64)queue->item_stride * queue->max_item_cnt;
+
+    fd = open(attr->persist_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(fd < 0)
+        return EMBED_FAILD;
+
+    if(fstat(fd, &st) != 0)
+        goto err_fd;
+    if(st.st_size == 0)
+    {
+        if(ftruncate(fd, size) != 0)
+            goto err_fd;
+    }
+    else if((uint64)st.st_size != size)
+    {
+        goto err_fd;
+    }
+
+    map = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+        goto err_fd;
+
+    hdr = (mcached_queue_persist_hdr_t *)map;
+
+    /*no magic: new, or created by a process that died before finishing*/
+    if(hdr->magic == 0)
+    {
+        hdr->version = MCACHED_QUEUE_PERSIST_VERSION;
+        hdr->item_size = queue->item_size;
+        hdr->item_stride = queue->item_stride;
+        hdr->max_item_cnt = queue->max_item_cnt;
+        hdr->head = hdr->tail = MCACHED_QUEUE_PERSIST_NIL;
+        hdr->next_off = next_off;
+        hdr->slab_off = slab_off;
+        hdr->file_size = size;
+        __atomic_store_n(&hdr->magic, MCACHED_QUEUE_PERSIST_MAGIC, __ATOMIC_RELEASE);
+        msync(map, page, MS_SYNC);
+    }
+    else if(hdr->magic != MCACHED_QUEUE_PERSIST_MAGIC
+            || hdr->version != MCACHED_QUEUE_PERSIST_VERSION
+            || hdr->item_size != (uint32)queue->item_size
+            || hdr->item_stride != (uint32)queue->item_stride
+            || hdr->max_item_cnt != (uint32)queue->max_item_cnt
+            || hdr->next_off != next_off || hdr->slab_off != slab_off)
+    {
+        goto err_map;
+    }
+
+    queue->persist_prev = (uint32 *)malloc(queue->max_item_cnt * sizeof(uint32));
+    if(queue->persist_prev == NULL)
+        goto err_map;
+
+    queue->persist_fd = fd;
+    queue->persist_map = map;
+    queue->persist_size = size;
+    queue->persist_hdr = hdr;
+    queue->persist_next = (uint32 *)(map + next_off);
+    queue->persist_sync = attr->persist_sync;
+    queue->persist_sync_ns = (uint64)attr->persist_sync_ms * 1000000ULL;
+
+    queue->mem_cached = map + slab_off;
+    queue->slab_size = size - slab_off;
+
+    return EMBED_SUCCESS;
+
+err_map:
+    munmap(map, size);
+err_fd:
+    close(fd);
+    return EMBED_FAILD;
+}
+
+static void
+mcached_queue_persist_close(mcached_queue_t *queue)
+{
+    if(queue->persist_sync != MCACHED_QUEUE_SYNC_NONE)
+        msync(queue->persist_map, queue->persist_size, MS_SYNC);
+
+    munmap(queue->persist_map, queue->persist_size);
+    close(queue->persist_fd);
+    Free(queue->persist_prev);
+
+    queue->persist_fd = -1;
+    queue->persist_map = NULL;
+    queue->persist_hdr = NULL;
+    queue->persist_next = NULL;
+    queue->mem_cached = NULL;
+}
+
+static void
+mcached_queue_slab_free(mcached_queue_t *queue)
+{
+    if(queue->mem_cached == NULL)
+        return;
+
+    if(queue->persist_map)
+    {
+        mcached_queue_persist_close(queue);
+    }
+    else if(queue->elastic_chunk_cnt)
+    {
+        munmap(queue->mem_cached, queue->slab_size);
+        queue->mem_cached = NULL;
+        Free(queue->chunk_idle);
+        Free(queue->chunk_idle_since);
+    }
+    else if(queue->slab_flags & (MCACHED_QUEUE_SLAB_THP | MCACHED_QUEUE_SLAB_HUGETLB
+                | MCACHED_QUEUE_SLAB_NUMA))
+    {
+        munmap(queue->mem_cached, queue->slab_size);
+        queue->mem_cached = NULL;
+    }
+    else
+    {
+        Free(queue->mem_cached);
+    }
+
+    queue->slab_size = 0;
+}
+
+static int
+mcached_queue_init_prio(mcached_queue_t *queue, int levels, uint64 age_ns)
+{
+    int i;
+
+    queue->prio_lists = (struct list_head *)malloc(levels * sizeof(struct list_head));
+    queue->item_prio = (uint8 *)malloc(queue->slot_cap * sizeof(uint8));
+    if(age_ns)
+        queue->item_stamp = (uint64 *)malloc(queue->slot_cap * sizeof(uint64));
+
+    if(queue->prio_lists == NULL || queue->item_prio == NULL
+            || (age_ns && queue->item_stamp == NULL))
+    {
+        Free(queue->prio_lists);
+        Free(queue->item_prio);
+        Free(queue->item_stamp);
+        return EMBED_FAILD;
+    }
+
+    for(i = 0; i < levels; i++)
+        INIT_LIST_HEAD(&queue->prio_lists[i]);
+
+    queue->prio_levels = levels;
+    queue->prio_age_ns = age_ns;
+    queue->prio_bitmap = 0;
+
+    return EMBED_SUCCESS;
+}
+
+static void
+mcached_queue_destroy_prio(mcached_queue_t *queue)
+{
+    Free(queue->prio_lists);
+    Free(queue->item_prio);
+    Free(queue->item_stamp);
+    queue->prio_levels = 0;
+    queue->prio_bitmap = 0;
+}
+
+static int
+mcached_queue_init_key_column(mcached_queue_t *queue, item_key64_cb key_column)
+{
+    /*whole bitmap words, so the scans never look at a partial one*/
+    size_t words = (queue->slot_cap + 63) / 64;
+
+    queue->key_col = (uint64 *)calloc(words * 64, sizeof(uint64));
+    queue->key_valid = (uint64 *)calloc(words, sizeof(uint64));
+    if(queue->key_col == NULL || queue->key_valid == NULL)
+    {
+        Free(queue->key_col);
+        Free(queue->key_valid);
+        return EMBED_FAILD;
+    }
+
+    queue->key_column = key_column;
+
+    return EMBED_SUCCESS;
+}
+
+static void
+mcached_queue_destroy_key_column(mcached_queue_t *queue)
+{
+    Free(queue->key_col);
+    Free(queue->key_valid);
+    queue->key_column = NULL;
+}
+
+static inline void
+mcached_queue_key_set(mcached_queue_t *queue, uint32 slot, struct list_head *item)
+{
+    queue->key_col[slot] = queue->key_column(item);
+    queue->key_valid[slot / 64] |= 1ULL << (slot % 64);
+}
+
+static inline void
+mcached_queue_key_clear(mcached_queue_t *queue, uint32 slot)
+{
+    queue->key_valid[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+static int
+mcached_queue_init_residency(mcached_queue_t *queue)
+{
+    queue->residency = (mcached_hist_t *)calloc(1, sizeof(mcached_hist_t));
+    queue->item_add_ns = (uint64 *)calloc(queue->slot_cap, sizeof(uint64));
+    if(queue->residency == NULL || queue->item_add_ns == NULL)
+    {
+        Free(queue->residency);
+        Free(queue->item_add_ns);
+        return EMBED_FAILD;
+    }
+
+    return EMBED_SUCCESS;
+}
+
+static void
+mcached_queue_destroy_residency(mcached_queue_t *queue)
+{
+    Free(queue->residency);
+    Free(queue->item_add_ns);
+}
+
+static int
+mcached_queue_persist_recover(mcached_queue_t *queue);
+
+int
+mcached_queue_init(mcached_queue_t *queue, int item_size, int item_cnt)
+{
+    return mcached_queue_init_ex(queue, item_size, item_cnt, NULL);
+}
+
+int
+mcached_queue_init_ex(mcached_queue_t *queue, int item_size, int item_cnt,
+        const mcached_queue_attr_t *attr)
+{
+    mcached_queue_attr_t def_attr;
+
+    EMBED_ASSERT_RETURN(queue != NULL, EMBED_FAILD);
+    EMBED_ASSERT_RETURN(item_size >= (int)sizeof(struct list_head) && item_cnt > 0, EMBED_FAILD);
+
+    if(attr == NULL)
+    {
+        mcached_queue_attr_init(&def_attr);
+        attr = &def_attr;
+    }
+
+    EMBED_ASSERT_RETURN(attr->magazine_size >= 0 && attr->slot_pad >= 0, EMBED_FAILD);
+    if((attr->index_key || attr->index_hash || attr->index_compare)
+            && (!attr->index_key || !attr->index_hash || !attr->index_compare
+                || attr->mode != MCACHED_QUEUE_MODE_LIST))
+        return EMBED_FAILD;
+    EMBED_ASSERT_RETURN(attr->slot_align >= 0
+            && (attr->slot_align & (attr->slot_align - 1)) == 0, EMBED_FAILD);
+    if(attr->magazine_size > 0 && attr->mode != MCACHED_QUEUE_MODE_LIST)
+        return EMBED_FAILD;
+    EMBED_ASSERT_RETURN(attr->prio_levels >= 0 && attr->prio_levels <= MCACHED_QUEUE_MAX_PRIO, EMBED_FAILD);
+    if(attr->prio_levels > 1 && attr->mode != MCACHED_QUEUE_MODE_LIST)
+        return EMBED_FAILD;
+    if(attr->persist_path && (attr->mode != MCACHED_QUEUE_MODE_LIST || attr->prio_levels > 1
+                || (attr->slab_flags & (MCACHED_QUEUE_SLAB_THP | MCACHED_QUEUE_SLAB_HUGETLB
+                        | MCACHED_QUEUE_SLAB_NUMA))))
+        return EMBED_FAILD;
+    if(attr->key_column && attr->mode != MCACHED_QUEUE_MODE_LIST)
+        return EMBED_FAILD;
+    if(attr->lockless_read && (attr->mode != MCACHED_QUEUE_MODE_LIST || attr->prio_levels > 1
+                || attr->magazine_size > 0))
+        return EMBED_FAILD;
+    if((attr->slab_flags & MCACHED_QUEUE_SLAB_NUMA)
+            && (attr->numa_node < 0 || attr->numa_node >= MCACHED_QUEUE_NUMA_MAX_NODES - 1))
+        return EMBED_FAILD;
+    EMBED_ASSERT_RETURN(attr->elastic_chunk_cnt >= 0, EMBED_FAILD);
+    if(attr->elastic_max_cnt > item_cnt && (attr->mode != MCACHED_QUEUE_MODE_LIST
+                || attr->magazine_size > 0 || attr->persist_path
+                || (attr->slab_flags & (MCACHED_QUEUE_SLAB_THP | MCACHED_QUEUE_SLAB_HUGETLB))))
+        return EMBED_FAILD;
+
+    memset(queue, 0, sizeof(*queue));
+    queue->event_fd = -1;
+    queue->persist_fd = -1;
+
+    INIT_LIST_HEAD(&queue->_idle_list);
+    INIT_LIST_HEAD(&queue->_used_list);
+    queue->idle_list = &queue->_idle_list;
+    queue->used_list = &queue->_used_list;
+
+    queue->item_size = item_size;
+    queue->item_stride = item_size + attr->slot_pad;
+    if(attr->slot_align > 0)
+        queue->item_stride = EMBED_ALIGN_UP(queue->item_stride, attr->slot_align);
+    queue->max_item_cnt = item_cnt;
+    queue->used_item_cnt = 0;
+    queue->slot_cap = item_cnt;
+    queue->mode = attr->mode;
+    queue->slab_flags = attr->slab_flags;
+    queue->numa_node = attr->numa_node;
+
+    if(attr->elastic_max_cnt > item_cnt)
+    {
+        queue->slot_cap = attr->elastic_max_cnt;
+        queue->elastic_min_cnt = item_cnt;
+        queue->elastic_chunk_cnt = attr->elastic_chunk_cnt ? attr->elastic_chunk_cnt : item_cnt;
+        queue->elastic_idle_ns = (uint64)attr->elastic_idle_ms * 1000000ULL;
+    }
+
+    /*slots are carved lazily by get_idle_item, see used_item_cnt*/
+    if((attr->persist_path ? mcached_queue_persist_open(queue, attr)
+                : mcached_queue_slab_alloc(queue, attr->slot_align)) != EMBED_SUCCESS)
+        return EMBED_FAILD;
+
+    if((queue->slab_flags & MCACHED_QUEUE_SLAB_NUMA) && mcached_queue_slab_bind(queue) != EMBED_SUCCESS)
+        goto err_mem;
+
+    if(mcached_queue_init_lock(queue) != EMBED_SUCCESS)
+        goto err_mem;
+
+    if(queue->mode != MCACHED_QUEUE_MODE_LIST
+            && mcached_queue_init_rings(queue) != EMBED_SUCCESS)
+        goto err_lock;
+
+    if(queue->mode == MCACHED_QUEUE_MODE_LIST)
+    {
+        queue->item_taken = (uint64 *)calloc((queue->slot_cap + 63) / 64, sizeof(uint64));
+        if(queue->item_taken == NULL)
+            goto err_rings;
+    }
+
+    if(attr->magazine_size > 0
+            && mcached_queue_init_magazines(queue, attr->magazine_size) != EMBED_SUCCESS)
+        goto err_rings;
+
+    if(attr->index_key)
+    {
+        if(mcached_hindex_create(&queue->index, queue->slot_cap) != EMBED_SUCCESS)
+            goto err_magazines;
+
+        queue->index_key = attr->index_key;
+        queue->index_hash = attr->index_hash;
+        queue->index_compare = attr->index_compare;
+    }
+
+    if(attr->key_column
+            && mcached_queue_init_key_column(queue, attr->key_column) != EMBED_SUCCESS)
+        goto err_index;
+
+    if(attr->prio_levels > 1
+            && mcached_queue_init_prio(queue, attr->prio_levels, attr->prio_age_ns) != EMBED_SUCCESS)
+        goto err_keys;
+
+    if(attr->residency_hist
+            && mcached_queue_init_residency(queue) != EMBED_SUCCESS)
+        goto err_prio;
+
+    if(attr->lockless_read
+            && mcached_queue_init_epoch(queue) != EMBED_SUCCESS)
+        goto err_residency;
+
+    if(attr->eventfd_mode != MCACHED_QUEUE_EVENTFD_NONE)
+    {
+        int flags = EFD_NONBLOCK | EFD_CLOEXEC;
+
+        if(attr->eventfd_mode == MCACHED_QUEUE_EVENTFD_SEMAPHORE)
+            flags |= EFD_SEMAPHORE;
+
+        queue->event_fd = eventfd(0, flags);
+        if(queue->event_fd < 0)
+            goto err_epoch;
+        queue->event_fd_mode = attr->eventfd_mode;
+    }
+
+    if(embed_ready_event_create(&queue->ready_event) != EMBED_SUCCESS)
+        goto err_eventfd;
+
+    if(queue->persist_hdr && mcached_queue_persist_recover(queue) != EMBED_SUCCESS)
+        goto err_ready;
+
+#if MCACHED_QUEUE_STATS
+    mcached_queue_init_stats(queue);
+#endif
+
+    return EMBED_SUCCESS;
+
+err_ready:
+    embed_ready_event_destroy(queue->ready_event);
+err_eventfd:
+    if(queue->event_fd >= 0)
+        close(queue->event_fd);
+err_epoch:
+    mcached_queue_destroy_epoch(queue);
+err_residency:
+    mcached_queue_destroy_residency(queue);
+err_prio:
+    mcached_queue_destroy_prio(queue);
+err_keys:
+    mcached_queue_destroy_key_column(queue);
+
+err_index:
+    if(queue->index)
+        mcached_hindex_destroy(queue->index);
+err_magazines:
+    mcached_queue_destroy_magazines(queue);
+err_rings:
+    Free(queue->item_taken);
+    mcached_queue_destroy_rings(queue);
+err_lock:
+    pthread_mutex_destroy(queue->mlock);
+    pthread_mutexattr_destroy(queue->mlattr);
+err_mem:
+    mcached_queue_slab_free(queue);
+    return EMBED_FAILD;
+}
+
+int
+mcached_queue_destroy(mcached_queue_t *queue)
+{
+    EMBED_ASSERT_RETURN(queue != NULL, EMBED_FAILD);
+
+    mcached_queue_destroy_rings(queue);
+    mcached_queue_destroy_magazines(queue);
+    Free(queue->item_taken);
+    queue->taken_cnt = 0;
+#if MCACHED_QUEUE_STATS
+    mcached_queue_destroy_stats(queue);
+#endif
+
+    if(queue->index)
+    {
+        mcached_hindex_destroy(queue->index);
+        queue->index = NULL;
+    }
+
+    mcached_queue_destroy_prio(queue);
+    mcached_queue_destroy_key_column(queue);
+    mcached_queue_destroy_residency(queue);
+    mcached_queue_destroy_epoch(queue);
+
+    if(queue->pool)
+    {
+        mcached_pool_destroy(queue->pool);
+        queue->pool = NULL;
+    }
+
+    if(queue->event_fd >= 0)
+    {
+        close(queue->event_fd);
+        queue->event_fd = -1;
+    }
+
+    embed_ready_event_destroy(queue->ready_event);
+    pthread_mutex_destroy(queue->mlock);
+    pthread_mutexattr_destroy(queue->mlattr);
+
+    mcached_queue_slab_free(queue);
+
+    INIT_LIST_HEAD(queue->idle_list);
+    INIT_LIST_HEAD(queue->used_list);
+    queue->max_item_cnt = 0;
+    queue->used_item_cnt = 0;
+
+    return EMBED_SUCCESS;
+}
+
+static inline embed_bool_t
+mcached_queue_own_item(mcached_queue_t *queue, struct list_head *item)
+{
+    char *p = (char *)item;
+
+    return p >= queue->mem_cached
+        && p < queue->mem_cached + (size_t)queue->item_stride * queue->max_item_cnt
+        && (p - queue->mem_cached) % queue->item_stride == 0;
+}
+
+/*Take a never used slot from mem_cached without holding mlock*/
+static embed_bool_t
+mcached_queue_carve_item(mcached_queue_t *queue, struct list_head **item)
+{
+    int cnt = __atomic_load_n(&queue->used_item_cnt, __ATOMIC_RELAXED);
+
+    if(queue->mode == MCACHED_QUEUE_MODE_SPSC)
+    {
+        /*only the producer carves*/
+        if(cnt >= queue->max_item_cnt)
+            return false;
+        __atomic_store_n(&queue->used_item_cnt, cnt + 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        do
+        {
+            if(cnt >= queue->max_item_cnt)
+                return false;
+        }while(!__atomic_compare_exchange_n(&queue->used_item_cnt, &cnt, cnt + 1,
+                    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    *item = MCACHED_QUEUE_ITEM(queue, cnt);
+
+    return true;
+}
+
+static inline embed_bool_t
+mcached_queue_ring_put(mcached_queue_t *queue, embed_bool_t used, uint32 index)
+{
+    if(queue->mode == MCACHED_QUEUE_MODE_SPSC)
+        return mcached_spsc_ring_enqueue(used ? queue->used_spsc : queue->idle_spsc, index);
+
+    return mcached_ring_enqueue(used ? queue->used_ring : queue->idle_ring, index);
+}
+
+static inline embed_bool_t
+mcached_queue_ring_take(mcached_queue_t *queue, embed_bool_t used, uint32 *index)
+{
+    if(queue->mode == MCACHED_QUEUE_MODE_SPSC)
+        return mcached_spsc_ring_dequeue(used ? queue->used_spsc : queue->idle_spsc, index);
+
+    return mcached_ring_dequeue(used ? queue->used_ring : queue->idle_ring, index);
+}
+
+/*Calling thread's magazine, created on first use*/
+static mcached_queue_magazine_t *
+mcached_queue_magazine(mcached_queue_t *queue)
+{
+    mcached_queue_magazine_t *mag;
+
+    mag = (mcached_queue_magazine_t *)pthread_getspecific(queue->magazine_key);
+    if(mag)
+        return mag;
+
+    mag = (mcached_queue_magazine_t *)malloc(sizeof(mcached_queue_magazine_t)
+            + queue->magazine_size * sizeof(struct list_head *));
+    if(mag == NULL)
+        return NULL;
+
+    mag->queue = queue;
+    mag->cnt = 0;
+
+    if(pthread_setspecific(queue->magazine_key, mag) != 0)
+    {
+        Free(mag);
+        return NULL;
+    }
+
+    MCACHED_QUEUE_LOCK(queue);
+    list_add_tail(&mag->node, &queue->magazines);
+    MCACHED_QUEUE_UNLOCK(queue);
+
+    return mag;
+}
+
+/*Load half a magazine from idle_list, carving new slots if it runs dry*/
+static void
+mcached_queue_magazine_refill(mcached_queue_t *queue, mcached_queue_magazine_t *mag)
+{
+    int want = (queue->magazine_size + 1) / 2;
+
+    MCACHED_QUEUE_LOCK(queue);
+    while(mag->cnt < want)
+    {
+        if(!list_empty(queue->idle_list))
+        {
+            mag->rounds[mag->cnt] = queue->idle_list->next;
+            list_del(mag->rounds[mag->cnt]);
+        }
+        else if(queue->used_item_cnt < queue->max_item_cnt)
+        {
+            mag->rounds[mag->cnt] = MCACHED_QUEUE_ITEM(queue, queue->used_item_cnt);
+            queue->used_item_cnt++;
+        }
+        else
+        {
+            break;
+        }
+        mag->cnt++;
+    }
+    MCACHED_QUEUE_UNLOCK(queue);
+}
+
+/*Push an idle item, flushing the upper half of a full magazine first*/
+static void
+mcached_queue_magazine_put(mcached_queue_t *queue, mcached_queue_magazine_t *mag,
+        struct list_head *item)
+{
+    if(mag->cnt == queue->magazine_size)
+    {
+        int keep = queue->magazine_size / 2;
+
+        MCACHED_QUEUE_LOCK(queue);
+        while(mag->cnt > keep)
+            list_add(mag->rounds[--mag->cnt], queue->idle_list);
+        MCACHED_QUEUE_UNLOCK(queue);
+    }
+
+    mag->rounds[mag->cnt++] = item;
+}
+
+void
+mcached_queue_magazine_flush(mcached_queue_t *queue)
+{
+    mcached_queue_magazine_t *mag;
+
+    if(queue->magazine_size == 0)
+        return;
+
+    mag = (mcached_queue_magazine_t *)pthread_getspecific(queue->magazine_key);
+    if(mag == NULL || mag->cnt == 0)
+        return;
+
+    MCACHED_QUEUE_LOCK(queue);
+    while(mag->cnt > 0)
+        list_add(mag->rounds[--mag->cnt], queue->idle_list);
+    MCACHED_QUEUE_UNLOCK(queue);
+}
+
+/*Wake consumers about cnt new items*/
+static inline void
+mcached_queue_notify(mcached_queue_t *queue, uint32 cnt)
+{
+    uint64 val = cnt;
+
+    embed_ready_event_active_n(queue->ready_event, cnt);
+
+    if(queue->event_fd < 0)
+        return;
+
+    if(queue->event_fd_mode == MCACHED_QUEUE_EVENTFD_COUNTER)
+    {
+        if(__atomic_exchange_n(&queue->event_fd_armed, 1, __ATOMIC_SEQ_CST))
+            return;
+        val = 1;
+    }
+
+    /*EAGAIN means the counter is saturated, the reader is awake anyway*/
+    if(write(queue->event_fd, &val, sizeof(val)) < 0)
+        return;
+}
+
+int
+mcached_queue_eventfd(mcached_queue_t *queue)
+{
+    return queue->event_fd;
+}
+
+uint64
+mcached_queue_eventfd_ack(mcached_queue_t *queue)
+{
+    uint64 val = 0;
+
+    if(queue->event_fd < 0)
+        return 0;
+
+    if(read(queue->event_fd, &val, sizeof(val)) != sizeof(val))
+        val = 0;
+
+    /*re-arm before the caller drains, adds racing the drain write again*/
+    if(queue->event_fd_mode == MCACHED_QUEUE_EVENTFD_COUNTER)
+        __atomic_store_n(&queue->event_fd_armed, 0, __ATOMIC_SEQ_CST);
+
+    return val;
+}
+
+static inline uint32
+mcached_queue_item_hash(mcached_queue_t *queue, struct list_head *item)
+{
+    return queue->index_hash(queue->index_key(item));
+}
+
+static inline void
+mcached_queue_residency_stamp(mcached_queue_t *queue, struct list_head *item, uint64 now)
+{
+    if(queue->residency)
+        queue->item_add_ns[MCACHED_QUEUE_ITEM_INDEX(queue, item)] = now;
+}
+
+/*item left the used set at now*/
+static inline void
+mcached_queue_residency_done(mcached_queue_t *queue, struct list_head *item, uint64 now)
+{
+    uint64 added;
+
+    if(queue->residency == NULL)
+        return;
+
+    added = queue->item_add_ns[MCACHED_QUEUE_ITEM_INDEX(queue, item)];
+    mcached_hist_record(queue->residency, now > added ? now - added : 0);
+}
+
+static inline void
+mcached_queue_residency_leave(mcached_queue_t *queue, struct list_head *item)
+{
+    if(queue->residency)
+        mcached_queue_residency_done(queue, item, mcached_queue_now_ns());
+}
+
+int
+mcached_queue_residency(mcached_queue_t *queue, mcached_hist_t *snapshot)
+{
+    EMBED_ASSERT_RETURN(queue != NULL && snapshot != NULL, EMBED_FAILD);
+
+    if(queue->residency == NULL)
+        return EMBED_FAILD;
+
+    mcached_hist_snapshot(queue->residency, snapshot);
+
+    return EMBED_SUCCESS;
+}
+
+int
+mcached_queue_residency_reset(mcached_queue_t *queue)
+{
+    EMBED_ASSERT_RETURN(queue != NULL, EMBED_FAILD);
+
+    if(queue->residency == NULL)
+        return EMBED_FAILD;
+
+    mcached_hist_reset(queue->residency);
+
+    return EMBED_SUCCESS;
+}
+
+/*Slots carved so far from chunk*/
+static inline int
+mcached_queue_chunk_carved(mcached_queue_t *queue, int chunk)
+{
+    int carved = queue->used_item_cnt - chunk * queue->elastic_chunk_cnt;
+
+    if(carved < 0)
+        return 0;
+
+    return carved < queue->elastic_chunk_cnt ? carved : queue->elastic_chunk_cnt;
+}
+
+/*Slot item entered (delta 1) or left (-1) idle_list; under mlock*/
+static inline void
+mcached_queue_elastic_idle(mcached_queue_t *queue, struct list_head *item, int delta)
+{
+    int chunk;
+
+    if(queue->elastic_chunk_cnt == 0)
+        return;
+
+    chunk = MCACHED_QUEUE_ITEM_INDEX(queue, item) / queue->elastic_chunk_cnt;
+    queue->chunk_idle[chunk] += delta;
+
+    /*the idle clock of a chunk starts when its last slot comes back*/
+    if(delta > 0 && queue->chunk_idle[chunk] == mcached_queue_chunk_carved(queue, chunk))
+        queue->chunk_idle_since[chunk] = mcached_queue_now_ns();
+}
+
+/*Commit the next chunk when the slab is full; under mlock*/
+static embed_bool_t
+mcached_queue_elastic_grow(mcached_queue_t *queue)
+{
+    char *begin, *end;
+    int cnt;
+
+    if(queue->elastic_chunk_cnt == 0 || queue->max_item_cnt >= queue->slot_cap)
+        return false;
+
+    cnt = (queue->max_item_cnt / queue->elastic_chunk_cnt + 1) * queue->elastic_chunk_cnt;
+    if(cnt > queue->slot_cap)
+        cnt = queue->slot_cap;
+
+    begin = mcached_queue_page_down(queue->mem_cached + (size_t)queue->item_stride * queue->max_item_cnt);
+    end = mcached_queue_page_up(queue->mem_cached + (size_t)queue->item_stride * cnt);
+    if(mprotect(begin, end - begin, PROT_READ | PROT_WRITE) != 0)
+        return false;
+
+    queue->chunk_idle_since[(cnt - 1) / queue->elastic_chunk_cnt] = mcached_queue_now_ns();
+    __atomic_store_n(&queue->max_item_cnt, cnt, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+/*
+ * Release the highest chunks, one after another, while every slot carved
+ * from the top one has sat on idle_list for elastic_idle_ns; under mlock.
+ * Only the top chunk can go, so indices below max_item_cnt stay valid.
+ */
+static void
+mcached_queue_elastic_trim(mcached_queue_t *queue)
+{
+    int chunk, start, carved, i;
+    char *begin, *end;
+    uint64 now = 0;
+
+    if(queue->elastic_chunk_cnt == 0)
+        return;
+
+    for(;;)
+    {
+        chunk = (queue->max_item_cnt - 1) / queue->elastic_chunk_cnt;
+        start = chunk * queue->elastic_chunk_cnt;
+        if(start < queue->elastic_min_cnt)
+            return;
+
+        carved = mcached_queue_chunk_carved(queue, chunk);
+        if(queue->chunk_idle[chunk] != carved)
+            return;
+
+        if(now == 0)
+            now = mcached_queue_now_ns();
+        if(now - queue->chunk_idle_since[chunk] < queue->elastic_idle_ns)
+            return;
+
+        for(i = start; i < start + carved; i++)
+            list_del(MCACHED_QUEUE_ITEM(queue, i));
+        queue->chunk_idle[chunk] = 0;
+
+        /*the page holding the tail of the chunk below stays*/
+        begin = mcached_queue_page_up(queue->mem_cached + (size_t)queue->item_stride * start);
+        end = mcached_queue_page_up(queue->mem_cached + (size_t)queue->item_stride * queue->max_item_cnt);
+        if(end > begin)
+        {
+            madvise(begin, end - begin, MADV_DONTNEED);
+            mprotect(begin, end - begin, PROT_NONE);
+        }
+
+        if(queue->used_item_cnt > start)
+            queue->used_item_cnt = start;
+        __atomic_store_n(&queue->max_item_cnt, start, __ATOMIC_RELAXED);
+    }
+}
+
+void
+mcached_queue_shrink(mcached_queue_t *queue)
+{
+    if(queue->elastic_chunk_cnt == 0)
+        return;
+
+    MCACHED_QUEUE_LOCK(queue);
+    mcached_queue_elastic_trim(queue);
+    MCACHED_QUEUE_UNLOCK(queue);
+}
+
+/*Head of used list level, level 0 is the only one without priorities*/
+static inline struct list_head *
+mcached_queue_used_head(mcached_queue_t *queue, int level)
+{
+    return queue->prio_levels ? &queue->prio_lists[level] : queue->used_list;
+}
+
+static inline int
+mcached_queue_used_levels(mcached_queue_t *queue)
+{
+    return queue->prio_levels ? queue->prio_levels : 1;
+}
+
+/*Does the list mode used set keep per-slot state (so only slab items fit)*/
+static inline embed_bool_t
+mcached_queue_slot_tracked(mcached_queue_t *queue)
+{
+    return queue->index != NULL || queue->prio_levels != 0 || queue->persist_hdr != NULL
+        || queue->key_col != NULL;
+}
+
+/*Append slot to the on-disk chain; under mlock*/
+static inline void
+mcached_queue_persist_link(mcached_queue_t *queue, uint32 slot)
+{
+    mcached_queue_persist_hdr_t *hdr = queue->persist_hdr;
+    uint32 tail = hdr->tail;
+
+    queue->persist_next[slot] = MCACHED_QUEUE_PERSIST_NIL;
+    queue->persist_prev[slot] = tail;
+
+    /*the item is queued on disk from this store on*/
+    if(tail == MCACHED_QUEUE_PERSIST_NIL)
+        __atomic_store_n(&hdr->head, slot, __ATOMIC_RELEASE);
+    else
+        __atomic_store_n(&queue->persist_next[tail], slot, __ATOMIC_RELEASE);
+
+    hdr->tail = slot;
+}
+
+/*Drop slot from the on-disk chain; under mlock*/
+static inline void
+mcached_queue_persist_unlink(mcached_queue_t *queue, uint32 slot)
+{
+    mcached_queue_persist_hdr_t *hdr = queue->persist_hdr;
+    uint32 prev = queue->persist_prev[slot];
+    uint32 next = queue->persist_next[slot];
+
+    if(prev == MCACHED_QUEUE_PERSIST_NIL)
+        __atomic_store_n(&hdr->head, next, __ATOMIC_RELEASE);
+    else
+        __atomic_store_n(&queue->persist_next[prev], next, __ATOMIC_RELEASE);
+
+    if(next == MCACHED_QUEUE_PERSIST_NIL)
+        hdr->tail = prev;
+    else
+        queue->persist_prev[next] = prev;
+}
+
+static void
+mcached_queue_persist_sync(mcached_queue_t *queue)
+{
+    uint64 now, last;
+
+    if(queue->persist_hdr == NULL || queue->persist_sync == MCACHED_QUEUE_SYNC_NONE)
+        return;
+
+    if(queue->persist_sync == MCACHED_QUEUE_SYNC_BATCH)
+    {
+        msync(queue->persist_map, queue->persist_size, MS_SYNC);
+        return;
+    }
+
+    now = mcached_queue_now_ns();
+    last = __atomic_load_n(&queue->persist_synced_at, __ATOMIC_RELAXED);
+    if(now - last < queue->persist_sync_ns)
+        return;
+
+    /*one caller per period starts the write back*/
+    if(__atomic_compare_exchange_n(&queue->persist_synced_at, &last, now,
+                false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        msync(queue->persist_map, queue->persist_size, MS_ASYNC);
+}
+
+/*
+ * Rebuild used_list from the on-disk chain and hand every other slot below
+ * the highest one seen to idle_list. A chain cut short by a torn or bogus
+ * link ends at the last good slot.
+ */
+static int
+mcached_queue_persist_recover(mcached_queue_t *queue)
+{
+    mcached_queue_persist_hdr_t *hdr = queue->persist_hdr;
+    uint32 slot = hdr->head, last = MCACHED_QUEUE_PERSIST_NIL, n = 0;
+    uint64 now = mcached_queue_now_ns();
+    int top = 0, i;
+    uint8 *seen;
+
+    seen = (uint8 *)calloc((queue->max_item_cnt + 7) / 8, 1);
+    if(seen == NULL)
+        return EMBED_FAILD;
+
+    while(slot < (uint32)queue->max_item_cnt && !(seen[slot / 8] & (1 << (slot % 8))))
+    {
+        struct list_head *item = MCACHED_QUEUE_ITEM(queue, slot);
+
+        seen[slot / 8] |= 1 << (slot % 8);
+        queue->persist_prev[slot] = last;
+        list_add_tail(item, queue->used_list);
+        if(queue->index)
+            mcached_hindex_insert(queue->index, slot, mcached_queue_item_hash(queue, item));
+        if(queue->key_col)
+            mcached_queue_key_set(queue, slot, item);
+        mcached_queue_residency_stamp(queue, item, now);
+
+        if((int)slot >= top)
+            top = slot + 1;
+        last = slot;
+        slot = queue->persist_next[slot];
+        n++;
+    }
+
+    if(last == MCACHED_QUEUE_PERSIST_NIL)
+        hdr->head = MCACHED_QUEUE_PERSIST_NIL;
+    else
+        queue->persist_next[last] = MCACHED_QUEUE_PERSIST_NIL;
+    hdr->tail = last;
+
+    /*slots handed out but not queued at the crash are idle again*/
+    for(i = 0; i < top; i++)
+    {
+        if(!(seen[i / 8] & (1 << (i % 8))))
+            list_add_tail(MCACHED_QUEUE_ITEM(queue, i), queue->idle_list);
+    }
+    queue->used_item_cnt = top;
+
+    Free(seen);
+
+    embed_ready_event_active_n(queue->ready_event, n);
+
+    return EMBED_SUCCESS;
+}
+
+/*Mark item (already on level's list) as used; under mlock*/
+static inline void
+mcached_queue_track_used(mcached_queue_t *queue, struct list_head *item, int level,
+        uint32 hash, uint64 now)
+{
+    int slot = MCACHED_QUEUE_ITEM_INDEX(queue, item);
+
+    if(queue->prio_levels)
+    {
+        queue->item_prio[slot] = level;
+        if(queue->item_stamp)
+            queue->item_stamp[slot] = now;
+        queue->prio_bitmap |= 1ULL << level;
+    }
+
+    if(queue->index)
+        mcached_hindex_insert(queue->index, slot, hash);
+
+    if(queue->key_col)
+        mcached_queue_key_set(queue, slot, item);
+
+    if(queue->persist_hdr)
+        mcached_queue_persist_link(queue, slot);
+}
+
+/*
+ * Unlink item from the used set, self-linking it (lockless_read: keeping
+ * its next for the readers and clearing prev); under mlock.
+ */
+static inline void
+mcached_queue_unlink_used(mcached_queue_t *queue, struct list_head *item)
+{
+    if(queue->epoch_enabled)
+        list_del_rcu(item);
+    else
+        list_del_init(item);
+
+    if(!mcached_queue_slot_tracked(queue))
+        return;
+
+    if(queue->prio_levels)
+    {
+        int level = queue->item_prio[MCACHED_QUEUE_ITEM_INDEX(queue, item)];
+
+        if(list_empty(&queue->prio_lists[level]))
+            queue->prio_bitmap &= ~(1ULL << level);
+    }
+
+    if(queue->index)
+        mcached_hindex_remove(queue->index, MCACHED_QUEUE_ITEM_INDEX(queue, item));
+
+    if(queue->key_col)
+        mcached_queue_key_clear(queue, MCACHED_QUEUE_ITEM_INDEX(queue, item));
+
+    if(queue->persist_hdr)
+        mcached_queue_persist_unlink(queue, MCACHED_QUEUE_ITEM_INDEX(queue, item));
+}
+
+/*
+ * Move every less urgent head that waited prio_age_ns one level up, to the
+ * tail of that level with a fresh stamp; under mlock.
+ */
+static void
+mcached_queue_prio_age(mcached_queue_t *queue)
+{
+    uint64 bits, now;
+
+    if(queue->item_stamp == NULL || queue->prio_bitmap == 0)
+        return;
+
+    bits = queue->prio_bitmap & (queue->prio_bitmap - 1);
+    if(bits == 0)
+        return;
+
+    now = mcached_queue_now_ns();
+
+    /*ascending, so an item moves at most one level per call*/
+    while(bits)
+    {
+        int level = __builtin_ctzll(bits);
+        struct list_head *head = queue->prio_lists[level].next;
+        int slot = MCACHED_QUEUE_ITEM_INDEX(queue, head);
+
+        bits &= bits - 1;
+
+        if(now - queue->item_stamp[slot] < queue->prio_age_ns)
+            continue;
+
+        list_move_tail(head, &queue->prio_lists[level - 1]);
+        if(list_empty(&queue->prio_lists[level]))
+            queue->prio_bitmap &= ~(1ULL << level);
+        queue->prio_bitmap |= 1ULL << (level - 1);
+        queue->item_prio[slot] = level - 1;
+        queue->item_stamp[slot] = now;
+    }
+}
+
+/*Most urgent non-empty used list, NULL when the queue is empty; under mlock*/
+static inline struct list_head *
+mcached_queue_first_used(mcached_queue_t *queue)
+{
+    if(queue->prio_levels == 0)
+        return list_empty(queue->used_list) ? NULL : queue->used_list;
+
+    mcached_queue_prio_age(queue);
+
+    if(queue->prio_bitmap == 0)
+        return NULL;
+
+    return &queue->prio_lists[__builtin_ctzll(queue->prio_bitmap)];
+}
+
+static inline void
+mcached_queue_link_used(mcached_queue_t *queue, struct list_head *item, struct list_head *head)
+{
+    if(queue->epoch_enabled)
+        list_add_tail_rcu(item, head);
+    else
+        list_add_tail(item, head);
+}
+
+/*Mark an item pop_batch leaves chained on out_list; under mlock*/
+static inline void
+mcached_queue_mark_taken(mcached_queue_t *queue, struct list_head *item)
+{
+    int slot;
+
+    if(!mcached_queue_own_item(queue, item))
+        return;
+
+    slot = MCACHED_QUEUE_ITEM_INDEX(queue, item);
+    queue->item_taken[slot / 64] |= 1ULL << (slot % 64);
+    queue->taken_cnt++;
+}
+
+/*Drop the pop_batch mark of item, true if it had one; under mlock*/
+static inline embed_bool_t
+mcached_queue_clear_taken(mcached_queue_t *queue, struct list_head *item)
+{
+    uint64 bit;
+    int slot;
+
+    if(queue->taken_cnt == 0 || !mcached_queue_own_item(queue, item))
+        return false;
+
+    slot = MCACHED_QUEUE_ITEM_INDEX(queue, item);
+    bit = 1ULL << (slot % 64);
+    if(!(queue->item_taken[slot / 64] & bit))
+        return false;
+
+    queue->item_taken[slot / 64] &= ~bit;
+    queue->taken_cnt--;
+
+    return true;
+}
+
+int
+mcached_queue_add(mcached_queue_t *queue, struct list_head *new_item)
+{
+    return mcached_queue_add_prio(queue, new_item, queue->prio_levels - 1);
+}
+
+int
+mcached_queue_add_prio(mcached_queue_t *queue, struct list_head *new_item, int prio)
+{
+    EMBED_ASSERT_RETURN(queue != NULL && new_item != NULL, EMBED_FAILD);
+
+    if(queue->residency)
+    {
+        if(!mcached_queue_own_item(queue, new_item))
+            return EMBED_FAILD;
+        mcached_queue_residency_stamp(queue, new_item, mcached_queue_now_ns());
+    }
+
+    if(queue->mode != MCACHED_QUEUE_MODE_LIST)
+    {
+        if(!mcached_queue_own_item(queue, new_item))
+            return EMBED_FAILD;
+
+        if(!mcached_queue_ring_put(queue, true, MCACHED_QUEUE_ITEM_INDEX(queue, new_item)))
+            return EMBED_FAILD;
+    }
+    else if(mcached_queue_slot_tracked(queue))
+    {
+        uint32 hash = 0;
+        uint64 now = 0;
+
+        if(!mcached_queue_own_item(queue, new_item))
+            return EMBED_FAILD;
+
+        if(prio < 0)
+            prio = 0;
+        else if(queue->prio_levels && prio >= queue->prio_levels)
+            prio = queue->prio_levels - 1;
+
+        if(queue->index)
+            hash = mcached_queue_item_hash(queue, new_item);
+        if(queue->item_stamp)
+            now = mcached_queue_now_ns();
+
+        MCACHED_QUEUE_LOCK(queue);
+        mcached_queue_clear_taken(queue, new_item);
+        mcached_queue_link_used(queue, new_item, mcached_queue_used_head(queue, prio));
+        mcached_queue_track_used(queue, new_item, prio, hash, now);
+        MCACHED_QUEUE_UNLOCK(queue);
+    }
+    else
+    {
+        MCACHED_QUEUE_LOCK(queue);
+        mcached_queue_clear_taken(queue, new_item);
+        mcached_queue_link_used(queue, new_item, queue->used_list);
+        MCACHED_QUEUE_UNLOCK(queue);
+    }
+
+    mcached_queue_persist_sync(queue);
+    MCACHED_QUEUE_STAT_ADD(queue, enqueue, 1);
+    mcached_queue_notify(queue, 1);
+
+    return EMBED_SUCCESS;
+}
+
+/*Give a slot that left the used set back to idle_list; under mlock*/
+static void
+mcached_queue_idle_put(mcached_queue_t *queue, struct list_head *item)
+{
+    if(queue->elastic_chunk_cnt)
+    {
+        /*low slots are reused first, so the top chunk can drain*/
+        if(MCACHED_QUEUE_ITEM_INDEX(queue, item) / queue->elastic_chunk_cnt
+                == (queue->max_item_cnt - 1) / queue->elastic_chunk_cnt)
+            list_add_tail(item, queue->idle_list);
+        else
+            list_add(item, queue->idle_list);
+        mcached_queue_elastic_idle(queue, item, 1);
+        mcached_queue_elastic_trim(queue);
+    }
+    else
+    {
+        list_add_tail(item, queue->idle_list);
+    }
+}
+
+/*Park item in limbo, tagged with the epoch it left in; under mlock*/
+static inline void
+mcached_queue_epoch_retire(mcached_queue_t *queue, struct list_head *item)
+{
+    int i = (queue->limbo_head + queue->limbo_cnt) % queue->slot_cap;
+
+    queue->limbo_slot[i] = MCACHED_QUEUE_ITEM_INDEX(queue, item);
+    queue->limbo_epoch[i] = __atomic_fetch_add(&queue->epoch, 1, __ATOMIC_SEQ_CST);
+    queue->limbo_cnt++;
+}
+
+/*Move every limbo slot no reader can still stand on to idle_list; under mlock*/
+static void
+mcached_queue_epoch_reclaim(mcached_queue_t *queue)
+{
+    uint64 oldest;
+
+    if(queue->limbo_cnt == 0)
+        return;
+
+    oldest = mcached_queue_epoch_oldest(queue);
+
+    /*tags only grow, so the limbo is ordered*/
+    while(queue->limbo_cnt > 0 && queue->limbo_epoch[queue->limbo_head] < oldest)
+    {
+        mcached_queue_idle_put(queue, MCACHED_QUEUE_ITEM(queue, queue->limbo_slot[queue->limbo_head]));
+        queue->limbo_head = (queue->limbo_head + 1) % queue->slot_cap;
+        queue->limbo_cnt--;
+    }
+}
+
+void
+mcached_queue_del(mcached_queue_t *queue, struct list_head *del_item)
+{
+    mcached_queue_magazine_t *mag = NULL;
+    embed_bool_t linked;
+
+    if(queue->mode != MCACHED_QUEUE_MODE_LIST)
+    {
+        /*the item already left the used ring (and was recorded) when it was handed out*/
+        mcached_queue_ring_put(queue, false, MCACHED_QUEUE_ITEM_INDEX(queue, del_item));
+        return;
+    }
+
+    if(queue->magazine_size > 0)
+        mag = mcached_queue_magazine(queue);
+
+    MCACHED_QUEUE_LOCK(queue);
+    /*popped items are self linked (or unlinked) or marked taken, and were counted when they left*/
+    if(mcached_queue_clear_taken(queue, del_item))
+        linked = false;
+    else
+        linked = queue->epoch_enabled ? del_item->prev != NULL : !list_empty(del_item);
+    if(linked)
+        mcached_queue_unlink_used(queue, del_item);
+    if(queue->epoch_enabled)
+    {
+        mcached_queue_epoch_retire(queue, del_item);
+        mcached_queue_epoch_reclaim(queue);
+    }
+    else if(mag == NULL)
+    {
+        mcached_queue_idle_put(queue, del_item);
+    }
+    MCACHED_QUEUE_UNLOCK(queue);
+
+    if(linked)
+    {
+        mcached_queue_persist_sync(queue);
+        mcached_queue_residency_leave(queue, del_item);
+        MCACHED_QUEUE_STAT_ADD(queue, dequeue, 1);
+    }
+
+    if(mag)
+        mcached_queue_magazine_put(queue, mag, del_item);
+}
+
+/*
+ * Hand a slot out of the idle set looking popped (self linked, or prev
+ * cleared on a lockless_read queue), so a del without an add in between
+ * only recycles it
+ */
+static inline void
+mcached_queue_idle_detach(mcached_queue_t *queue, struct list_head *item)
+{
+    INIT_LIST_HEAD(item);
+    if(queue->epoch_enabled)
+        item->prev = NULL;
+}
+
+int
+mcached_queue_get_idle_item(mcached_queue_t *queue, struct list_head **item)
+{
+    int status = EMBED_SUCCESS;
+
+    EMBED_ASSERT_RETURN(queue != NULL && item != NULL, EMBED_FAILD);
+
+    if(queue->mode != MCACHED_QUEUE_MODE_LIST)
+    {
+        uint32 index;
+
+        if(mcached_queue_ring_take(queue, false, &index))
+        {
+            *item = MCACHED_QUEUE_ITEM(queue, index);
+            return EMBED_SUCCESS;
+        }
+
+        if(mcached_queue_carve_item(queue, item))
+            return EMBED_SUCCESS;
+
+        MCACHED_QUEUE_STAT_ADD(queue, full, 1);
+        return EMBED_FAILD;
+    }
+
+    if(queue->magazine_size > 0)
+    {
+        mcached_queue_magazine_t *mag = mcached_queue_magazine(queue);
+
+        if(mag)
+        {
+            if(mag->cnt == 0)
+                mcached_queue_magazine_refill(queue, mag);
+            if(mag->cnt == 0)
+            {
+                MCACHED_QUEUE_STAT_ADD(queue, full, 1);
+                return EMBED_FAILD;
+            }
+
+            *item = mag->rounds[--mag->cnt];
+            mcached_queue_idle_detach(queue, *item);
+            return EMBED_SUCCESS;
+        }
+    }
+
+    MCACHED_QUEUE_LOCK(queue);
+    if(list_empty(queue->idle_list))
+        mcached_queue_epoch_reclaim(queue);
+    if(IS_IDLE_LIST_EMPTY(queue) && !mcached_queue_elastic_grow(queue))
+    {
+        status = EMBED_FAILD;
+    }
+    else if(!list_empty(queue->idle_list))
+    {
+        *item = queue->idle_list->next;
+        list_del(*item);
+        mcached_queue_elastic_idle(queue, *item, -1);
+    }
+    else
+    {
+        *item = MCACHED_QUEUE_ITEM(queue, queue->used_item_cnt);
+        queue->used_item_cnt++;
+    }
+    MCACHED_QUEUE_UNLOCK(queue);
+
+    if(status != EMBED_SUCCESS)
+        MCACHED_QUEUE_STAT_ADD(queue, full, 1);
+    else
+        mcached_queue_idle_detach(queue, *item);
+
+    return status;
+}
+
+void
+mcached_queue_traverse(mcached_queue_t *queue, traverse_item_cb item_handler)
+{
+    struct list_head *pos, *n, *ahead;
+    int level;
+
+    if(queue->mode != MCACHED_QUEUE_MODE_LIST)
+    {
+        uint32 index;
+        int cnt = 0;
+
+        /*bounded, so producers refilling the ring cannot keep us here*/
+        while(cnt < queue->max_item_cnt
+                && mcached_queue_ring_take(queue, true, &index))
+        {
+            mcached_queue_residency_leave(queue, MCACHED_QUEUE_ITEM(queue, index));
+            item_handler(queue, MCACHED_QUEUE_ITEM(queue, index));
+            cnt++;
+        }
+
+        MCACHED_QUEUE_STAT_ADD(queue, dequeue, cnt);
+        return;
+    }
+
+    if(queue->epoch_enabled)
+    {
+        /*next is read first, item_handler may add or del pos*/
+        mcached_queue_read_lock(queue);
+        for(pos = list_next_rcu(queue->used_list); pos != queue->used_list; pos = n)
+        {
+            n = list_next_rcu(pos);
+            item_handler(queue, pos);
+        }
+        mcached_queue_read_unlock(queue);
+        return;
+    }
+
+    MCACHED_QUEUE_LOCK(queue);
+    for(level = 0; level < mcached_queue_used_levels(queue); level++)
+    {
+        list_for_each_safe_prefetch(pos, n, ahead, mcached_queue_used_head(queue, level))
+        {
+            item_handler(queue, pos);
+        }
+    }
+    MCACHED_QUEUE_UNLOCK(queue);
+}
+
+int
+mcached_queue_find(
+        mcached_queue_t *queue,
+        void *find_index,
+        find_compared_cb compared,
+        struct list_head **find_item
+        )
+{
+    struct list_head *pos, *ahead;
+    int status = EMBED_FAILD;
+    int level;
+
+    EMBED_ASSERT_RETURN(queue != NULL && compared != NULL && find_item != NULL, EMBED_FAILD);
+
+    if(queue->mode != MCACHED_QUEUE_MODE_LIST)
+        return EMBED_FAILD;
+
+    if(queue->epoch_enabled)
+    {
+        mcached_queue_read_lock(queue);
+        for(pos = list_next_rcu(queue->used_list); pos != queue->used_list; pos = list_next_rcu(pos))
+        {
+            if(compared(pos, find_index))
+            {
+                *find_item = pos;
+                status = EMBED_SUCCESS;
+                break;
+            }
+        }
+        mcached_queue_read_unlock(queue);
+
+        return status;
+    }
+
+    MCACHED_QUEUE_LOCK(queue);
+    for(level = 0; level < mcached_queue_used_levels(queue) && status != EMBED_SUCCESS; level++)
+    {
+        list_for_each_prefetch(pos, ahead, mcached_queue_used_head(queue, level))
+        {
+            if(compared(pos, find_index))
+            {
+                *find_item = pos;
+                status = EMBED_SUCCESS;
+                break;
+            }
+        }
+    }
+    MCACHED_QUEUE_UNLOCK(queue);
+
+    return status;
+}
+
+struct mcached_queue_parallel
+{
+    mcached_queue_t *queue;
+    parallel_item_cb item_handler;
+
+    struct list_head **items;
+    int    item_cnt;
+    int    seg_cnt;
+
+    char   *parts;
+    size_t part_stride;
+};
+
+/*One segment of the snapshot, items to del get their low bit set*/
+static void
+mcached_queue_parallel_task(void *arg, int task)
+{
+    struct mcached_queue_parallel *par = (struct mcached_queue_parallel *)arg;
+    int begin = (int)((int64)par->item_cnt * task / par->seg_cnt);
+    int end = (int)((int64)par->item_cnt * (task + 1) / par->seg_cnt);
+    void *part = par->parts ? par->parts + task * par->part_stride : NULL;
+    int i;
+
+    for(i = begin; i < end; i++)
+    {
+        if(i + LIST_PREFETCH_DISTANCE < end)
+            prefetch(par->items[i + LIST_PREFETCH_DISTANCE]);
+        if(par->item_handler(par->queue, par->items[i], part))
+            par->items[i] = (struct list_head *)((uintptr_t)par->items[i] | 1);
+    }
+}
+
+int
+mcached_queue_traverse_parallel(mcached_queue_t *queue, parallel_item_cb item_handler,
+        int nthreads, size_t part_size, parallel_reduce_cb reduce, void *result)
+{
+    struct mcached_queue_parallel par;
+    struct list_head *pos, *ahead;
+    int status = EMBED_FAILD;
+    int level, i, cnt = 0;
+
+    EMBED_ASSERT_RETURN(queue != NULL && item_handler != NULL, EMBED_FAILD);
+    EMBED_ASSERT_RETURN(nthreads > 0 && nthreads <= MCACHED_QUEUE_PARALLEL_MAX, EMBED_FAILD);
+
+    if(queue->mode != MCACHED_QUEUE_MODE_LIST)
+        return EMBED_FAILD;
+
+    memset(&par, 0, sizeof(par));
+    par.queue = queue;
+    par.item_handler = item_handler;
+    par.seg_cnt = nthreads > 1 ? nthreads * MCACHED_QUEUE_PARALLEL_SPLIT : 1;
+    par.part_stride = EMBED_ALIGN_UP(part_size, EMBED_CACHE_LINE_SIZE);
+
+    if(part_size)
+    {
+        if(posix_memalign((void **)&par.parts, EMBED_CACHE_LINE_SIZE, par.seg_cnt * par.part_stride) != 0)
+            return EMBED_FAILD;
+        memset(par.parts, 0, par.seg_cnt * par.part_stride);
+    }
+
+    MCACHED_QUEUE_LOCK(queue);
+
+    /*the caller is one of the nthreads*/
+    if(nthreads > 1 && (queue->pool == NULL || queue->pool->thread_cnt != nthreads - 1))
+    {
+        if(queue->pool)
+            mcached_pool_destroy(queue->pool);
+        queue->pool = NULL;
+        if(mcached_pool_create(&queue->pool, nthreads - 1) != EMBED_SUCCESS)
+            goto out;
+    }
+
+    /*
+     * Count the lists: stolen or plainly added foreign items sit on them
+     * too, so used_item_cnt does not bound the snapshot
+     */
+    for(level = 0; level < mcached_queue_used_levels(queue); level++)
+    {
+        list_for_each_prefetch(pos, ahead, mcached_queue_used_head(queue, level))
+            cnt++;
+    }
+
+    par.items = (struct list_head **)malloc((cnt + 1) * sizeof(struct list_head *));
+    if(par.items == NULL)
+        goto out;
+
+    for(level = 0; level < mcached_queue_used_levels(queue); level++)
+    {
+        list_for_each_prefetch(pos, ahead, mcached_queue_used_head(queue, level))
+            par.items[par.item_cnt++] = pos;
+    }
+
+    if(nthreads > 1 && par.item_cnt > 0)
+    {
+        mcached_pool_run(queue->pool, mcached_queue_parallel_task, &par, par.seg_cnt);
+    }
+    else
+    {
+        for(i = 0; i < par.seg_cnt; i++)
+            mcached_queue_parallel_task(&par, i);
+    }
+
+    for(i = 0; i < par.item_cnt; i++)
+    {
+        if((uintptr_t)par.items[i] & 1)
+            mcached_queue_del(queue, (struct list_head *)((uintptr_t)par.items[i] & ~(uintptr_t)1));
+    }
+
+    status = EMBED_SUCCESS;
+
+out:
+    MCACHED_QUEUE_UNLOCK(queue);
+
+    if(status == EMBED_SUCCESS && reduce && par.parts)
+    {
+        for(i = 0; i < par.seg_cnt; i++)
+            reduce(queue, result, par.parts + i * par.part_stride);
+    }
+
+    Free(par.items);
+    Free(par.parts);
+
+    return status;
+}
+
+/*Last of the first *cnt nodes of list, *cnt is clamped to the list length*/
+static struct list_head *
+mcached_queue_list_nth(struct list_head *list, int *cnt)
+{
+    struct list_head *pos = list;
+    int n = 0;
+
+    while(n < *cnt && pos->next != list)
+    {
+        pos = pos->next;
+        n++;
+    }
+
+    *cnt = n;
+
+    return pos;
+}
+
+int
+mcached_queue_add_batch(mcached_queue_t *queue, struct list_head *batch)
+{
+    struct list_head *pos, *n;
+    uint32 cnt = 0;
+
+    EMBED_ASSERT_RETURN(queue != NULL && batch != NULL, EMBED_FAILD);
+
+    list_for_each(pos, batch)
+    {
+        if((queue->mode != MCACHED_QUEUE_MODE_LIST || mcached_queue_slot_tracked(queue)
+                    || queue->residency)
+                && !mcached_queue_own_item(queue, pos))
+            return EMBED_FAILD;
+        cnt++;
+    }
+
+    if(cnt == 0)
+        return EMBED_SUCCESS;
+
+    if(queue->residency)
+    {
+        uint64 now = mcached_queue_now_ns();
+
+        list_for_each(pos, batch)
+            mcached_queue_residency_stamp(queue, pos, now);
+    }
+
+    if(queue->mode != MCACHED_QUEUE_MODE_LIST)
+    {
+        list_for_each_safe(pos, n, batch)
+            mcached_queue_ring_put(queue, true, MCACHED_QUEUE_ITEM_INDEX(queue, pos));
+        INIT_LIST_HEAD(batch);
+    }
+    else
+    {
+        int level = queue->prio_levels ? queue->prio_levels - 1 : 0;
+        uint64 now = queue->item_stamp ? mcached_queue_now_ns() : 0;
+
+        MCACHED_QUEUE_LOCK(queue);
+        if(queue->taken_cnt)
+        {
+            list_for_each(pos, batch)
+                mcached_queue_clear_taken(queue, pos);
+        }
+        if(mcached_queue_slot_tracked(queue))
+        {
+            list_for_each(pos, batch)
+                mcached_queue_track_used(queue, pos, level,
+                        queue->index ? mcached_queue_item_hash(queue, pos) : 0, now);
+        }
+        if(queue->epoch_enabled)
+            list_splice_tail_init_rcu(batch, mcached_queue_used_head(queue, level));
+        else
+            list_splice_tail_init(batch, mcached_queue_used_head(queue, level));
+        MCACHED_QUEUE_UNLOCK(queue);
+    }
+
+    mcached_queue_persist_sync(queue);
+    MCACHED_QUEUE_STAT_ADD(queue, enqueue, cnt);
+    mcached_queue_notify(queue, cnt);
+
+    return EMBED_SUCCESS;
+}
+
+/*Drop one ready token per item pop_batch took, like pop does, and count them*/
+static void
+mcached_queue_pop_batch_done(mcached_queue_t *queue, int n)
+{
+    int i;
+
+    for(i = 0; i < n; i++)
+        embed_ready_event_trywait(queue->ready_event);
+
+    MCACHED_QUEUE_STAT_ADD(queue, dequeue, n);
+    if(n == 0)
+        MCACHED_QUEUE_STAT_ADD(queue, empty, 1);
+}
+
+/*
+ * lockless_read pop_batch: unlink the head items one by one, which leaves
+ * them chained through their next pointers, then relink them onto
+ * out_list once no reader can be standing on them.
+ */
+static int
+mcached_queue_pop_batch_epoch(mcached_queue_t *queue, int cnt, struct list_head *out_list)
+{
+    struct list_head *first = NULL, *pos, *next;
+    uint64 now;
+    int n = 0, i;
+
+    MCACHED_QUEUE_LOCK(queue);
+    while(n < cnt && !list_empty(queue->used_list))
+    {
+        pos = queue->used_list->next;
+        if(first == NULL)
+            first = pos;
+        mcached_queue_unlink_used(queue, pos);
+        mcached_queue_mark_taken(queue, pos);
+        n++;
+    }
+    MCACHED_QUEUE_UNLOCK(queue);
+
+    if(n > 0)
+    {
+        mcached_queue_epoch_synchronize(queue);
+
+        now = queue->residency ? mcached_queue_now_ns() : 0;
+        for(i = 0, pos = first; i < n; i++, pos = next)
+        {
+            next = pos->next;
+            mcached_queue_residency_done(queue, pos, now);
+            list_add_tail(pos, out_list);
+        }
+
+        mcached_queue_persist_sync(queue);
+    }
+
+    mcached_queue_pop_batch_done(queue, n);
+
+    return n;
+}
+
+int
+mcached_queue_pop_batch(mcached_queue_t *queue, int cnt, struct list_head *out_list)
+{
+    struct list_head *head, *last, *pos;
+    int n = 0;
+
+    EMBED_ASSERT_RETURN(queue != NULL && out_list != NULL, 0);
+
+    if(cnt <= 0)
+        return 0;
+
+    if(queue->mode != MCACHED_QUEUE_MODE_LIST)
+    {
+        uint32 index;
+
+        uint64 now = queue->residency ? mcached_queue_now_ns() : 0;
+
+        while(n < cnt && mcached_queue_ring_take(queue, true, &index))
+        {
+            mcached_queue_residency_done(queue, MCACHED_QUEUE_ITEM(queue, index), now);
+            list_add_tail(MCACHED_QUEUE_ITEM(queue, index), out_list);
+            n++;
+        }
+
+        mcached_queue_pop_batch_done(queue, n);
+
+        return n;
+    }
+
+    if(queue->epoch_enabled)
+        return mcached_queue_pop_batch_epoch(queue, cnt, out_list);
+
+    MCACHED_QUEUE_LOCK(queue);
+    while(n < cnt && (head = mcached_queue_first_used(queue)) != NULL)
+    {
+        LIST_HEAD(cut);
+        int take = cnt - n;
+
+        last = mcached_queue_list_nth(head, &take);
+        list_cut_position(&cut, head, last);
+
+        if(mcached_queue_slot_tracked(queue))
+        {
+            if(queue->prio_levels && list_empty(head))
+                queue->prio_bitmap &= ~(1ULL << (head - queue->prio_lists));
+            if(queue->index)
+            {
+                list_for_each(pos, &cut)
+                    mcached_hindex_remove(queue->index, MCACHED_QUEUE_ITEM_INDEX(queue, pos));
+            }
+            if(queue->key_col)
+            {
+                list_for_each(pos, &cut)
+                    mcached_queue_key_clear(queue, MCACHED_QUEUE_ITEM_INDEX(queue, pos));
+            }
+            if(queue->persist_hdr)
+            {
+                list_for_each(pos, &cut)
+                    mcached_queue_persist_unlink(queue, MCACHED_QUEUE_ITEM_INDEX(queue, pos));
+            }
+        }
+
+        if(queue->residency)
+        {
+            uint64 now = mcached_queue_now_ns();
+
+            list_for_each(pos, &cut)
+                mcached_queue_residency_done(queue, pos, now);
+        }
+
+        /*they stay chained on out_list, so del must be told they left*/
+        list_for_each(pos, &cut)
+            mcached_queue_mark_taken(queue, pos);
+
+        list_splice_tail(&cut, out_list);
+        n += take;
+    }
+    MCACHED_QUEUE_UNLOCK(queue);
+
+    if(n > 0)
+        mcached_queue_persist_sync(queue);
+    mcached_queue_pop_batch_done(queue, n);
+
+    return n;
+}
+
+int
+mcached_queue_get_idle_items(mcached_queue_t *queue, int cnt, struct list_head *out_list)
+{
+    struct list_head *last, *item;
+    LIST_HEAD(cut);
+    int n;
+
+    EMBED_ASSERT_RETURN(queue != NULL && out_list != NULL, 0);
+
+    if(cnt <= 0)
+        return 0;
+
+    if(queue->mode != MCACHED_QUEUE_MODE_LIST)
+    {
+        for(n = 0; n < cnt; n++)
+        {
+            if(mcached_queue_get_idle_item(queue, &item) != EMBED_SUCCESS)
+                break;
+            list_add_tail(item, out_list);
+        }
+
+        return n;
+    }
+
+    n = cnt;
+
+    MCACHED_QUEUE_LOCK(queue);
+    mcached_queue_epoch_reclaim(queue);
+    last = mcached_queue_list_nth(queue->idle_list, &n);
+    if(n > 0)
+        list_cut_position(&cut, queue->idle_list, last);
+
+    if(queue->elastic_chunk_cnt)
+    {
+        list_for_each(item, &cut)
+            mcached_queue_elastic_idle(queue, item, -1);
+    }
+
+    while(n < cnt && (queue->used_item_cnt < queue->max_item_cnt
+                || mcached_queue_elastic_grow(queue)))
+    {
+        list_add_tail(MCACHED_QUEUE_ITEM(queue, queue->used_item_cnt), &cut);
+        queue->used_item_cnt++;
+        n++;
+    }
+    MCACHED_QUEUE_UNLOCK(queue);
+
+    list_splice_tail(&cut, out_list);
+
+    if(n < cnt)
+        MCACHED_QUEUE_STAT_ADD(queue, full, 1);
+
+    return n;
+}
+
+void
+mcached_queue_put_idle_items(mcached_queue_t *queue, struct list_head *batch)
+{
+    struct list_head *pos, *n;
+
+    if(list_empty(batch))
+        return;
+
+    if(queue->mode != MCACHED_QUEUE_MODE_LIST)
+    {
+        list_for_each_safe(pos, n, batch)
+            mcached_queue_ring_put(queue, false, MCACHED_QUEUE_ITEM_INDEX(queue, pos));
+        INIT_LIST_HEAD(batch);
+        return;
+    }
+
+    MCACHED_QUEUE_LOCK(queue);
+    if(queue->taken_cnt)
+    {
+        list_for_each(pos, batch)
+            mcached_queue_clear_taken(queue, pos);
+    }
+    if(queue->elastic_chunk_cnt)
+    {
+        list_for_each(pos, batch)
+            mcached_queue_elastic_idle(queue, pos, 1);
+    }
+    list_splice_tail_init(batch, queue->idle_list);
+    mcached_queue_elastic_trim(queue);
+    MCACHED_QUEUE_UNLOCK(queue);
+}
+
+/*
+ * writev iov[0..cnt) without waiting for fd, returns how many entries were
+ * completely written; a partly written entry is left advanced past the
+ * bytes that went out
+ */
+static int
+mcached_queue_drain_stream(int fd, struct iovec *iov, int cnt)
+{
+    int done = 0;
+    ssize_t w;
+
+    while(done < cnt)
+    {
+        w = writev(fd, iov + done, cnt - done);
+        if(w < 0 && errno == EINTR)
+            continue;
+        if(w <= 0)
+            break;
+
+        /*resume a partial write inside the entry it stopped in*/
+        while(w > 0)
+        {
+            if((size_t)w >= iov[done].iov_len)
+            {
+                w -= iov[done].iov_len;
+                done++;
+            }
+            else
+            {
+                iov[done].iov_base = (char *)iov[done].iov_base + w;
+                iov[done].iov_len -= w;
+                w = 0;
+            }
+        }
+    }
+
+    return done;
+}
+
+/*One datagram per entry without waiting for fd, returns how many were sent*/
+static int
+mcached_queue_drain_dgram(int fd, struct iovec *iov, int cnt)
+{
+    struct mmsghdr msgs[MCACHED_QUEUE_DRAIN_MAX];
+    int done = 0, i, sent;
+
+    memset(msgs, 0, cnt * sizeof(struct mmsghdr));
+    for(i = 0; i < cnt; i++)
+    {
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while(done < cnt)
+    {
+        sent = sendmmsg(fd, msgs + done, cnt - done, 0);
+        if(sent < 0 && errno == EINTR)
+            continue;
+        if(sent <= 0)
+            break;
+
+        done += sent;
+    }
+
+    return done;
+}
+
+/*
+ * Up to cnt items from the head, in pop order, without taking them: under
+ * mlock in list mode, on the consumer side of the SPSC ring otherwise
+ */
+static int
+mcached_queue_drain_peek(mcached_queue_t *queue, struct list_head **items, int cnt)
+{
+    struct list_head *pos;
+    uint32 index;
+    int level, n = 0;
+
+    if(queue->mode == MCACHED_QUEUE_MODE_SPSC)
+    {
+        while(n < cnt && mcached_spsc_ring_peek(queue->used_spsc, n, &index))
+            items[n++] = MCACHED_QUEUE_ITEM(queue, index);
+        return n;
+    }
+
+    /*age the levels once, the walk below keeps the order pop would use*/
+    if(mcached_queue_first_used(queue) == NULL)
+        return 0;
+
+    for(level = 0; level < mcached_queue_used_levels(queue); level++)
+    {
+        list_for_each(pos, mcached_queue_used_head(queue, level))
+        {
+            if(n == cnt)
+                return n;
+            items[n++] = pos;
+        }
+    }
+
+    return n;
+}
+
+int
+mcached_queue_drain_to_fd(mcached_queue_t *queue, int fd, int max_items, size_t max_bytes,
+        struct list_head **partial, size_t *partial_off)
+{
+    struct iovec iov[MCACHED_QUEUE_DRAIN_MAX];
+    struct list_head *items[MCACHED_QUEUE_DRAIN_MAX];
+    size_t len, off = 0;
+    int cnt, n, done = 0, i, sock_type, err = 0;
+    socklen_t opt_len = sizeof(sock_type);
+    embed_bool_t dgram;
+
+    EMBED_ASSERT_RETURN(queue != NULL && fd >= 0 && max_items >= 0, -1);
+    EMBED_ASSERT_RETURN(partial != NULL && partial_off != NULL, -1);
+
+    *partial = NULL;
+    *partial_off = 0;
+
+    /*consumers of a shared ring cannot leave unsent items at its head*/
+    if(queue->mode == MCACHED_QUEUE_MODE_MPMC_RING)
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    len = queue->item_size - sizeof(struct list_head);
+    if(len == 0)
+        return 0;
+
+    cnt = max_items < MCACHED_QUEUE_DRAIN_MAX ? max_items : MCACHED_QUEUE_DRAIN_MAX;
+    if(max_bytes && max_bytes / len < (size_t)cnt)
+        cnt = max_bytes / len;
+    if(cnt == 0)
+        return 0;
+
+    dgram = getsockopt(fd, SOL_SOCKET, SO_TYPE, &sock_type, &opt_len) == 0 && sock_type == SOCK_DGRAM;
+
+    /*held across the write, so nothing else can take the items written*/
+    if(queue->mode == MCACHED_QUEUE_MODE_LIST)
+        MCACHED_QUEUE_LOCK(queue);
+
+    n = mcached_queue_drain_peek(queue, items, cnt);
+    for(i = 0; i < n; i++)
+    {
+        iov[i].iov_base = (char *)items[i] + sizeof(struct list_head);
+        iov[i].iov_len = len;
+    }
+
+    if(n > 0)
+    {
+        done = dgram ? mcached_queue_drain_dgram(fd, iov, n) : mcached_queue_drain_stream(fd, iov, n);
+        err = errno;
+        if(done < n)
+            off = len - iov[done].iov_len;
+    }
+
+    if(queue->mode == MCACHED_QUEUE_MODE_LIST)
+    {
+        /*mlock is recursive: the written items leave and recycle as del would*/
+        for(i = 0; i < done; i++)
+            mcached_queue_del(queue, items[i]);
+        if(off)
+            mcached_queue_unlink_used(queue, items[done]);
+        MCACHED_QUEUE_UNLOCK(queue);
+
+        if(off)
+        {
+            if(queue->epoch_enabled)
+                mcached_queue_epoch_synchronize(queue);
+            mcached_queue_persist_sync(queue);
+            mcached_queue_residency_leave(queue, items[done]);
+            MCACHED_QUEUE_STAT_ADD(queue, dequeue, 1);
+        }
+    }
+    else
+    {
+        mcached_spsc_ring_skip(queue->used_spsc, done + (off > 0));
+        for(i = 0; i < done + (off > 0); i++)
+            mcached_queue_residency_leave(queue, items[i]);
+        for(i = 0; i < done; i++)
+            mcached_queue_ring_put(queue, false, MCACHED_QUEUE_ITEM_INDEX(queue, items[i]));
+        MCACHED_QUEUE_STAT_ADD(queue, dequeue, done + (off > 0));
+    }
+
+    /*every item taken consumes its token, as a pop would*/
+    for(i = 0; i < done + (off > 0); i++)
+        embed_ready_event_trywait(queue->ready_event);
+
+    if(n == 0)
+    {
+        MCACHED_QUEUE_STAT_ADD(queue, empty, 1);
+        return 0;
+    }
+
+    if(off)
+    {
+        *partial = items[done];
+        *partial_off = off;
+    }
+
+    if(done > 0 || off > 0)
+        return done;
+
+    errno = err;
+
+    return -1;
+}
+
+struct mcached_queue_key_match
+{
+    mcached_queue_t *queue;
+    const void *key;
+};
+
+static embed_bool_t
+mcached_queue_key_match(uint32 slot, void *arg)
+{
+    struct mcached_queue_key_match *m = (struct mcached_queue_key_match *)arg;
+
+    return m->queue->index_compare(MCACHED_QUEUE_ITEM(m->queue, slot), (void *)m->key);
+}
+
+int
+mcached_queue_find_by_key(mcached_queue_t *queue, const void *key,
+        struct list_head **find_item)
+{
+    struct mcached_queue_key_match m;
+    uint32 hash;
+    int32 slot;
+
+    EMBED_ASSERT_RETURN(queue != NULL && find_item != NULL, EMBED_FAILD);
+
+    if(queue->index == NULL)
+        return EMBED_FAILD;
+
+    m.queue = queue;
+    m.key = key;
+    hash = queue->index_hash(key);
+
+    MCACHED_QUEUE_LOCK(queue);
+    slot = mcached_hindex_lookup(queue->index, hash, mcached_queue_key_match, &m);
+    MCACHED_QUEUE_UNLOCK(queue);
+
+    if(slot < 0)
+        return EMBED_FAILD;
+
+    *find_item = MCACHED_QUEUE_ITEM(queue, slot);
+
+    return EMBED_SUCCESS;
+}
+
+/*
+ * Key column scans: the first used slot in [begin, end) holding key, or
+ * -1. begin is a multiple of 64 and key_col is allocated in whole words,
+ * so each step covers one validity word.
+ */
+typedef int (*mcached_queue_key_scan_fn)(const uint64 *col, const uint64 *valid,
+        int begin, int end, uint64 key);
+
+static inline uint64
+mcached_queue_key_live(const uint64 *valid, int base, int end)
+{
+    uint64 live = valid[base / 64];
+
+    if(end - base < 64)
+        live &= (1ULL << (end - base)) - 1;
+
+    return live;
+}
+
+static int
+mcached_queue_key_scan_scalar(const uint64 *col, const uint64 *valid, int begin, int end, uint64 key)
+{
+    int base, j;
+
+    for(base = begin; base < end; base += 64)
+    {
+        uint64 live = mcached_queue_key_live(valid, base, end), hit = 0;
+
+        if(live == 0)
+            continue;
+
+        for(j = 0; j < 64; j++)
+            hit |= (uint64)(col[base + j] == key) << j;
+
+        if(hit & live)
+            return base + __builtin_ctzll(hit & live);
+    }
+
+    return -1;
+}
+
+#if MCACHED_QUEUE_KEY_SIMD && defined(__x86_64__)
+__attribute__((target("avx2")))
+static int
+mcached_queue_key_scan_avx2(const uint64 *col, const uint64 *valid, int begin, int end, uint64 key)
+{
+    __m256i k = _mm256_set1_epi64x((long long)key);
+    int base, j;
+
+    for(base = begin; base < end; base += 64)
+    {
+        uint64 live = mcached_queue_key_live(valid, base, end), hit = 0;
+
+        if(live == 0)
+            continue;
+
+        for(j = 0; j < 64; j += 4)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(col + base + j));
+
+            hit |= (uint64)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, k))) << j;
+        }
+
+        if(hit & live)
+            return base + __builtin_ctzll(hit & live);
+    }
+
+    return -1;
+}
+
+__attribute__((target("avx512f")))
+static int
+mcached_queue_key_scan_avx512(const uint64 *col, const uint64 *valid, int begin, int end, uint64 key)
+{
+    __m512i k = _mm512_set1_epi64((long long)key);
+    int base, j;
+
+    for(base = begin; base < end; base += 64)
+    {
+        uint64 live = mcached_queue_key_live(valid, base, end), hit = 0;
+
+        if(live == 0)
+            continue;
+
+        for(j = 0; j < 64; j += 8)
+            hit |= (uint64)_mm512_cmpeq_epu64_mask(_mm512_loadu_si512(col + base + j), k) << j;
+
+        if(hit & live)
+            return base + __builtin_ctzll(hit & live);
+    }
+
+    return -1;
+}
+#endif
+
+static mcached_queue_key_scan_fn
+mcached_queue_key_scan(void)
+{
+    static mcached_queue_key_scan_fn scan;
+
+    if(scan)
+        return scan;
+
+    scan = mcached_queue_key_scan_scalar;
+#if MCACHED_QUEUE_KEY_SIMD && defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f"))
+        scan = mcached_queue_key_scan_avx512;
+    else if(__builtin_cpu_supports("avx2"))
+        scan = mcached_queue_key_scan_avx2;
+#endif
+
+    return scan;
+}
+
+int
+mcached_queue_find_keys(mcached_queue_t *queue, const uint64 *keys, int cnt,
+        struct list_head **items)
+{
+    mcached_queue_key_scan_fn scan;
+    int begin, end, i, slot, found = 0;
+
+    EMBED_ASSERT_RETURN(queue != NULL && keys != NULL && items != NULL && cnt >= 0, 0);
+
+    if(queue->key_col == NULL)
+        return 0;
+
+    scan = mcached_queue_key_scan();
+
+    for(i = 0; i < cnt; i++)
+        items[i] = NULL;
+
+    MCACHED_QUEUE_LOCK(queue);
+    /*chunk outer, keys inner: the column streams through the cache once*/
+    for(begin = 0; begin < queue->used_item_cnt && found < cnt; begin += MCACHED_QUEUE_KEY_CHUNK)
+    {
+        end = begin + MCACHED_QUEUE_KEY_CHUNK;
+        if(end > queue->used_item_cnt)
+            end = queue->used_item_cnt;
+
+        for(i = 0; i < cnt; i++)
+        {
+            if(items[i])
+                continue;
+
+            slot = scan(queue->key_col, queue->key_valid, begin, end, keys[i]);
+            if(slot >= 0)
+            {
+                items[i] = MCACHED_QUEUE_ITEM(queue, slot);
+                found++;
+            }
+        }
+    }
+    MCACHED_QUEUE_UNLOCK(queue);
+
+    return found;
+}
+
+int
+mcached_queue_find_key(mcached_queue_t *queue, uint64 key, struct list_head **find_item)
+{
+    EMBED_ASSERT_RETURN(find_item != NULL, EMBED_FAILD);
+
+    return mcached_queue_find_keys(queue, &key, 1, find_item) == 1 ? EMBED_SUCCESS : EMBED_FAILD;
+}
+
+/*Unlink the head of the used list (or used ring) with one lock round trip*/
+static embed_bool_t
+mcached_queue_take_head(void *mcached_queue, void *out)
+{
+    mcached_queue_t *queue = (mcached_queue_t *)mcached_queue;
+    struct list_head **item = (struct list_head **)out;
+    struct list_head *head, *first = NULL;
+
+    if(queue->mode != MCACHED_QUEUE_MODE_LIST)
+    {
+        uint32 index;
+
+        /*
+         * A producer claims its cell before it fills it, so the head can
+         * still be empty while a later cell is filled and signalled. Give
+         * up only once no claimed cell is left, or that token is lost.
+         */
+        while(!mcached_queue_ring_take(queue, true, &index))
+        {
+            if(queue->mode == MCACHED_QUEUE_MODE_SPSC
+                    || (int32)mcached_ring_count(queue->used_ring) <= 0)
+                return false;
+            sched_yield();
+        }
+
+        *item = MCACHED_QUEUE_ITEM(queue, index);
+        mcached_queue_residency_leave(queue, *item);
+        MCACHED_QUEUE_STAT_ADD(queue, dequeue, 1);
+        return true;
+    }
+
+    MCACHED_QUEUE_LOCK(queue);
+    head = mcached_queue_first_used(queue);
+    if(head)
+    {
+        first = head->next;
+        /*self linked (or prev cleared), so a later mcached_queue_del only recycles it*/
+        mcached_queue_unlink_used(queue, first);
+    }
+    MCACHED_QUEUE_UNLOCK(queue);
+
+    if(first == NULL)
+        return false;
+
+    /*a lockless reader may still be on it, hand it out once they are gone*/
+    if(queue->epoch_enabled)
+        mcached_queue_epoch_synchronize(queue);
+
+    *item = first;
+    mcached_queue_persist_sync(queue);
+    mcached_queue_residency_leave(queue, first);
+    MCACHED_QUEUE_STAT_ADD(queue, dequeue, 1);
+
+    return true;
+}
+
+int
+mcached_queue_pop(mcached_queue_t *queue, struct list_head **item)
+{
+    embed_status_t status;
+    embed_bool_t blocked;
+
+    EMBED_ASSERT_RETURN(queue != NULL && item != NULL, EMBED_FAILD);
+
+    status = embed_ready_event_pop(queue->ready_event, mcached_queue_take_head,
+            queue, item, NULL, &blocked);
+    if(blocked)
+        MCACHED_QUEUE_STAT_ADD(queue, blocked_pops, 1);
+
+    return status;
+}
+
+int
+mcached_queue_trypop(mcached_queue_t *queue, struct list_head **item)
+{
+    EMBED_ASSERT_RETURN(queue != NULL && item != NULL, EMBED_FAILD);
+
+    if(embed_ready_event_trypop(queue->ready_event, mcached_queue_take_head,
+            queue, item) != EMBED_SUCCESS)
+    {
+        MCACHED_QUEUE_STAT_ADD(queue, empty, 1);
+        return EMBED_FAILD;
+    }
+
+    return EMBED_SUCCESS;
+}
+
+int
+mcached_queue_timedpop(mcached_queue_t *queue, struct list_head **item,
+        const struct timespec *deadline)
+{
+    embed_status_t status;
+    embed_bool_t blocked;
+
+    EMBED_ASSERT_RETURN(queue != NULL && item != NULL && deadline != NULL, EMBED_FAILD);
+
+    status = embed_ready_event_pop(queue->ready_event, mcached_queue_take_head,
+            queue, item, deadline, &blocked);
+    if(blocked)
+        MCACHED_QUEUE_STAT_ADD(queue, blocked_pops, 1);
+    if(status != EMBED_SUCCESS)
+        MCACHED_QUEUE_STAT_ADD(queue, empty, 1);
+
+    return status;
+}
@@ -1,82 +1,658 @@
-#ifndef __MCACHEDLIST_H_
-#define __MCACHEDLIST_H_
-
-#include "list.h"
-#include "event.h"
-#include "assert.h"
-
-#include <pthread.h>
-
-typedef struct 
-{
-    struct list_head _idle_list;
-    struct list_head _used_list;
-
-    struct list_head *idle_list;
-    struct list_head *used_list;
-
-    char   *mem_cached;
-
-    int    max_item_cnt;
-    int    used_item_cnt;
-
-    pthread_mutex_t _mlock;
-    pthread_mutex_t *mlock;
-
-    pthread_mutexattr_t _mlattr;
-    pthread_mutexattr_t *mlattr;
-
-    embed_ready_event_t *ready_event;
-}mcached_queue_t;
-
-typedef void (*traverse_item_cb)(mcached_queue_t *mcached_queue, struct list_head *item);
-typedef bool (*find_compared_cb)(struct list_head *queue_item,  void *find_item);
-
-#define IS_IDLE_LIST_EMPTY(list) \
-    (\
-     ((list)->used_item_cnt >= (list)->max_item_cnt) \
-     &&\
-     ((list_empty((list)->idle_list)))\
-    ) \
-
-#define MCACHED_QUEUE_LOCK(queue) \
-do \
-{\
-    pthread_mutex_lock((queue)->mlock);\
-}while(0)
-
-#define MCACHED_QUEUE_UNLOCK(queue) \
-do \
-{\
-    pthread_mutex_unlock((queue)->mlock);\
-}while(0)
-
-
-int
-mcached_queue_init(mcached_queue_t *queue, int item_size, int item_cnt);
-
-int 
-mcached_queue_destroy(mcached_queue_t *queue);
-
-int
-mcached_queue_add(mcached_queue_t *queue, struct list_head *new_item);
-
-void
-mcached_queue_del(mcached_queue_t *queue, struct list_head *del_item);
-
-int
-mcached_queue_get_idle_item(mcached_queue_t *queue, struct list_head **item);
-
-void 
-mcached_queue_traverse(mcached_queue_t *queue, traverse_item_cb item_handler);
-
-int 
-mcached_queue_find(
-        mcached_queue_t *queue, 
-        void *find_index,
-        find_compared_cb compared, 
-        struct list_head **find_item
-        );
-
-#endif
-
+#ifndef __MCACHEDLIST_H_
+#define __MCACHEDLIST_H_
+
+#include "list.h"
+#include "event.h"
+#include "ring.h"
+#include "hindex.h"
+#include "hist.h"
+#include "pool.h"
+#include "assert.h"
+
+#include <pthread.h>
+
+/*
+ * How the queue tracks used and idle slots of mem_cached.
+ *
+ * MCACHED_QUEUE_MODE_LIST keeps both sets on mutex guarded lists linked
+ * through the list_head at the start of every slot.
+ *
+ * MCACHED_QUEUE_MODE_MPMC_RING keeps slot indices on two lock-free bounded
+ * MPMC rings instead, so add/get_idle_item/del never take mlock. Items
+ * leave the queue in FIFO order only: mcached_queue_traverse hands every
+ * item it visits over to the callback, which releases it with
+ * mcached_queue_del, and mcached_queue_find is not supported.
+ *
+ * MCACHED_QUEUE_MODE_SPSC is the same contract for exactly one producer
+ * thread (get_idle_item/add) and one consumer thread (traverse/del). Both
+ * rings are wait-free SPSC rings that need only acquire/release ordering.
+ */
+typedef enum
+{
+    MCACHED_QUEUE_MODE_LIST,
+    MCACHED_QUEUE_MODE_MPMC_RING,
+    MCACHED_QUEUE_MODE_SPSC
+}mcached_queue_mode_t;
+
+/*
+ * Optional eventfd signalled by add/add_batch, so a consumer can epoll many
+ * queues at once.
+ *
+ * MCACHED_QUEUE_EVENTFD_COUNTER is edge triggered and coalesced: only the
+ * first add after mcached_queue_eventfd_ack writes the fd, later adds find
+ * it already armed. The consumer acks, then drains the queue until empty.
+ *
+ * MCACHED_QUEUE_EVENTFD_SEMAPHORE opens the fd with EFD_SEMAPHORE and
+ * writes the number of items once per add/add_batch call, so every read
+ * by any of several event loops stands for one item.
+ */
+typedef enum
+{
+    MCACHED_QUEUE_EVENTFD_NONE,
+    MCACHED_QUEUE_EVENTFD_COUNTER,
+    MCACHED_QUEUE_EVENTFD_SEMAPHORE
+}mcached_queue_eventfd_mode_t;
+
+/*
+ * When a persistent queue flushes its file, see mcached_queue_attr_t.persist_path.
+ *
+ * MCACHED_QUEUE_SYNC_NONE leaves write back to the kernel, a process crash
+ * loses nothing but a machine crash can. MCACHED_QUEUE_SYNC_PERIODIC
+ * starts an asynchronous msync at most every persist_sync_ms, from the
+ * first add/pop/del after the period. MCACHED_QUEUE_SYNC_BATCH msyncs
+ * synchronously at the end of every add, add_batch, pop, pop_batch and del.
+ */
+typedef enum
+{
+    MCACHED_QUEUE_SYNC_NONE,
+    MCACHED_QUEUE_SYNC_PERIODIC,
+    MCACHED_QUEUE_SYNC_BATCH
+}mcached_queue_sync_mode_t;
+
+typedef bool (*find_compared_cb)(struct list_head *queue_item,  void *find_item);
+typedef const void *(*item_key_cb)(struct list_head *item);
+typedef uint32 (*key_hash_cb)(const void *key);
+typedef uint64 (*item_key64_cb)(struct list_head *item);
+
+typedef struct
+{
+    mcached_queue_mode_t mode;
+
+    /*
+     * MCACHED_QUEUE_MODE_LIST only: when non-zero every thread keeps up to
+     * magazine_size idle items of its own in front of idle_list, refilled
+     * and flushed half a magazine at a time under mlock.
+     */
+    int magazine_size;
+
+    /*
+     * Slab layout. Slots are item_size + slot_pad bytes rounded up to
+     * slot_align (0 or a power of two, e.g. EMBED_CACHE_LINE_SIZE or 128
+     * so neighbouring items never share a line). slab_flags picks the
+     * backing memory, see MCACHED_QUEUE_SLAB_*. With MCACHED_QUEUE_SLAB_NUMA
+     * the slab pages are bound to numa_node before they are first touched.
+     */
+    int slot_align;
+    int slot_pad;
+    int slab_flags;
+    int numa_node;
+
+    /*
+     * MCACHED_QUEUE_MODE_LIST only: set all three to keep a hash index of
+     * the used items for mcached_queue_find_by_key. index_key returns the
+     * key stored in an item, index_hash hashes a key and index_compare
+     * tells whether an item carries the given key.
+     */
+    item_key_cb      index_key;
+    key_hash_cb      index_hash;
+    find_compared_cb index_compare;
+
+    /*
+     * MCACHED_QUEUE_MODE_LIST only: keep the 8-byte key that key_column
+     * returns for every used item in a dense array indexed by slot, with a
+     * validity bitmap, for mcached_queue_find_key(s).
+     */
+    item_key64_cb    key_column;
+
+    mcached_queue_eventfd_mode_t eventfd_mode;
+
+    /*
+     * MCACHED_QUEUE_MODE_LIST only: with prio_levels > 1 the used items are
+     * kept on that many FIFO lists, level 0 being the most urgent, see
+     * mcached_queue_add_prio. pop, pop_batch, traverse and find serve the
+     * most urgent non-empty level first. When prio_age_ns is set, the head
+     * of a less urgent level that has waited that long moves up one level
+     * on the next pop, so bulk items cannot starve.
+     */
+    int    prio_levels;
+    uint64 prio_age_ns;
+
+    /*
+     * Stamp every item (CLOCK_MONOTONIC) on add and record how long it
+     * stayed queued into a histogram when it is popped, traversed out of
+     * a ring or deleted, see mcached_queue_residency.
+     */
+    int    residency_hist;
+
+    /*
+     * MCACHED_QUEUE_MODE_LIST without prio_levels only: back mem_cached
+     * with this file and keep the FIFO of used slots in it as a chain of
+     * slot numbers. A later init with the same path, item_size and
+     * item_cnt reattaches: the used items come back in order and every
+     * other slot that was handed out becomes idle, in time proportional
+     * to the slots ever used rather than to the file size.
+     */
+    const char *persist_path;
+    mcached_queue_sync_mode_t persist_sync;
+    uint32 persist_sync_ms;
+
+    /*
+     * MCACHED_QUEUE_MODE_LIST without magazines or persist_path only: with
+     * elastic_max_cnt > item_cnt the slab reserves address space for
+     * elastic_max_cnt slots but starts with item_cnt. When it is full, it
+     * grows by elastic_chunk_cnt slots (default item_cnt). Once the highest
+     * chunk has been completely idle for elastic_idle_ms, its pages go
+     * back to the OS, then the next one down once it qualifies too, and
+     * the capacity shrinks again, never below item_cnt.
+     */
+    int    elastic_max_cnt;
+    int    elastic_chunk_cnt;
+    uint32 elastic_idle_ms;
+
+    /*
+     * MCACHED_QUEUE_MODE_LIST without prio_levels or magazines only:
+     * traverse and find walk the used list without mlock, so a slow
+     * callback no longer stalls add. Items leaving the queue through del
+     * stay out of idle_list until every reader that was active when they
+     * left has finished (epoch based), and pop, trypop, timedpop and
+     * pop_batch wait for those readers before handing out what they took,
+     * so popped items may go on local lists and back through
+     * put_idle_items. Callbacks may add and del, but not pop.
+     */
+    int    lockless_read;
+}mcached_queue_attr_t;
+
+#define MCACHED_QUEUE_MAX_PRIO  64
+
+/*Back mem_cached with 2MB transparent huge pages (madvise)*/
+#define MCACHED_QUEUE_SLAB_THP      0x01
+/*Back mem_cached with explicit MAP_HUGETLB pages, init fails without them*/
+#define MCACHED_QUEUE_SLAB_HUGETLB  0x02
+/*Bind mem_cached to attr.numa_node (mbind), init fails if the node is not online*/
+#define MCACHED_QUEUE_SLAB_NUMA     0x04
+
+#define MCACHED_QUEUE_NUMA_MAX_NODES 1024
+
+/*
+ * Runtime statistics. Build with -DMCACHED_QUEUE_STATS=0 to compile every
+ * counter, the per-thread blocks and the timed lock wrappers out;
+ * mcached_queue_get_stats then fails.
+ */
+#ifndef MCACHED_QUEUE_STATS
+#define MCACHED_QUEUE_STATS 1
+#endif
+
+/*lock hold time is measured on one in this many acquisitions and scaled*/
+#define MCACHED_QUEUE_STATS_HOLD_SAMPLE  64
+
+typedef struct
+{
+    uint64 enqueue;         /*items added*/
+    uint64 dequeue;         /*items taken off the used set*/
+    uint64 full;            /*idle item requests refused or cut short*/
+    uint64 empty;           /*trypop/timedpop/pop_batch that found nothing*/
+    uint64 blocked_pops;    /*pop/timedpop that had to wait on ready_event*/
+
+    uint64 lock_acquired;
+    uint64 lock_contended;
+    uint64 lock_wait_ns;    /*time spent waiting for a contended mlock*/
+    uint64 lock_hold_ns;    /*sampled, see MCACHED_QUEUE_STATS_HOLD_SAMPLE*/
+
+    /*set by mcached_queue_get_stats only*/
+    uint64 queued;          /*enqueue - dequeue when collected*/
+    int    used_item_hwm;   /*slots carved from mem_cached, only an elastic shrink lowers it*/
+    int    max_item_cnt;
+    int    threads;         /*threads that touched the queue and are alive*/
+}mcached_queue_stats_t;
+
+/*
+ * Counters of one thread for one queue. Only the owning thread writes
+ * them, so the hot path never shares a cache line with other threads.
+ */
+typedef struct
+{
+    mcached_queue_stats_t c;
+
+    int    lock_depth;
+    uint64 hold_start;
+
+    struct list_head node;
+    void *queue;
+}EMBED_CACHE_ALIGNED mcached_queue_thread_stats_t;
+
+/*Read side state of one thread for one lockless_read queue*/
+typedef struct
+{
+    /*epoch seen on entry, 0 outside a read section*/
+    uint64 active;
+    int    depth;
+
+    struct list_head node;
+    void *queue;
+}EMBED_CACHE_ALIGNED mcached_queue_reader_t;
+
+#define MCACHED_QUEUE_PERSIST_MAGIC    0x6d635046u /*"mcPF"*/
+#define MCACHED_QUEUE_PERSIST_VERSION  1
+#define MCACHED_QUEUE_PERSIST_NIL      ((uint32)-1)
+
+/*
+ * Page at the start of a persistent queue file, followed by next[] (one
+ * uint32 per slot) and the page aligned slab. Walking next[] from head is
+ * the whole on-disk state: every change to it is published by a single
+ * aligned store, so a crash between any two stores leaves a valid chain.
+ */
+typedef struct
+{
+    uint32 magic;
+    uint32 version;
+    uint32 item_size;
+    uint32 item_stride;
+    uint32 max_item_cnt;
+
+    uint32 head;
+    /*hint only, recovery recomputes it from the chain*/
+    uint32 tail;
+
+    uint64 next_off;
+    uint64 slab_off;
+    uint64 file_size;
+}mcached_queue_persist_hdr_t;
+
+/*Per-thread idle item magazine, see mcached_queue_attr_t.magazine_size*/
+typedef struct
+{
+    struct list_head node;
+    void *queue;
+
+    int cnt;
+    struct list_head *rounds[];
+}mcached_queue_magazine_t;
+
+typedef struct 
+{
+    struct list_head _idle_list;
+    struct list_head _used_list;
+
+    struct list_head *idle_list;
+    struct list_head *used_list;
+
+    char   *mem_cached;
+
+    int    item_size;
+    int    item_stride;
+    int    max_item_cnt;
+    int    used_item_cnt;
+
+    /*slots the slab and per-slot arrays are sized for, see elastic_max_cnt*/
+    int    slot_cap;
+
+    int    elastic_min_cnt;
+    int    elastic_chunk_cnt;
+    uint64 elastic_idle_ns;
+    /*idle_list members per chunk, and when each last became fully idle*/
+    int    *chunk_idle;
+    uint64 *chunk_idle_since;
+
+    mcached_queue_mode_t mode;
+
+    int    slab_flags;
+    int    numa_node;
+    size_t slab_size;
+
+    /*persistent mode, see mcached_queue_attr_t.persist_path*/
+    int    persist_fd;
+    char   *persist_map;
+    size_t persist_size;
+    mcached_queue_persist_hdr_t *persist_hdr;
+    uint32 *persist_next;
+    uint32 *persist_prev;
+    mcached_queue_sync_mode_t persist_sync;
+    uint64 persist_sync_ns;
+    uint64 persist_synced_at;
+
+    mcached_ring_t *used_ring;
+    mcached_ring_t *idle_ring;
+
+    mcached_spsc_ring_t *used_spsc;
+    mcached_spsc_ring_t *idle_spsc;
+
+    int magazine_size;
+    pthread_key_t magazine_key;
+    struct list_head magazines;
+
+    int    prio_levels;
+    uint64 prio_age_ns;
+    uint64 prio_bitmap;
+    struct list_head *prio_lists;
+    uint8  *item_prio;
+    uint64 *item_stamp;
+
+    mcached_hist_t *residency;
+    uint64 *item_add_ns;
+
+    /*lockless_read mode, slots wait in limbo until readers move past them*/
+    int    epoch_enabled;
+    uint64 epoch;
+    pthread_key_t epoch_key;
+    struct list_head epoch_readers;
+    uint32 *limbo_slot;
+    uint64 *limbo_epoch;
+    int    limbo_head;
+    int    limbo_cnt;
+
+    /*list mode, bit i set while slot i waits on a pop_batch out_list*/
+    uint64 *item_taken;
+    int    taken_cnt;
+
+    /*workers of mcached_queue_traverse_parallel, created on first use*/
+    mcached_pool_t *pool;
+
+    mcached_hindex_t *index;
+
+    item_key64_cb key_column;
+    uint64 *key_col;
+    /*bit i set while slot i is used*/
+    uint64 *key_valid;
+    item_key_cb      index_key;
+    key_hash_cb      index_hash;
+    find_compared_cb index_compare;
+
+    pthread_mutex_t _mlock;
+    pthread_mutex_t *mlock;
+
+    pthread_mutexattr_t _mlattr;
+    pthread_mutexattr_t *mlattr;
+
+    embed_ready_event_t *ready_event;
+
+#if MCACHED_QUEUE_STATS
+    int stats_enabled;
+    pthread_key_t stats_key;
+    struct list_head stats_threads;
+    /*counters of threads that already exited*/
+    mcached_queue_stats_t stats_retired;
+#endif
+
+    int    event_fd;
+    mcached_queue_eventfd_mode_t event_fd_mode;
+    uint32 event_fd_armed;
+}mcached_queue_t;
+
+typedef void (*traverse_item_cb)(mcached_queue_t *mcached_queue, struct list_head *item);
+
+/*part is the calling worker's private result, return true to del item*/
+typedef embed_bool_t (*parallel_item_cb)(mcached_queue_t *mcached_queue, struct list_head *item, void *part);
+/*Merge one worker's part into result*/
+typedef void (*parallel_reduce_cb)(mcached_queue_t *mcached_queue, void *result, void *part);
+
+#define IS_IDLE_LIST_EMPTY(list) \
+    (\
+     ((list)->used_item_cnt >= (list)->max_item_cnt) \
+     &&\
+     ((list_empty((list)->idle_list)))\
+    ) \
+
+#if MCACHED_QUEUE_STATS
+/*mlock with wait/hold accounting for the calling thread*/
+void
+mcached_queue_stats_lock(mcached_queue_t *queue);
+
+void
+mcached_queue_stats_unlock(mcached_queue_t *queue);
+
+#define MCACHED_QUEUE_LOCK(queue) \
+do \
+{\
+    mcached_queue_stats_lock(queue);\
+}while(0)
+
+#define MCACHED_QUEUE_UNLOCK(queue) \
+do \
+{\
+    mcached_queue_stats_unlock(queue);\
+}while(0)
+#else
+#define MCACHED_QUEUE_LOCK(queue) \
+do \
+{\
+    pthread_mutex_lock((queue)->mlock);\
+}while(0)
+
+#define MCACHED_QUEUE_UNLOCK(queue) \
+do \
+{\
+    pthread_mutex_unlock((queue)->mlock);\
+}while(0)
+#endif
+
+
+#define MCACHED_QUEUE_ITEM(queue, index) \
+    ((struct list_head *)((queue)->mem_cached + (size_t)(index) * (queue)->item_stride))
+
+#define MCACHED_QUEUE_ITEM_INDEX(queue, item) \
+    ((int)(((char *)(item) - (queue)->mem_cached) / (queue)->item_stride))
+
+/*Does item point into this queue's mem_cached*/
+#define MCACHED_QUEUE_HAS_ITEM(queue, item) \
+    ((char *)(item) >= (queue)->mem_cached \
+     && (char *)(item) < (queue)->mem_cached + (size_t)(queue)->item_stride * (queue)->max_item_cnt)
+
+void
+mcached_queue_attr_init(mcached_queue_attr_t *attr);
+
+int
+mcached_queue_init(mcached_queue_t *queue, int item_size, int item_cnt);
+
+int
+mcached_queue_init_ex(mcached_queue_t *queue, int item_size, int item_cnt,
+        const mcached_queue_attr_t *attr);
+
+int 
+mcached_queue_destroy(mcached_queue_t *queue);
+
+int
+mcached_queue_add(mcached_queue_t *queue, struct list_head *new_item);
+
+/*add at level prio, plain add uses the least urgent level*/
+int
+mcached_queue_add_prio(mcached_queue_t *queue, struct list_head *new_item, int prio);
+
+/*Unlink a queued item, or recycle one taken by pop or get_idle_item*/
+void
+mcached_queue_del(mcached_queue_t *queue, struct list_head *del_item);
+
+int
+mcached_queue_get_idle_item(mcached_queue_t *queue, struct list_head **item);
+
+void 
+mcached_queue_traverse(mcached_queue_t *queue, traverse_item_cb item_handler);
+
+int 
+mcached_queue_find(
+        mcached_queue_t *queue, 
+        void *find_index,
+        find_compared_cb compared, 
+        struct list_head **find_item
+        );
+
+/*
+ * MCACHED_QUEUE_MODE_LIST only: traverse with nthreads threads, the caller
+ * and a pool of nthreads - 1 workers the queue keeps for later passes.
+ *
+ * The used items (every level) are snapshotted into an array under mlock
+ * and split into contiguous segments, one task per segment. mlock stays
+ * held until the pass is over, so item_handler runs on other threads while
+ * the queue is locked and must not call back into it; it returns true for
+ * the items to del instead, which the caller does after the join. Every
+ * segment gets a zeroed, cache line aligned part of part_size bytes that
+ * only its worker writes; reduce, when given, folds the parts into result
+ * one after another on the calling thread.
+ */
+int
+mcached_queue_traverse_parallel(mcached_queue_t *queue, parallel_item_cb item_handler,
+        int nthreads, size_t part_size, parallel_reduce_cb reduce, void *result);
+
+#define MCACHED_QUEUE_PARALLEL_MAX      64
+/*segments per thread, so a slow segment does not hold up the join*/
+#define MCACHED_QUEUE_PARALLEL_SPLIT    4
+
+/*
+ * Keep the items seen by find (or traverse) from being recycled while the
+ * caller still uses them. A read section on a lockless_read queue blocks
+ * no writer; on other queues it holds mlock. Sections nest.
+ */
+void
+mcached_queue_read_lock(mcached_queue_t *queue);
+
+void
+mcached_queue_read_unlock(mcached_queue_t *queue);
+
+/*
+ * Take the item at the head of the queue; it no longer belongs to the used
+ * list and goes back with mcached_queue_del or mcached_queue_put_idle_items.
+ *
+ * pop blocks on ready_event until an item arrives, trypop never blocks and
+ * timedpop gives up once the absolute CLOCK_MONOTONIC deadline passes.
+ * Each takes mlock once. Every add leaves one token on ready_event and
+ * every pop consumes one, so a waiter can neither miss an add nor spin on
+ * an empty queue for longer than the stale tokens left by traverse/del
+ * style consumers.
+ */
+int
+mcached_queue_pop(mcached_queue_t *queue, struct list_head **item);
+
+int
+mcached_queue_trypop(mcached_queue_t *queue, struct list_head **item);
+
+int
+mcached_queue_timedpop(mcached_queue_t *queue, struct list_head **item,
+        const struct timespec *deadline);
+
+/*The queue's eventfd for epoll, or -1 when eventfd_mode is NONE*/
+int
+mcached_queue_eventfd(mcached_queue_t *queue);
+
+/*Consume the eventfd readiness, returns the value read (0 if none)*/
+uint64
+mcached_queue_eventfd_ack(mcached_queue_t *queue);
+
+/*O(1) lookup through the hash index, see mcached_queue_attr_t.index_key*/
+int
+mcached_queue_find_by_key(mcached_queue_t *queue, const void *key,
+        struct list_head **find_item);
+
+/*
+ * Scan the key column (attr.key_column) with SIMD compares, AVX-512 or
+ * AVX2 when the CPU has them and scalar otherwise. find_keys looks up cnt
+ * keys in one pass over the column and sets items[i] to the used item
+ * with keys[i], or NULL; it returns how many were found. With duplicate
+ * keys the lowest slot wins, not the oldest item.
+ */
+int
+mcached_queue_find_key(mcached_queue_t *queue, uint64 key, struct list_head **find_item);
+
+int
+mcached_queue_find_keys(mcached_queue_t *queue, const uint64 *keys, int cnt,
+        struct list_head **items);
+
+/*Build with -DMCACHED_QUEUE_KEY_SIMD=0 to keep only the scalar scan*/
+#ifndef MCACHED_QUEUE_KEY_SIMD
+#define MCACHED_QUEUE_KEY_SIMD 1
+#endif
+
+/*column slots scanned for every key before moving on, fits in L1*/
+#define MCACHED_QUEUE_KEY_CHUNK 1024
+
+/*
+ * Batch variants. A batch is a local list_head chain of slot items, moved
+ * with one lock acquisition and one ready-event signal for the whole burst.
+ *
+ * add_batch appends every item of batch to the queue and leaves batch
+ * empty. pop_batch moves up to cnt items from the head of the queue to the
+ * tail of out_list, get_idle_items moves up to cnt idle items to the tail
+ * of out_list; both return the number of items moved. put_idle_items
+ * gives popped (or unused idle) items back and leaves batch empty.
+ *
+ * pop_batch consumes one ready token per item, like pop. Its items stay
+ * chained on out_list but are marked taken, so mcached_queue_del of one
+ * (walk out_list with list_for_each_safe) only recycles it.
+ */
+int
+mcached_queue_add_batch(mcached_queue_t *queue, struct list_head *batch);
+
+int
+mcached_queue_pop_batch(mcached_queue_t *queue, int cnt, struct list_head *out_list);
+
+int
+mcached_queue_get_idle_items(mcached_queue_t *queue, int cnt, struct list_head *out_list);
+
+void
+mcached_queue_put_idle_items(mcached_queue_t *queue, struct list_head *batch);
+
+/*
+ * Write the payloads of up to max_items items from the head of the queue
+ * (and at most max_bytes of payload, 0 for no limit), the item_size -
+ * sizeof(struct list_head) bytes after each list_head, straight from the
+ * slab to fd: one writev per burst on streams and files, one sendmmsg
+ * datagram per item on SOCK_DGRAM sockets. Returns the number of items
+ * written in full; they go back to the idle set as del would.
+ *
+ * drain never waits for fd: on a non-blocking fd it stops at EAGAIN and
+ * polling is up to the caller. Items not written at all stay at the head
+ * of the queue, in order. An item cut short by a stream is taken off the
+ * queue and handed back in *partial with the bytes already written in
+ * *partial_off; the caller writes the rest and gives it back with del.
+ * With nothing written -1 is returned with errno set.
+ *
+ * List mode holds mlock across the write, so a blocking fd stalls the
+ * producers too. In SPSC mode only the consumer thread may drain. The
+ * MPMC ring cannot keep unsent items at its head and fails with ENOTSUP.
+ */
+int
+mcached_queue_drain_to_fd(mcached_queue_t *queue, int fd, int max_items, size_t max_bytes,
+        struct list_head **partial, size_t *partial_off);
+
+/*items per drain_to_fd call, one iovec each*/
+#define MCACHED_QUEUE_DRAIN_MAX  256
+
+/*
+ * Sum the counters of every thread into stats. Other threads keep running,
+ * so the totals are a consistent snapshot per thread, not across threads.
+ */
+int
+mcached_queue_get_stats(mcached_queue_t *queue, mcached_queue_stats_t *stats);
+
+/*
+ * Residency time histogram in nanoseconds, attr.residency_hist only.
+ * Both may be called at any time while producers and consumers run.
+ */
+int
+mcached_queue_residency(mcached_queue_t *queue, mcached_hist_t *snapshot);
+
+int
+mcached_queue_residency_reset(mcached_queue_t *queue);
+
+/*
+ * Elastic queues only: give the highest chunks back to the OS for as long
+ * as the top one has been idle for elastic_idle_ms. del checks this on its
+ * own; call it from a timer to shrink queues that see no traffic at all.
+ */
+void
+mcached_queue_shrink(mcached_queue_t *queue);
+
+/*Give the calling thread's magazine back to idle_list*/
+void
+mcached_queue_magazine_flush(mcached_queue_t *queue);
+
+#endif
+
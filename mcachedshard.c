@@ -0,0 +1,367 @@
+#include "mcachedshard.h"
+#include "embed_assert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/*nodes is NULL for plain shards, else shard i is bound to nodes[i]*/
+static int
+mcached_shard_queue_init_shards(mcached_shard_queue_t *squeue, int item_size, int item_cnt,
+        int shard_cnt, const mcached_queue_attr_t *attr, const int *nodes)
+{
+    mcached_queue_attr_t shard_attr;
+    int i;
+
+    EMBED_ASSERT_RETURN(squeue != NULL && shard_cnt > 0 && item_cnt >= shard_cnt, EMBED_FAILD);
+
+    if(attr)
+        shard_attr = *attr;
+    else
+        mcached_queue_attr_init(&shard_attr);
+
+    memset(squeue, 0, sizeof(*squeue));
+
+    if(posix_memalign((void **)&squeue->shards, EMBED_CACHE_LINE_SIZE,
+                shard_cnt * sizeof(mcached_shard_t)) != 0)
+        return EMBED_FAILD;
+
+    for(i = 0; i < shard_cnt; i++)
+    {
+        /*spread the remainder so the total stays exactly item_cnt*/
+        int cnt = item_cnt / shard_cnt + (i < item_cnt % shard_cnt);
+
+        if(nodes)
+        {
+            shard_attr.slab_flags |= MCACHED_QUEUE_SLAB_NUMA;
+            shard_attr.numa_node = nodes[i];
+        }
+
+        if(mcached_queue_init_ex(MCACHED_SHARD_QUEUE(squeue, i), item_size, cnt, &shard_attr) != EMBED_SUCCESS)
+            goto err_shards;
+    }
+
+    if(embed_ready_event_create(&squeue->ready_event) != EMBED_SUCCESS)
+        goto err_shards;
+
+    squeue->shard_cnt = shard_cnt;
+    squeue->steal_batch = MCACHED_SHARD_STEAL_BATCH;
+    squeue->numa = nodes != NULL;
+
+    return EMBED_SUCCESS;
+
+err_shards:
+    while(--i >= 0)
+        mcached_queue_destroy(MCACHED_SHARD_QUEUE(squeue, i));
+    Free(squeue->shards);
+    return EMBED_FAILD;
+}
+
+int
+mcached_shard_queue_init(mcached_shard_queue_t *squeue, int item_size, int item_cnt,
+        int shard_cnt, const mcached_queue_attr_t *attr)
+{
+    return mcached_shard_queue_init_shards(squeue, item_size, item_cnt, shard_cnt, attr, NULL);
+}
+
+/*
+ * Online node ids, ascending, from a list such as "0-1" or "0,2-3"; node
+ * ids may have holes. Falls back to node 0 alone if the list is unreadable.
+ */
+static int
+mcached_shard_numa_nodes(int *nodes, int max)
+{
+    char buf[256], *p, *end;
+    FILE *fp = fopen("/sys/devices/system/node/online", "r");
+    long first, last;
+    int cnt = 0;
+
+    if(fp && fgets(buf, sizeof(buf), fp))
+    {
+        for(p = buf; *p >= '0' && *p <= '9'; p = end + (*end == ','))
+        {
+            first = last = strtol(p, &end, 10);
+            if(*end == '-')
+                last = strtol(end + 1, &end, 10);
+
+            for(; first <= last && first < MCACHED_QUEUE_NUMA_MAX_NODES - 1 && cnt < max; first++)
+                nodes[cnt++] = first;
+        }
+    }
+    if(fp)
+        fclose(fp);
+
+    if(cnt == 0)
+        nodes[cnt++] = 0;
+
+    return cnt;
+}
+
+int
+mcached_shard_queue_init_numa(mcached_shard_queue_t *squeue, int item_size, int item_cnt,
+        const mcached_queue_attr_t *attr)
+{
+    int nodes[MCACHED_QUEUE_NUMA_MAX_NODES];
+    int cnt = mcached_shard_numa_nodes(nodes, MCACHED_QUEUE_NUMA_MAX_NODES);
+
+    return mcached_shard_queue_init_shards(squeue, item_size, item_cnt, cnt, attr, nodes);
+}
+
+int
+mcached_shard_queue_local(mcached_shard_queue_t *squeue)
+{
+    unsigned cpu = 0, node = 0;
+    int i;
+
+    if(syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+        return 0;
+
+    if(!squeue->numa)
+        return cpu % squeue->shard_cnt;
+
+    for(i = 0; i < squeue->shard_cnt; i++)
+    {
+        if(MCACHED_SHARD_QUEUE(squeue, i)->numa_node == (int)node)
+            return i;
+    }
+
+    return node % squeue->shard_cnt;
+}
+
+int
+mcached_shard_queue_destroy(mcached_shard_queue_t *squeue)
+{
+    int i;
+
+    EMBED_ASSERT_RETURN(squeue != NULL, EMBED_FAILD);
+
+    for(i = 0; i < squeue->shard_cnt; i++)
+        mcached_queue_destroy(MCACHED_SHARD_QUEUE(squeue, i));
+
+    embed_ready_event_destroy(squeue->ready_event);
+    Free(squeue->shards);
+    squeue->shard_cnt = 0;
+
+    return EMBED_SUCCESS;
+}
+
+/*Shard whose slab slice holds item*/
+static mcached_queue_t *
+mcached_shard_owner(mcached_shard_queue_t *squeue, struct list_head *item)
+{
+    int i;
+
+    for(i = 0; i < squeue->shard_cnt; i++)
+    {
+        if(MCACHED_QUEUE_HAS_ITEM(MCACHED_SHARD_QUEUE(squeue, i), item))
+            return MCACHED_SHARD_QUEUE(squeue, i);
+    }
+
+    return NULL;
+}
+
+int
+mcached_shard_queue_get_idle_item(mcached_shard_queue_t *squeue, uint32 key,
+        struct list_head **item)
+{
+    uint32 start;
+    int i;
+
+    EMBED_ASSERT_RETURN(squeue != NULL && item != NULL, EMBED_FAILD);
+
+    if(key == MCACHED_SHARD_ROUND_ROBIN)
+        key = __atomic_fetch_add(&squeue->next_shard, 1, __ATOMIC_RELAXED);
+    start = key % squeue->shard_cnt;
+
+    /*a full shard borrows capacity from its siblings*/
+    for(i = 0; i < squeue->shard_cnt; i++)
+    {
+        mcached_queue_t *queue = MCACHED_SHARD_QUEUE(squeue, (start + i) % squeue->shard_cnt);
+
+        if(mcached_queue_get_idle_item(queue, item) == EMBED_SUCCESS)
+            return EMBED_SUCCESS;
+    }
+
+    return EMBED_FAILD;
+}
+
+int
+mcached_shard_queue_add(mcached_shard_queue_t *squeue, struct list_head *new_item)
+{
+    mcached_queue_t *queue;
+
+    EMBED_ASSERT_RETURN(squeue != NULL && new_item != NULL, EMBED_FAILD);
+
+    queue = mcached_shard_owner(squeue, new_item);
+    if(queue == NULL || mcached_queue_add(queue, new_item) != EMBED_SUCCESS)
+        return EMBED_FAILD;
+
+    embed_ready_event_active(squeue->ready_event);
+
+    return EMBED_SUCCESS;
+}
+
+void
+mcached_shard_queue_del(mcached_shard_queue_t *squeue, struct list_head *del_item)
+{
+    mcached_queue_t *queue = mcached_shard_owner(squeue, del_item);
+
+    if(queue)
+        mcached_queue_del(queue, del_item);
+}
+
+void
+mcached_shard_queue_put_idle_items(mcached_shard_queue_t *squeue, struct list_head *batch)
+{
+    struct list_head *pos, *n;
+
+    /*one locked splice per owning shard present in the batch*/
+    while(!list_empty(batch))
+    {
+        mcached_queue_t *queue = mcached_shard_owner(squeue, batch->next);
+        LIST_HEAD(own);
+
+        if(queue == NULL)
+        {
+            list_del_init(batch->next);
+            continue;
+        }
+
+        list_for_each_safe(pos, n, batch)
+        {
+            if(MCACHED_QUEUE_HAS_ITEM(queue, pos))
+                list_move_tail(pos, &own);
+        }
+
+        mcached_queue_put_idle_items(queue, &own);
+    }
+}
+
+/*
+ * Can queue hold items from a sibling's slab on its used list: only a
+ * plain list with no per-slot state (index, prio, persist, key column),
+ * no residency stamps and no epoch readers
+ */
+static embed_bool_t
+mcached_shard_takes_foreign(mcached_queue_t *queue)
+{
+    return queue->mode == MCACHED_QUEUE_MODE_LIST
+        && queue->index == NULL && queue->prio_levels == 0
+        && queue->persist_hdr == NULL && queue->key_col == NULL
+        && queue->residency == NULL && !queue->epoch_enabled;
+}
+
+/*
+ * Take one item from the first non-empty sibling of home. A home that
+ * takes foreign items keeps up to steal_batch of them so the next pops
+ * stay local; any other home steals one item at a time.
+ */
+static embed_bool_t
+mcached_shard_steal(mcached_shard_queue_t *squeue, int home, struct list_head **item)
+{
+    mcached_queue_t *home_queue = MCACHED_SHARD_QUEUE(squeue, home);
+    embed_bool_t keep_rest = mcached_shard_takes_foreign(home_queue);
+    int i;
+
+    for(i = 1; i < squeue->shard_cnt; i++)
+    {
+        mcached_queue_t *queue = MCACHED_SHARD_QUEUE(squeue, (home + i) % squeue->shard_cnt);
+        LIST_HEAD(stolen);
+
+        if(!keep_rest)
+        {
+            if(mcached_queue_trypop(queue, item) == EMBED_SUCCESS)
+                return true;
+            continue;
+        }
+
+        if(mcached_queue_pop_batch(queue, squeue->steal_batch, &stolen) == 0)
+            continue;
+
+        *item = stolen.next;
+        list_del_init(*item);
+
+        /*never drop the rest, hand it back to its owner if home refuses*/
+        if(mcached_queue_add_batch(home_queue, &stolen) != EMBED_SUCCESS)
+            mcached_queue_add_batch(queue, &stolen);
+
+        return true;
+    }
+
+    return false;
+}
+
+static embed_bool_t
+mcached_shard_take(mcached_shard_queue_t *squeue, int home, struct list_head **item)
+{
+    if(mcached_queue_trypop(MCACHED_SHARD_QUEUE(squeue, home), item) == EMBED_SUCCESS)
+        return true;
+
+    return mcached_shard_steal(squeue, home, item);
+}
+
+int
+mcached_shard_queue_trypop(mcached_shard_queue_t *squeue, int home, struct list_head **item)
+{
+    EMBED_ASSERT_RETURN(squeue != NULL && item != NULL, EMBED_FAILD);
+    EMBED_ASSERT_RETURN(home >= 0 && home < squeue->shard_cnt, EMBED_FAILD);
+
+    if(!mcached_shard_take(squeue, home, item))
+        return EMBED_FAILD;
+
+    embed_ready_event_trywait(squeue->ready_event);
+
+    return EMBED_SUCCESS;
+}
+
+int
+mcached_shard_queue_pop(mcached_shard_queue_t *squeue, int home, struct list_head **item)
+{
+    EMBED_ASSERT_RETURN(squeue != NULL && item != NULL, EMBED_FAILD);
+    EMBED_ASSERT_RETURN(home >= 0 && home < squeue->shard_cnt, EMBED_FAILD);
+
+    if(mcached_shard_take(squeue, home, item))
+    {
+        embed_ready_event_trywait(squeue->ready_event);
+        return EMBED_SUCCESS;
+    }
+
+    /*every shard looked empty, sleep until some producer adds*/
+    for(;;)
+    {
+        if(embed_ready_event_wait(squeue->ready_event) != EMBED_SUCCESS)
+            return EMBED_FAILD;
+
+        if(mcached_shard_take(squeue, home, item))
+            return EMBED_SUCCESS;
+    }
+}
+
+int
+mcached_shard_queue_pop_batch(mcached_shard_queue_t *squeue, int home, int cnt,
+        struct list_head *out_list)
+{
+    int i, n;
+
+    EMBED_ASSERT_RETURN(squeue != NULL && out_list != NULL, 0);
+    EMBED_ASSERT_RETURN(home >= 0 && home < squeue->shard_cnt, 0);
+
+    for(i = 0; i < squeue->shard_cnt; i++)
+    {
+        n = mcached_queue_pop_batch(MCACHED_SHARD_QUEUE(squeue, (home + i) % squeue->shard_cnt),
+                cnt, out_list);
+        if(n > 0)
+            break;
+    }
+
+    if(i == squeue->shard_cnt)
+        return 0;
+
+    for(i = 0; i < n; i++)
+        embed_ready_event_trywait(squeue->ready_event);
+
+    return n;
+}
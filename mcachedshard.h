@@ -0,0 +1,93 @@
+#ifndef __MCACHEDSHARD_H_
+#define __MCACHEDSHARD_H_
+
+#include "mcachedqueue.h"
+
+/*
+ * A queue split into shard_cnt inner mcached_queue_t, each with its own
+ * slice of the slab, its own mlock and ready event, so producers and
+ * consumers on different shards never share a lock.
+ *
+ * Producers pick a shard when they take an idle item (by key, or round
+ * robin with MCACHED_SHARD_ROUND_ROBIN) and the item is added to, and
+ * later recycled into, the shard that owns its slot. Consumers pop from
+ * their home shard first and steal from the siblings when it is empty;
+ * they only sleep, on the shared ready_event, once every shard is empty.
+ * The total capacity is item_cnt across all shards.
+ *
+ * mcached_shard_queue_init_numa makes one shard per online NUMA node with
+ * its slab bound to that node. Passing mcached_shard_queue_local as the
+ * key and the home keeps producers and consumers on their own node; they
+ * only reach into a remote node's shard when the local one is full or
+ * empty.
+ */
+
+#define MCACHED_SHARD_ROUND_ROBIN   ((uint32)-1)
+
+/*Default number of items a consumer steals from a sibling at once*/
+#define MCACHED_SHARD_STEAL_BATCH   16
+
+typedef struct
+{
+    mcached_queue_t queue;
+}EMBED_CACHE_ALIGNED mcached_shard_t;
+
+typedef struct
+{
+    mcached_shard_t *shards;
+    int    shard_cnt;
+
+    uint32 next_shard EMBED_CACHE_ALIGNED;
+
+    int    steal_batch;
+
+    /*shard i lives on NUMA node MCACHED_SHARD_QUEUE(squeue, i)->numa_node*/
+    int    numa;
+
+    embed_ready_event_t *ready_event;
+}mcached_shard_queue_t;
+
+int
+mcached_shard_queue_init(mcached_shard_queue_t *squeue, int item_size, int item_cnt,
+        int shard_cnt, const mcached_queue_attr_t *attr);
+
+/*One shard per online node, item_cnt spread across them*/
+int
+mcached_shard_queue_init_numa(mcached_shard_queue_t *squeue, int item_size, int item_cnt,
+        const mcached_queue_attr_t *attr);
+
+/*Shard of the calling thread: its NUMA node for a numa queue, else its cpu*/
+int
+mcached_shard_queue_local(mcached_shard_queue_t *squeue);
+
+int
+mcached_shard_queue_destroy(mcached_shard_queue_t *squeue);
+
+int
+mcached_shard_queue_get_idle_item(mcached_shard_queue_t *squeue, uint32 key,
+        struct list_head **item);
+
+int
+mcached_shard_queue_add(mcached_shard_queue_t *squeue, struct list_head *new_item);
+
+/*Recycle an item taken by pop/pop_batch (or an unused idle item)*/
+void
+mcached_shard_queue_del(mcached_shard_queue_t *squeue, struct list_head *del_item);
+
+void
+mcached_shard_queue_put_idle_items(mcached_shard_queue_t *squeue, struct list_head *batch);
+
+int
+mcached_shard_queue_trypop(mcached_shard_queue_t *squeue, int home, struct list_head **item);
+
+int
+mcached_shard_queue_pop(mcached_shard_queue_t *squeue, int home, struct list_head **item);
+
+/*Up to cnt items, from home first and then stolen from one sibling*/
+int
+mcached_shard_queue_pop_batch(mcached_shard_queue_t *squeue, int home, int cnt,
+        struct list_head *out_list);
+
+#define MCACHED_SHARD_QUEUE(squeue, i) (&(squeue)->shards[(i)].queue)
+
+#endif
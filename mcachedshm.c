@@ -0,0 +1,451 @@
+#define _GNU_SOURCE
+#include "mcachedshm.h"
+#include "embed_assert.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_LINK(queue, off)  MCACHED_SHM_ITEM(queue, off)
+#define SHM_OFF(queue, link)  MCACHED_SHM_OFFSET(queue, link)
+
+static inline void
+shm_list_init(mcached_shm_queue_t *queue, mcached_shm_link_t *link)
+{
+    link->next = link->prev = SHM_OFF(queue, link);
+}
+
+static inline embed_bool_t
+shm_list_empty(mcached_shm_queue_t *queue, mcached_shm_link_t *head)
+{
+    return head->next == SHM_OFF(queue, head);
+}
+
+static inline void
+shm_list_add_tail(mcached_shm_queue_t *queue, mcached_shm_link_t *link, mcached_shm_link_t *head)
+{
+    uint64 off = SHM_OFF(queue, link);
+
+    link->next = SHM_OFF(queue, head);
+    link->prev = head->prev;
+    SHM_LINK(queue, head->prev)->next = off;
+    head->prev = off;
+}
+
+/*Unlink and self-link, like list_del_init*/
+static inline void
+shm_list_del_init(mcached_shm_queue_t *queue, mcached_shm_link_t *link)
+{
+    SHM_LINK(queue, link->prev)->next = link->next;
+    SHM_LINK(queue, link->next)->prev = link->prev;
+    shm_list_init(queue, link);
+}
+
+/*Is off the start of a carved slot*/
+static inline embed_bool_t
+shm_valid_item(mcached_shm_queue_t *queue, uint64 off)
+{
+    mcached_shm_header_t *hdr = queue->hdr;
+
+    return off >= hdr->slab_off
+        && off < hdr->slab_off + (uint64)hdr->item_stride * hdr->used_item_cnt
+        && (off - hdr->slab_off) % hdr->item_stride == 0;
+}
+
+/*
+ * Re-link head from its next chain after a process died inside the lock:
+ * prev links are rebuilt, and the chain is cut at the first offset that is
+ * not a slot or once it is longer than the slab. Returns the length.
+ */
+static uint32
+shm_list_repair(mcached_shm_queue_t *queue, mcached_shm_link_t *head)
+{
+    uint64 head_off = SHM_OFF(queue, head);
+    uint64 prev = head_off, cur = head->next;
+    uint32 n = 0;
+
+    while(cur != head_off && n < queue->hdr->max_item_cnt && shm_valid_item(queue, cur))
+    {
+        SHM_LINK(queue, cur)->prev = prev;
+        prev = cur;
+        cur = SHM_LINK(queue, cur)->next;
+        n++;
+    }
+
+    SHM_LINK(queue, prev)->next = head_off;
+    head->prev = prev;
+
+    return n;
+}
+
+static void
+shm_queue_repair(mcached_shm_queue_t *queue)
+{
+    mcached_shm_header_t *hdr = queue->hdr;
+    uint32 nready;
+
+    hdr->queued_cnt = shm_list_repair(queue, &hdr->used_list);
+    shm_list_repair(queue, &hdr->idle_list);
+
+    /*pop must not sleep on items that are queued*/
+    nready = __atomic_load_n(&hdr->ready_event.nready, __ATOMIC_ACQUIRE);
+    if(hdr->queued_cnt > nready)
+        embed_ready_event_active_n(&hdr->ready_event, hdr->queued_cnt - nready);
+}
+
+static void
+shm_queue_lock(mcached_shm_queue_t *queue)
+{
+    if(pthread_mutex_lock(&queue->hdr->mlock) == EOWNERDEAD)
+    {
+        shm_queue_repair(queue);
+        pthread_mutex_consistent(&queue->hdr->mlock);
+    }
+}
+
+static void
+shm_queue_unlock(mcached_shm_queue_t *queue)
+{
+    pthread_mutex_unlock(&queue->hdr->mlock);
+}
+
+static int
+shm_queue_init_lock(mcached_shm_header_t *hdr)
+{
+    pthread_mutexattr_t mlattr;
+    int ret;
+
+    if(pthread_mutexattr_init(&mlattr) != 0)
+        return EMBED_FAILD;
+
+    pthread_mutexattr_setpshared(&mlattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mlattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutexattr_settype(&mlattr, PTHREAD_MUTEX_RECURSIVE);
+
+    ret = pthread_mutex_init(&hdr->mlock, &mlattr);
+    pthread_mutexattr_destroy(&mlattr);
+
+    return ret == 0 ? EMBED_SUCCESS : EMBED_FAILD;
+}
+
+static int
+shm_queue_map(mcached_shm_queue_t *queue, int fd, size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if(p == MAP_FAILED)
+        return EMBED_FAILD;
+
+    queue->base = (char *)p;
+    queue->hdr = (mcached_shm_header_t *)p;
+    queue->map_size = size;
+    queue->fd = fd;
+
+    return EMBED_SUCCESS;
+}
+
+int
+mcached_shm_queue_create(mcached_shm_queue_t *queue, const char *name,
+        int item_size, int item_cnt)
+{
+    mcached_shm_header_t *hdr;
+    uint32 stride;
+    uint64 slab_off, size;
+    int fd;
+
+    EMBED_ASSERT_RETURN(queue != NULL, EMBED_FAILD);
+    EMBED_ASSERT_RETURN(item_size >= (int)sizeof(mcached_shm_link_t) && item_cnt > 0, EMBED_FAILD);
+
+    memset(queue, 0, sizeof(*queue));
+    queue->fd = -1;
+
+    stride = EMBED_ALIGN_UP(item_size, sizeof(uint64));
+    slab_off = EMBED_ALIGN_UP(sizeof(mcached_shm_header_t), EMBED_CACHE_LINE_SIZE);
+    size = slab_off + (uint64)stride * item_cnt;
+
+    /*O_EXCL: never reinitialize a region other processes may be using*/
+    if(name)
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    else
+        fd = memfd_create("mcached_shm", MFD_CLOEXEC);
+    if(fd < 0)
+        return EMBED_FAILD;
+
+    if(ftruncate(fd, size) != 0 || shm_queue_map(queue, fd, size) != EMBED_SUCCESS)
+        goto err_fd;
+
+    hdr = queue->hdr;
+    hdr->version = MCACHED_SHM_VERSION;
+    hdr->item_size = item_size;
+    hdr->item_stride = stride;
+    hdr->max_item_cnt = item_cnt;
+    hdr->used_item_cnt = 0;
+    hdr->region_size = size;
+    hdr->slab_off = slab_off;
+    hdr->queued_cnt = 0;
+    shm_list_init(queue, &hdr->used_list);
+    shm_list_init(queue, &hdr->idle_list);
+
+    if(shm_queue_init_lock(hdr) != EMBED_SUCCESS)
+        goto err_map;
+
+    embed_ready_event_init(&hdr->ready_event, true);
+
+    /*attachers only look at a region once the magic is there*/
+    __atomic_store_n(&hdr->magic, MCACHED_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return EMBED_SUCCESS;
+
+err_map:
+    munmap(queue->base, queue->map_size);
+err_fd:
+    close(fd);
+    if(name)
+        shm_unlink(name);
+    memset(queue, 0, sizeof(*queue));
+    queue->fd = -1;
+    return EMBED_FAILD;
+}
+
+static int
+shm_queue_attach_fd(mcached_shm_queue_t *queue, int fd)
+{
+    mcached_shm_header_t *hdr;
+    struct stat st;
+
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(mcached_shm_header_t))
+        return EMBED_FAILD;
+
+    if(shm_queue_map(queue, fd, st.st_size) != EMBED_SUCCESS)
+        return EMBED_FAILD;
+
+    hdr = queue->hdr;
+    if(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != MCACHED_SHM_MAGIC
+            || hdr->version != MCACHED_SHM_VERSION
+            || hdr->region_size != (uint64)st.st_size)
+    {
+        munmap(queue->base, queue->map_size);
+        return EMBED_FAILD;
+    }
+
+    return EMBED_SUCCESS;
+}
+
+int
+mcached_shm_queue_attach(mcached_shm_queue_t *queue, const char *name)
+{
+    int fd;
+
+    EMBED_ASSERT_RETURN(queue != NULL && name != NULL, EMBED_FAILD);
+
+    memset(queue, 0, sizeof(*queue));
+    queue->fd = -1;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if(fd < 0)
+        return EMBED_FAILD;
+
+    if(shm_queue_attach_fd(queue, fd) != EMBED_SUCCESS)
+    {
+        close(fd);
+        queue->fd = -1;
+        return EMBED_FAILD;
+    }
+
+    return EMBED_SUCCESS;
+}
+
+int
+mcached_shm_queue_attach_fd(mcached_shm_queue_t *queue, int fd)
+{
+    int own;
+
+    EMBED_ASSERT_RETURN(queue != NULL && fd >= 0, EMBED_FAILD);
+
+    memset(queue, 0, sizeof(*queue));
+    queue->fd = -1;
+
+    own = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if(own < 0)
+        return EMBED_FAILD;
+
+    if(shm_queue_attach_fd(queue, own) != EMBED_SUCCESS)
+    {
+        close(own);
+        queue->fd = -1;
+        return EMBED_FAILD;
+    }
+
+    return EMBED_SUCCESS;
+}
+
+int
+mcached_shm_queue_fd(mcached_shm_queue_t *queue)
+{
+    return queue->fd;
+}
+
+int
+mcached_shm_queue_detach(mcached_shm_queue_t *queue)
+{
+    EMBED_ASSERT_RETURN(queue != NULL && queue->base != NULL, EMBED_FAILD);
+
+    munmap(queue->base, queue->map_size);
+    if(queue->fd >= 0)
+        close(queue->fd);
+
+    memset(queue, 0, sizeof(*queue));
+    queue->fd = -1;
+
+    return EMBED_SUCCESS;
+}
+
+int
+mcached_shm_queue_unlink(const char *name)
+{
+    EMBED_ASSERT_RETURN(name != NULL, EMBED_FAILD);
+
+    return shm_unlink(name) == 0 ? EMBED_SUCCESS : EMBED_FAILD;
+}
+
+int
+mcached_shm_queue_get_idle_item(mcached_shm_queue_t *queue, mcached_shm_link_t **item)
+{
+    mcached_shm_header_t *hdr;
+    int status = EMBED_SUCCESS;
+
+    EMBED_ASSERT_RETURN(queue != NULL && item != NULL, EMBED_FAILD);
+
+    hdr = queue->hdr;
+
+    shm_queue_lock(queue);
+    if(!shm_list_empty(queue, &hdr->idle_list))
+    {
+        *item = SHM_LINK(queue, hdr->idle_list.next);
+        shm_list_del_init(queue, *item);
+    }
+    else if(hdr->used_item_cnt < hdr->max_item_cnt)
+    {
+        /*slots are carved lazily, as in mcached_queue_get_idle_item*/
+        *item = SHM_LINK(queue, hdr->slab_off + (uint64)hdr->item_stride * hdr->used_item_cnt);
+        shm_list_init(queue, *item);
+        hdr->used_item_cnt++;
+    }
+    else
+    {
+        status = EMBED_FAILD;
+    }
+    shm_queue_unlock(queue);
+
+    return status;
+}
+
+int
+mcached_shm_queue_add(mcached_shm_queue_t *queue, mcached_shm_link_t *new_item)
+{
+    mcached_shm_header_t *hdr;
+
+    EMBED_ASSERT_RETURN(queue != NULL && new_item != NULL, EMBED_FAILD);
+
+    hdr = queue->hdr;
+    if(!shm_valid_item(queue, SHM_OFF(queue, new_item)))
+        return EMBED_FAILD;
+
+    shm_queue_lock(queue);
+    shm_list_add_tail(queue, new_item, &hdr->used_list);
+    hdr->queued_cnt++;
+    shm_queue_unlock(queue);
+
+    embed_ready_event_active(&hdr->ready_event);
+
+    return EMBED_SUCCESS;
+}
+
+void
+mcached_shm_queue_del(mcached_shm_queue_t *queue, mcached_shm_link_t *del_item)
+{
+    mcached_shm_header_t *hdr = queue->hdr;
+
+    if(!shm_valid_item(queue, SHM_OFF(queue, del_item)))
+        return;
+
+    shm_queue_lock(queue);
+    /*popped and idle items are self linked*/
+    if(!shm_list_empty(queue, del_item))
+    {
+        shm_list_del_init(queue, del_item);
+        hdr->queued_cnt--;
+    }
+    shm_list_add_tail(queue, del_item, &hdr->idle_list);
+    shm_queue_unlock(queue);
+}
+
+static embed_bool_t
+shm_queue_take_head(void *shm_queue, void *item)
+{
+    mcached_shm_queue_t *queue = (mcached_shm_queue_t *)shm_queue;
+    mcached_shm_header_t *hdr = queue->hdr;
+    mcached_shm_link_t *first = NULL;
+
+    shm_queue_lock(queue);
+    if(!shm_list_empty(queue, &hdr->used_list))
+    {
+        first = SHM_LINK(queue, hdr->used_list.next);
+        shm_list_del_init(queue, first);
+        hdr->queued_cnt--;
+    }
+    shm_queue_unlock(queue);
+
+    if(first == NULL)
+        return false;
+
+    *(mcached_shm_link_t **)item = first;
+
+    return true;
+}
+
+int
+mcached_shm_queue_pop(mcached_shm_queue_t *queue, mcached_shm_link_t **item)
+{
+    EMBED_ASSERT_RETURN(queue != NULL && item != NULL, EMBED_FAILD);
+
+    return embed_ready_event_pop(&queue->hdr->ready_event, shm_queue_take_head, queue, item, NULL, NULL);
+}
+
+int
+mcached_shm_queue_trypop(mcached_shm_queue_t *queue, mcached_shm_link_t **item)
+{
+    EMBED_ASSERT_RETURN(queue != NULL && item != NULL, EMBED_FAILD);
+
+    return embed_ready_event_trypop(&queue->hdr->ready_event, shm_queue_take_head, queue, item);
+}
+
+int
+mcached_shm_queue_timedpop(mcached_shm_queue_t *queue, mcached_shm_link_t **item,
+        const struct timespec *deadline)
+{
+    EMBED_ASSERT_RETURN(queue != NULL && item != NULL && deadline != NULL, EMBED_FAILD);
+
+    return embed_ready_event_pop(&queue->hdr->ready_event, shm_queue_take_head, queue, item, deadline, NULL);
+}
+
+void
+mcached_shm_queue_traverse(mcached_shm_queue_t *queue, shm_traverse_item_cb item_handler)
+{
+    mcached_shm_header_t *hdr = queue->hdr;
+    uint64 head_off = SHM_OFF(queue, &hdr->used_list);
+    uint64 pos, n;
+
+    shm_queue_lock(queue);
+    for(pos = hdr->used_list.next, n = SHM_LINK(queue, pos)->next;
+            pos != head_off;
+            pos = n, n = SHM_LINK(queue, pos)->next)
+    {
+        item_handler(queue, SHM_LINK(queue, pos));
+    }
+    shm_queue_unlock(queue);
+}
@@ -0,0 +1,129 @@
+#ifndef __MCACHEDSHM_H_
+#define __MCACHEDSHM_H_
+
+#include "type.h"
+#include "event.h"
+
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * A queue that lives entirely in one shared memory region, so several
+ * processes can hand items to each other without copying them.
+ *
+ * The region is a named POSIX shm object (mcached_shm_queue_create with a
+ * name, mcached_shm_queue_attach with the same name) or an anonymous memfd
+ * whose descriptor is inherited or passed over a unix socket
+ * (mcached_shm_queue_attach_fd). It holds the header, the slab and every
+ * link. The region maps at a different address in every process, so the
+ * links are byte offsets from the start of the region instead of pointers.
+ *
+ * Every item starts with a mcached_shm_link_t, the way mcached_queue_t
+ * items start with a list_head. The lock is a PTHREAD_PROCESS_SHARED
+ * robust mutex, and the ready event uses shared futexes. When a process
+ * dies holding the lock, the next locker re-links both lists from their
+ * next chains. Items the dead process held are lost until the region is
+ * created again.
+ */
+
+#define MCACHED_SHM_MAGIC      0x6d635348u /*"mcSH"*/
+#define MCACHED_SHM_VERSION    1
+
+/*offset based list_head, 0 is never a valid item offset*/
+typedef struct
+{
+    uint64 next;
+    uint64 prev;
+}mcached_shm_link_t;
+
+typedef struct
+{
+    uint32 magic;
+    uint32 version;
+
+    uint32 item_size;
+    uint32 item_stride;
+    uint32 max_item_cnt;
+    uint32 used_item_cnt;
+
+    uint64 region_size;
+    uint64 slab_off;
+
+    mcached_shm_link_t used_list;
+    mcached_shm_link_t idle_list;
+    uint32 queued_cnt;
+
+    pthread_mutex_t mlock;
+
+    embed_ready_event_t ready_event EMBED_CACHE_ALIGNED;
+}mcached_shm_header_t;
+
+/*Per-process handle of a shared queue*/
+typedef struct
+{
+    mcached_shm_header_t *hdr;
+    char   *base;
+    size_t map_size;
+    int    fd;
+}mcached_shm_queue_t;
+
+typedef void (*shm_traverse_item_cb)(mcached_shm_queue_t *queue, mcached_shm_link_t *item);
+
+/*
+ * Create and initialize a region for item_cnt items of item_size bytes
+ * (the link included). name is a shm_open name such as "/capture"; NULL
+ * creates an anonymous memfd, see mcached_shm_queue_fd.
+ */
+int
+mcached_shm_queue_create(mcached_shm_queue_t *queue, const char *name,
+        int item_size, int item_cnt);
+
+int
+mcached_shm_queue_attach(mcached_shm_queue_t *queue, const char *name);
+
+/*Attach through a descriptor of the region, fd stays owned by the caller*/
+int
+mcached_shm_queue_attach_fd(mcached_shm_queue_t *queue, int fd);
+
+/*Descriptor of the region, to pass on to another process*/
+int
+mcached_shm_queue_fd(mcached_shm_queue_t *queue);
+
+/*Unmap this process' view, the region lives on in the others*/
+int
+mcached_shm_queue_detach(mcached_shm_queue_t *queue);
+
+/*Remove a named region, mappings that are still open stay valid*/
+int
+mcached_shm_queue_unlink(const char *name);
+
+int
+mcached_shm_queue_get_idle_item(mcached_shm_queue_t *queue, mcached_shm_link_t **item);
+
+int
+mcached_shm_queue_add(mcached_shm_queue_t *queue, mcached_shm_link_t *new_item);
+
+/*Give item back to the idle list, unlinking it first if still queued*/
+void
+mcached_shm_queue_del(mcached_shm_queue_t *queue, mcached_shm_link_t *del_item);
+
+/*Same token contract as mcached_queue_pop/trypop/timedpop*/
+int
+mcached_shm_queue_pop(mcached_shm_queue_t *queue, mcached_shm_link_t **item);
+
+int
+mcached_shm_queue_trypop(mcached_shm_queue_t *queue, mcached_shm_link_t **item);
+
+int
+mcached_shm_queue_timedpop(mcached_shm_queue_t *queue, mcached_shm_link_t **item,
+        const struct timespec *deadline);
+
+void
+mcached_shm_queue_traverse(mcached_shm_queue_t *queue, shm_traverse_item_cb item_handler);
+
+/*Offsets name items across processes, pointers only within one*/
+#define MCACHED_SHM_OFFSET(queue, item) ((uint64)((char *)(item) - (queue)->base))
+
+#define MCACHED_SHM_ITEM(queue, offset) ((mcached_shm_link_t *)((queue)->base + (offset)))
+
+#endif
@@ -0,0 +1,257 @@
+#include "mcachedsized.h"
+#include "embed_assert.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int
+mcached_sized_init_lock(mcached_sized_queue_t *squeue)
+{
+    pthread_mutexattr_t mlattr;
+    int ret;
+
+    if(pthread_mutexattr_init(&mlattr) != 0)
+        return EMBED_FAILD;
+
+    pthread_mutexattr_settype(&mlattr, PTHREAD_MUTEX_RECURSIVE);
+    ret = pthread_mutex_init(&squeue->mlock, &mlattr);
+    pthread_mutexattr_destroy(&mlattr);
+
+    return ret == 0 ? EMBED_SUCCESS : EMBED_FAILD;
+}
+
+int
+mcached_sized_queue_init(mcached_sized_queue_t *squeue, const int *class_sizes,
+        const int *class_cnts, int class_cnt, const mcached_queue_attr_t *attr)
+{
+    mcached_queue_attr_t class_attr;
+    int i, g, c;
+
+    EMBED_ASSERT_RETURN(squeue != NULL && class_sizes != NULL && class_cnts != NULL, EMBED_FAILD);
+    EMBED_ASSERT_RETURN(class_cnt > 0 && class_cnt <= MCACHED_SIZED_MAX_CLASSES, EMBED_FAILD);
+
+    for(i = 1; i < class_cnt; i++)
+    {
+        if(class_sizes[i] <= class_sizes[i - 1])
+            return EMBED_FAILD;
+    }
+
+    memset(squeue, 0, sizeof(*squeue));
+
+    /*the inner queues only hand out and take back idle slots*/
+    if(attr)
+        class_attr = *attr;
+    else
+        mcached_queue_attr_init(&class_attr);
+    class_attr.mode = MCACHED_QUEUE_MODE_LIST;
+    class_attr.index_key = NULL;
+    class_attr.index_hash = NULL;
+    class_attr.index_compare = NULL;
+    class_attr.eventfd_mode = MCACHED_QUEUE_EVENTFD_NONE;
+    class_attr.prio_levels = 0;
+    class_attr.residency_hist = 0;
+    class_attr.persist_path = NULL;
+    class_attr.key_column = NULL;
+    class_attr.lockless_read = 0;
+
+    squeue->max_size = class_sizes[class_cnt - 1];
+    squeue->class_of = (uint8 *)malloc(squeue->max_size / MCACHED_SIZED_GRANULE + 2);
+    squeue->classes = (mcached_queue_t *)malloc(class_cnt * sizeof(mcached_queue_t));
+    if(squeue->class_of == NULL || squeue->classes == NULL)
+        goto err_mem;
+
+    for(g = 0, c = 0; g <= squeue->max_size / MCACHED_SIZED_GRANULE + 1; g++)
+    {
+        while(c < class_cnt - 1 && class_sizes[c] < g * MCACHED_SIZED_GRANULE)
+            c++;
+        squeue->class_of[g] = c;
+    }
+
+    for(i = 0; i < class_cnt; i++)
+    {
+        if(mcached_queue_init_ex(MCACHED_SIZED_QUEUE(squeue, i), class_sizes[i],
+                    class_cnts[i], &class_attr) != EMBED_SUCCESS)
+            goto err_classes;
+    }
+
+    if(mcached_sized_init_lock(squeue) != EMBED_SUCCESS)
+        goto err_classes;
+
+    if(embed_ready_event_create(&squeue->ready_event) != EMBED_SUCCESS)
+        goto err_lock;
+
+    INIT_LIST_HEAD(&squeue->used_list);
+    squeue->class_cnt = class_cnt;
+
+    return EMBED_SUCCESS;
+
+err_lock:
+    pthread_mutex_destroy(&squeue->mlock);
+err_classes:
+    while(--i >= 0)
+        mcached_queue_destroy(MCACHED_SIZED_QUEUE(squeue, i));
+err_mem:
+    Free(squeue->class_of);
+    Free(squeue->classes);
+    return EMBED_FAILD;
+}
+
+int
+mcached_sized_queue_destroy(mcached_sized_queue_t *squeue)
+{
+    int i;
+
+    EMBED_ASSERT_RETURN(squeue != NULL, EMBED_FAILD);
+
+    for(i = 0; i < squeue->class_cnt; i++)
+        mcached_queue_destroy(MCACHED_SIZED_QUEUE(squeue, i));
+
+    embed_ready_event_destroy(squeue->ready_event);
+    pthread_mutex_destroy(&squeue->mlock);
+    Free(squeue->class_of);
+    Free(squeue->classes);
+    INIT_LIST_HEAD(&squeue->used_list);
+    squeue->class_cnt = 0;
+
+    return EMBED_SUCCESS;
+}
+
+/*Class whose slab holds item*/
+static mcached_queue_t *
+mcached_sized_owner(mcached_sized_queue_t *squeue, struct list_head *item)
+{
+    int i;
+
+    for(i = 0; i < squeue->class_cnt; i++)
+    {
+        if(MCACHED_QUEUE_HAS_ITEM(MCACHED_SIZED_QUEUE(squeue, i), item))
+            return MCACHED_SIZED_QUEUE(squeue, i);
+    }
+
+    return NULL;
+}
+
+int
+mcached_sized_queue_get_idle_item(mcached_sized_queue_t *squeue, int size,
+        struct list_head **item)
+{
+    int c;
+
+    EMBED_ASSERT_RETURN(squeue != NULL && item != NULL, EMBED_FAILD);
+
+    if(size > squeue->max_size)
+        return EMBED_FAILD;
+    if(size < 0)
+        size = 0;
+
+    /*an exhausted class borrows from the larger ones*/
+    for(c = squeue->class_of[(size + MCACHED_SIZED_GRANULE - 1) / MCACHED_SIZED_GRANULE];
+            c < squeue->class_cnt; c++)
+    {
+        if(mcached_queue_get_idle_item(MCACHED_SIZED_QUEUE(squeue, c), item) == EMBED_SUCCESS)
+            return EMBED_SUCCESS;
+    }
+
+    return EMBED_FAILD;
+}
+
+int
+mcached_sized_queue_item_size(mcached_sized_queue_t *squeue, struct list_head *item)
+{
+    mcached_queue_t *queue = mcached_sized_owner(squeue, item);
+
+    return queue ? queue->item_size : 0;
+}
+
+int
+mcached_sized_queue_add(mcached_sized_queue_t *squeue, struct list_head *new_item)
+{
+    EMBED_ASSERT_RETURN(squeue != NULL && new_item != NULL, EMBED_FAILD);
+
+    if(mcached_sized_owner(squeue, new_item) == NULL)
+        return EMBED_FAILD;
+
+    pthread_mutex_lock(&squeue->mlock);
+    list_add_tail(new_item, &squeue->used_list);
+    pthread_mutex_unlock(&squeue->mlock);
+
+    embed_ready_event_active(squeue->ready_event);
+
+    return EMBED_SUCCESS;
+}
+
+void
+mcached_sized_queue_del(mcached_sized_queue_t *squeue, struct list_head *del_item)
+{
+    mcached_queue_t *queue = mcached_sized_owner(squeue, del_item);
+
+    if(queue == NULL)
+        return;
+
+    /*self linked afterwards, so the class queue only recycles it*/
+    pthread_mutex_lock(&squeue->mlock);
+    list_del_init(del_item);
+    pthread_mutex_unlock(&squeue->mlock);
+
+    mcached_queue_del(queue, del_item);
+}
+
+static embed_bool_t
+mcached_sized_take_head(void *sized_queue, void *item)
+{
+    mcached_sized_queue_t *squeue = (mcached_sized_queue_t *)sized_queue;
+    struct list_head *first = NULL;
+
+    pthread_mutex_lock(&squeue->mlock);
+    if(!list_empty(&squeue->used_list))
+    {
+        first = squeue->used_list.next;
+        list_del_init(first);
+    }
+    pthread_mutex_unlock(&squeue->mlock);
+
+    if(first == NULL)
+        return false;
+
+    *(struct list_head **)item = first;
+
+    return true;
+}
+
+int
+mcached_sized_queue_pop(mcached_sized_queue_t *squeue, struct list_head **item)
+{
+    EMBED_ASSERT_RETURN(squeue != NULL && item != NULL, EMBED_FAILD);
+
+    return embed_ready_event_pop(squeue->ready_event, mcached_sized_take_head, squeue, item, NULL, NULL);
+}
+
+int
+mcached_sized_queue_trypop(mcached_sized_queue_t *squeue, struct list_head **item)
+{
+    EMBED_ASSERT_RETURN(squeue != NULL && item != NULL, EMBED_FAILD);
+
+    return embed_ready_event_trypop(squeue->ready_event, mcached_sized_take_head, squeue, item);
+}
+
+int
+mcached_sized_queue_timedpop(mcached_sized_queue_t *squeue, struct list_head **item,
+        const struct timespec *deadline)
+{
+    EMBED_ASSERT_RETURN(squeue != NULL && item != NULL && deadline != NULL, EMBED_FAILD);
+
+    return embed_ready_event_pop(squeue->ready_event, mcached_sized_take_head, squeue, item, deadline, NULL);
+}
+
+void
+mcached_sized_queue_traverse(mcached_sized_queue_t *squeue, sized_traverse_item_cb item_handler)
+{
+    struct list_head *pos, *n;
+
+    pthread_mutex_lock(&squeue->mlock);
+    list_for_each_safe(pos, n, &squeue->used_list)
+    {
+        item_handler(squeue, pos);
+    }
+    pthread_mutex_unlock(&squeue->mlock);
+}
@@ -0,0 +1,83 @@
+#ifndef __MCACHEDSIZED_H_
+#define __MCACHEDSIZED_H_
+
+#include "mcachedqueue.h"
+
+/*
+ * A queue over items of several sizes.
+ *
+ * Every size class is an inner mcached_queue_t that only manages its own
+ * slab and idle list, so small items no longer pay for the largest one.
+ * All classes share one FIFO used list, one mlock and one ready event
+ * here. get_idle_item picks the smallest class that fits through a table
+ * indexed by size, and falls back to larger classes when that class is
+ * exhausted. The size table makes the lookup O(1).
+ *
+ * class_sizes must be ascending; each includes the list_head at the start
+ * of the item. attr applies to every class (slot_align, slot_pad,
+ * slab_flags, magazine_size, elastic_*); its used-side options (mode,
+ * index, prio, eventfd, residency_hist, persist_path, key_column,
+ * lockless_read) are ignored.
+ */
+
+#define MCACHED_SIZED_MAX_CLASSES   32
+
+/*size table resolution*/
+#define MCACHED_SIZED_GRANULE       16
+
+typedef struct
+{
+    mcached_queue_t *classes;
+    int    class_cnt;
+    int    max_size;
+
+    /*smallest class for (size + GRANULE - 1) / GRANULE*/
+    uint8  *class_of;
+
+    struct list_head used_list;
+    pthread_mutex_t mlock;
+
+    embed_ready_event_t *ready_event;
+}mcached_sized_queue_t;
+
+typedef void (*sized_traverse_item_cb)(mcached_sized_queue_t *squeue, struct list_head *item);
+
+int
+mcached_sized_queue_init(mcached_sized_queue_t *squeue, const int *class_sizes,
+        const int *class_cnts, int class_cnt, const mcached_queue_attr_t *attr);
+
+int
+mcached_sized_queue_destroy(mcached_sized_queue_t *squeue);
+
+/*An idle item of at least size bytes*/
+int
+mcached_sized_queue_get_idle_item(mcached_sized_queue_t *squeue, int size,
+        struct list_head **item);
+
+/*Usable bytes of item (its class size), 0 if it is not from squeue*/
+int
+mcached_sized_queue_item_size(mcached_sized_queue_t *squeue, struct list_head *item);
+
+int
+mcached_sized_queue_add(mcached_sized_queue_t *squeue, struct list_head *new_item);
+
+/*Give item back to its class, unlinking it first if still queued*/
+void
+mcached_sized_queue_del(mcached_sized_queue_t *squeue, struct list_head *del_item);
+
+int
+mcached_sized_queue_pop(mcached_sized_queue_t *squeue, struct list_head **item);
+
+int
+mcached_sized_queue_trypop(mcached_sized_queue_t *squeue, struct list_head **item);
+
+int
+mcached_sized_queue_timedpop(mcached_sized_queue_t *squeue, struct list_head **item,
+        const struct timespec *deadline);
+
+void
+mcached_sized_queue_traverse(mcached_sized_queue_t *squeue, sized_traverse_item_cb item_handler);
+
+#define MCACHED_SIZED_QUEUE(squeue, i) (&(squeue)->classes[(i)])
+
+#endif
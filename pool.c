@@ -0,0 +1,151 @@
+#include "pool.h"
+#include "event.h"
+#include "embed_assert.h"
+
+#include <stdlib.h>
+
+/**
+ * @defgroup EMBED_HAS_THREAD_POOL
+ * @{
+ */
+
+/*Take task indexes until none is left*/
+static void mcached_pool_drain(mcached_pool_t *pool)
+{
+    int task;
+
+    while((task = __atomic_fetch_add(&pool->next_task, 1, __ATOMIC_RELAXED)) < pool->ntasks)
+        pool->fn(pool->arg, task);
+}
+
+static void *mcached_pool_worker(void *arg)
+{
+    mcached_pool_t *pool = (mcached_pool_t *)arg;
+    uint64 seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;)
+    {
+        while(!pool->stop && pool->generation == seen)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if(pool->stop)
+            break;
+
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        mcached_pool_drain(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+embed_status_t mcached_pool_create(mcached_pool_t **pool, int thread_cnt)
+{
+    mcached_pool_t *p;
+    int i;
+
+    EMBED_ASSERT_RETURN(pool != NULL && thread_cnt >= 0, EMBED_FAILD);
+
+    p = (mcached_pool_t *)calloc(1, sizeof(mcached_pool_t));
+    if(p == NULL)
+        return EMBED_FAILD;
+
+    p->threads = (pthread_t *)calloc(thread_cnt ? thread_cnt : 1, sizeof(pthread_t));
+    if(p->threads == NULL)
+        goto err_pool;
+
+    if(pthread_mutex_init(&p->lock, NULL) != 0)
+        goto err_threads;
+    if(pthread_cond_init(&p->start, NULL) != 0)
+        goto err_lock;
+    if(pthread_cond_init(&p->done, NULL) != 0)
+        goto err_start;
+
+    for(i = 0; i < thread_cnt; i++)
+    {
+        if(pthread_create(&p->threads[i], NULL, mcached_pool_worker, p) != 0)
+            break;
+    }
+    p->thread_cnt = i;
+
+    if(i < thread_cnt)
+    {
+        mcached_pool_destroy(p);
+        return EMBED_FAILD;
+    }
+
+    *pool = p;
+
+    return EMBED_SUCCESS;
+
+err_start:
+    pthread_cond_destroy(&p->start);
+err_lock:
+    pthread_mutex_destroy(&p->lock);
+err_threads:
+    Free(p->threads);
+err_pool:
+    Free(p);
+    return EMBED_FAILD;
+}
+
+embed_status_t mcached_pool_destroy(mcached_pool_t *pool)
+{
+    int i;
+
+    EMBED_ASSERT_RETURN(pool != NULL, EMBED_FAILD);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(i = 0; i < pool->thread_cnt; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    Free(pool->threads);
+    Free(pool);
+
+    return EMBED_SUCCESS;
+}
+
+embed_status_t mcached_pool_run(mcached_pool_t *pool, mcached_pool_task_cb fn, void *arg, int ntasks)
+{
+    EMBED_ASSERT_RETURN(pool != NULL && fn != NULL, EMBED_FAILD);
+
+    if(ntasks <= 0)
+        return EMBED_SUCCESS;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->ntasks = ntasks;
+    pool->next_task = 0;
+    pool->busy = pool->thread_cnt;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    mcached_pool_drain(pool);
+
+    /*every worker checks in, even those that found no task left*/
+    pthread_mutex_lock(&pool->lock);
+    while(pool->busy > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    return EMBED_SUCCESS;
+}
+
+/**
+ * @}
+ */
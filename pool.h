@@ -0,0 +1,54 @@
+#ifndef _MCACHED_POOL_H_
+#define _MCACHED_POOL_H_
+
+#include "type.h"
+
+#include <pthread.h>
+
+/**
+ * @defgroup EMBED_HAS_THREAD_POOL
+ * @{
+ */
+
+/**
+ * A fixed set of worker threads that stay parked between runs.
+ *
+ * mcached_pool_run hands task indexes 0..ntasks-1 out to the workers and
+ * to the calling thread, and returns once every task is done. Runs are
+ * serialized by the caller; one pool serves one run at a time.
+ */
+
+typedef void (*mcached_pool_task_cb)(void *arg, int task);
+
+typedef struct
+{
+    pthread_t *threads;
+    int    thread_cnt;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  start;
+    pthread_cond_t  done;
+
+    /*bumped by every run, workers wake when it changes*/
+    uint64 generation;
+    int    stop;
+    int    busy;
+
+    mcached_pool_task_cb fn;
+    void   *arg;
+    int    ntasks;
+    int    next_task;
+}mcached_pool_t;
+
+/*thread_cnt workers, the caller of mcached_pool_run is one more*/
+embed_status_t mcached_pool_create(mcached_pool_t **pool, int thread_cnt);
+
+embed_status_t mcached_pool_destroy(mcached_pool_t *pool);
+
+embed_status_t mcached_pool_run(mcached_pool_t *pool, mcached_pool_task_cb fn, void *arg, int ntasks);
+
+/**
+ * @}
+ */
+
+#endif
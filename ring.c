@@ -0,0 +1,111 @@
+#include "ring.h"
+#include "event.h"
+#include "embed_assert.h"
+
+#include <stdlib.h>
+
+/**
+ * @defgroup EMBED_HAS_MPMC_RING
+ * @{
+ */
+
+static uint32 ring_roundup_pow2(uint32 v)
+{
+    uint32 n = 1;
+
+    while(n < v)
+        n <<= 1;
+
+    return n;
+}
+
+embed_status_t mcached_ring_create(mcached_ring_t **ring, uint32 capacity)
+{
+    mcached_ring_t *r;
+    uint32 size, i;
+
+    EMBED_ASSERT_RETURN(ring != NULL && capacity > 0 && capacity <= 0x80000000u, EMBED_FAILD);
+
+    if(posix_memalign((void **)&r, EMBED_CACHE_LINE_SIZE, sizeof(mcached_ring_t)) != 0)
+        return EMBED_FAILD;
+
+    size = ring_roundup_pow2(capacity);
+    r->cells = (mcached_ring_cell_t *)malloc(size * sizeof(mcached_ring_cell_t));
+    if(r->cells == NULL)
+    {
+        Free(r);
+        return EMBED_FAILD;
+    }
+
+    for(i = 0; i < size; i++)
+        r->cells[i].seq = i;
+
+    r->mask = size - 1;
+    r->enqueue_pos = 0;
+    r->dequeue_pos = 0;
+
+    *ring = r;
+
+    return EMBED_SUCCESS;
+}
+
+embed_status_t mcached_ring_destroy(mcached_ring_t *ring)
+{
+    EMBED_ASSERT_RETURN(ring != NULL, EMBED_FAILD);
+
+    Free(ring->cells);
+    Free(ring);
+
+    return EMBED_SUCCESS;
+}
+
+/**
+ * @}
+ */
+
+
+/**
+ * @defgroup EMBED_HAS_SPSC_RING
+ * @{
+ */
+
+embed_status_t mcached_spsc_ring_create(mcached_spsc_ring_t **ring, uint32 capacity)
+{
+    mcached_spsc_ring_t *r;
+    uint32 size;
+
+    EMBED_ASSERT_RETURN(ring != NULL && capacity > 0 && capacity <= 0x80000000u, EMBED_FAILD);
+
+    if(posix_memalign((void **)&r, EMBED_CACHE_LINE_SIZE, sizeof(mcached_spsc_ring_t)) != 0)
+        return EMBED_FAILD;
+
+    size = ring_roundup_pow2(capacity);
+    r->slots = (uint32 *)malloc(size * sizeof(uint32));
+    if(r->slots == NULL)
+    {
+        Free(r);
+        return EMBED_FAILD;
+    }
+
+    r->mask = size - 1;
+    r->head = r->tail_cache = 0;
+    r->tail = r->head_cache = 0;
+
+    *ring = r;
+
+    return EMBED_SUCCESS;
+}
+
+embed_status_t mcached_spsc_ring_destroy(mcached_spsc_ring_t *ring)
+{
+    EMBED_ASSERT_RETURN(ring != NULL, EMBED_FAILD);
+
+    Free(ring->slots);
+    Free(ring);
+
+    return EMBED_SUCCESS;
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,212 @@
+#ifndef _MCACHED_RING_H_
+#define _MCACHED_RING_H_
+
+#include "type.h"
+
+/**
+ * @defgroup EMBED_HAS_MPMC_RING
+ * @{
+ */
+
+/**
+ * Bounded multi-producer/multi-consumer ring of 32-bit values.
+ *
+ * Every cell carries a sequence number that tells producers and consumers
+ * whether the cell is free for the current lap (D. Vyukov's scheme), so
+ * enqueue and dequeue only contend on a single CAS of their own cursor.
+ * Capacity is rounded up to a power of two.
+ */
+
+typedef struct
+{
+    uint32 seq;
+    uint32 data;
+}mcached_ring_cell_t;
+
+typedef struct
+{
+    uint32 enqueue_pos EMBED_CACHE_ALIGNED;
+    uint32 dequeue_pos EMBED_CACHE_ALIGNED;
+
+    uint32 mask EMBED_CACHE_ALIGNED;
+    mcached_ring_cell_t *cells;
+}mcached_ring_t;
+
+embed_status_t mcached_ring_create(mcached_ring_t **ring, uint32 capacity);
+
+embed_status_t mcached_ring_destroy(mcached_ring_t *ring);
+
+static inline embed_bool_t mcached_ring_enqueue(mcached_ring_t *ring, uint32 data)
+{
+    mcached_ring_cell_t *cell;
+    uint32 pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+
+    for(;;)
+    {
+        int32 dif;
+
+        cell = &ring->cells[pos & ring->mask];
+        dif = (int32)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if(dif == 0)
+        {
+            if(__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1,
+                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if(dif < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->data = data;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static inline embed_bool_t mcached_ring_dequeue(mcached_ring_t *ring, uint32 *data)
+{
+    mcached_ring_cell_t *cell;
+    uint32 pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+
+    for(;;)
+    {
+        int32 dif;
+
+        cell = &ring->cells[pos & ring->mask];
+        dif = (int32)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+
+        if(dif == 0)
+        {
+            if(__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + 1,
+                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if(dif < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    *data = cell->data;
+    __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/*Approximate number of queued values, exact only when the ring is quiescent*/
+static inline uint32 mcached_ring_count(mcached_ring_t *ring)
+{
+    return __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED)
+        - __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+}
+
+/**
+ * @}
+ */
+
+
+/**
+ * @defgroup EMBED_HAS_SPSC_RING
+ * @{
+ */
+
+/**
+ * Bounded single-producer/single-consumer ring of 32-bit values.
+ *
+ * head is only written by the consumer and tail only by the producer, each
+ * on its own cache line next to the side's cached copy of the other index.
+ * The shared index is re-read (acquire) only when the cached copy says the
+ * ring is full or empty, so the common case touches no shared line at all.
+ */
+
+typedef struct
+{
+    uint32 head EMBED_CACHE_ALIGNED;
+    uint32 tail_cache;
+
+    uint32 tail EMBED_CACHE_ALIGNED;
+    uint32 head_cache;
+
+    uint32 mask EMBED_CACHE_ALIGNED;
+    uint32 *slots;
+}mcached_spsc_ring_t;
+
+embed_status_t mcached_spsc_ring_create(mcached_spsc_ring_t **ring, uint32 capacity);
+
+embed_status_t mcached_spsc_ring_destroy(mcached_spsc_ring_t *ring);
+
+/*Producer side only*/
+static inline embed_bool_t mcached_spsc_ring_enqueue(mcached_spsc_ring_t *ring, uint32 data)
+{
+    uint32 tail = ring->tail;
+
+    if(tail - ring->head_cache > ring->mask)
+    {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if(tail - ring->head_cache > ring->mask)
+            return false;
+    }
+
+    ring->slots[tail & ring->mask] = data;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/*Consumer side only*/
+static inline embed_bool_t mcached_spsc_ring_dequeue(mcached_spsc_ring_t *ring, uint32 *data)
+{
+    uint32 head = ring->head;
+
+    if(head == ring->tail_cache)
+    {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if(head == ring->tail_cache)
+            return false;
+    }
+
+    *data = ring->slots[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/*Consumer side only: the entry n places behind the head, left queued*/
+static inline embed_bool_t mcached_spsc_ring_peek(mcached_spsc_ring_t *ring, uint32 n, uint32 *data)
+{
+    uint32 head = ring->head;
+
+    if(ring->tail_cache - head <= n)
+    {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if(ring->tail_cache - head <= n)
+            return false;
+    }
+
+    *data = ring->slots[(head + n) & ring->mask];
+
+    return true;
+}
+
+/*Consumer side only: take n entries already seen through peek*/
+static inline void mcached_spsc_ring_skip(mcached_spsc_ring_t *ring, uint32 n)
+{
+    __atomic_store_n(&ring->head, ring->head + n, __ATOMIC_RELEASE);
+}
+
+/**
+ * @}
+ */
+
+#endif
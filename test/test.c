@@ -0,0 +1,1998 @@
+/*
+ * mcached behaviour tests.
+ *
+ * Every case builds its own queue, drives it through one feature and
+ * checks what comes out. Cases run in table order; the first failed check
+ * prints file:line and the run exits non zero. Pass case names to run only
+ * those:
+ *
+ *   ./test/mcached_test               all cases
+ *   ./test/mcached_test shard_steal   one case
+ */
+#include "mcachedqueue.h"
+#include "mcachedshard.h"
+#include "mcachedsized.h"
+#include "mcachedshm.h"
+#include "mcachedcompact.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+typedef struct
+{
+    struct list_head node;
+    uint64 key;
+    uint64 seq;
+}test_item_t;
+
+#define TEST_ITEM(item) ((test_item_t *)(item))
+
+#define TEST_CHECK(cond) \
+    do { \
+        if(!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return EMBED_FAILD; \
+        } \
+    } while(0)
+
+typedef int (*test_case_cb)(void);
+
+static uint64 test_key(struct list_head *item)
+{
+    return TEST_ITEM(item)->key;
+}
+
+/*Absolute CLOCK_MONOTONIC deadline ms from now*/
+static struct timespec test_deadline(int ms)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += (long)ms * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+
+    return ts;
+}
+
+#define TEST_MPMC_PER_PRODUCER  50000
+
+typedef struct
+{
+    mcached_queue_t *queue;
+    int    id;
+    int    producers;
+    long   *consumed;
+    uint64 sum;
+    char   *seen;
+
+    /*a lone consumer sees every producer's items in order*/
+    int    ordered;
+    uint64 next[8];
+    long   out_of_order;
+}test_mpmc_t;
+
+static void *test_mpmc_producer(void *arg)
+{
+    test_mpmc_t *t = (test_mpmc_t *)arg;
+    struct list_head *item;
+    uint64 i;
+
+    for(i = 0; i < TEST_MPMC_PER_PRODUCER; i++)
+    {
+        while(mcached_queue_get_idle_item(t->queue, &item) != EMBED_SUCCESS)
+            sched_yield();
+        TEST_ITEM(item)->seq = t->id * (uint64)TEST_MPMC_PER_PRODUCER + i;
+        mcached_queue_add(t->queue, item);
+    }
+
+    return NULL;
+}
+
+static void *test_mpmc_consumer(void *arg)
+{
+    test_mpmc_t *t = (test_mpmc_t *)arg;
+    long total = (long)t->producers * TEST_MPMC_PER_PRODUCER;
+    struct list_head *item;
+    struct timespec deadline;
+    uint64 seq;
+
+    while(__atomic_load_n(t->consumed, __ATOMIC_RELAXED) < total)
+    {
+        deadline = test_deadline(10);
+        if(mcached_queue_timedpop(t->queue, &item, &deadline) != EMBED_SUCCESS)
+            continue;
+
+        seq = TEST_ITEM(item)->seq;
+        mcached_queue_del(t->queue, item);
+
+        if(seq < (uint64)total)
+            __atomic_add_fetch(&t->seen[seq], 1, __ATOMIC_RELAXED);
+        if(t->ordered && seq < (uint64)total
+                && seq % TEST_MPMC_PER_PRODUCER != t->next[seq / TEST_MPMC_PER_PRODUCER]++)
+            t->out_of_order++;
+        t->sum += seq;
+        __atomic_add_fetch(t->consumed, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/*
+ * producers x consumers threads through a small queue; every item must
+ * come out exactly once
+ */
+static int test_mpmc(const mcached_queue_attr_t *attr, int producers, int consumers)
+{
+    mcached_queue_t queue;
+    test_mpmc_t prod[8], cons[8];
+    long consumed = 0, total = (long)producers * TEST_MPMC_PER_PRODUCER, i;
+    uint64 sum = 0;
+    char *seen;
+
+    TEST_CHECK(producers <= 8 && consumers <= 8);
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 256, attr) == EMBED_SUCCESS);
+    seen = (char *)calloc(total, 1);
+    TEST_CHECK(seen != NULL);
+
+    for(i = 0; i < consumers; i++)
+    {
+        memset(&cons[i], 0, sizeof(cons[i]));
+        cons[i].queue = &queue;
+        cons[i].producers = producers;
+        cons[i].consumed = &consumed;
+        cons[i].seen = seen;
+        cons[i].ordered = consumers == 1;
+    }
+    for(i = 0; i < producers; i++)
+    {
+        memset(&prod[i], 0, sizeof(prod[i]));
+        prod[i].queue = &queue;
+        prod[i].id = i;
+    }
+
+    {
+        pthread_t ptid[8], ctid[8];
+
+        for(i = 0; i < consumers; i++)
+            TEST_CHECK(pthread_create(&ctid[i], NULL, test_mpmc_consumer, &cons[i]) == 0);
+        for(i = 0; i < producers; i++)
+            TEST_CHECK(pthread_create(&ptid[i], NULL, test_mpmc_producer, &prod[i]) == 0);
+        for(i = 0; i < producers; i++)
+            pthread_join(ptid[i], NULL);
+        for(i = 0; i < consumers; i++)
+        {
+            pthread_join(ctid[i], NULL);
+            sum += cons[i].sum;
+            TEST_CHECK(cons[i].out_of_order == 0);
+        }
+    }
+
+    TEST_CHECK(consumed == total);
+    TEST_CHECK(sum == (uint64)total * (total - 1) / 2);
+    for(i = 0; i < total; i++)
+        TEST_CHECK(seen[i] == 1);
+
+    Free(seen);
+    mcached_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+
+/*The lock-free MPMC ring against the list it replaces*/
+static int test_ring(void)
+{
+    mcached_queue_attr_t attr;
+
+    mcached_queue_attr_init(&attr);
+    TEST_CHECK(test_mpmc(&attr, 4, 4) == EMBED_SUCCESS);
+
+    attr.mode = MCACHED_QUEUE_MODE_MPMC_RING;
+    TEST_CHECK(test_mpmc(&attr, 1, 1) == EMBED_SUCCESS);
+    TEST_CHECK(test_mpmc(&attr, 4, 4) == EMBED_SUCCESS);
+    TEST_CHECK(test_mpmc(&attr, 8, 2) == EMBED_SUCCESS);
+
+    return EMBED_SUCCESS;
+}
+
+/*The wait-free SPSC rings, one thread on each side and strict FIFO*/
+static int test_spsc(void)
+{
+    mcached_queue_attr_t attr;
+
+    mcached_queue_attr_init(&attr);
+    attr.mode = MCACHED_QUEUE_MODE_SPSC;
+    TEST_CHECK(test_mpmc(&attr, 1, 1) == EMBED_SUCCESS);
+
+    attr.residency_hist = 1;
+    TEST_CHECK(test_mpmc(&attr, 1, 1) == EMBED_SUCCESS);
+
+    return EMBED_SUCCESS;
+}
+
+/*Batches move whole runs in FIFO order and capacity is never exceeded*/
+static int test_batch_mode(mcached_queue_mode_t mode)
+{
+    mcached_queue_attr_t attr;
+    mcached_queue_t queue;
+    struct list_head *item;
+    LIST_HEAD(batch);
+    uint64 seq = 0, next = 0;
+    int n;
+
+    mcached_queue_attr_init(&attr);
+    attr.mode = mode;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 256, &attr) == EMBED_SUCCESS);
+
+    TEST_CHECK(mcached_queue_get_idle_items(&queue, 300, &batch) == 256);
+    TEST_CHECK(mcached_queue_get_idle_item(&queue, &item) != EMBED_SUCCESS);
+    list_for_each(item, &batch)
+        TEST_ITEM(item)->seq = seq++;
+    TEST_CHECK(mcached_queue_add_batch(&queue, &batch) == EMBED_SUCCESS);
+    TEST_CHECK(list_empty(&batch));
+
+    while((n = mcached_queue_pop_batch(&queue, 100, &batch)) > 0)
+    {
+        TEST_CHECK(n == (next < 200 ? 100 : 56));
+        list_for_each(item, &batch)
+            TEST_CHECK(TEST_ITEM(item)->seq == next++);
+        mcached_queue_put_idle_items(&queue, &batch);
+        TEST_CHECK(list_empty(&batch));
+    }
+    TEST_CHECK(next == 256);
+
+    /*every slot went back to idle*/
+    TEST_CHECK(mcached_queue_get_idle_items(&queue, 256, &batch) == 256);
+    mcached_queue_put_idle_items(&queue, &batch);
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) != EMBED_SUCCESS);
+
+    mcached_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+
+static int test_batch(void)
+{
+    TEST_CHECK(test_batch_mode(MCACHED_QUEUE_MODE_LIST) == EMBED_SUCCESS);
+    TEST_CHECK(test_batch_mode(MCACHED_QUEUE_MODE_MPMC_RING) == EMBED_SUCCESS);
+
+    return EMBED_SUCCESS;
+}
+
+#define TEST_MAGAZINE_CNT 64
+
+/*Queue up to cnt idle items and del them again, returns how many*/
+static int test_magazine_cycle(mcached_queue_t *queue, int cnt)
+{
+    struct list_head *item;
+    int n = 0;
+
+    while(n < cnt && mcached_queue_get_idle_item(queue, &item) == EMBED_SUCCESS)
+    {
+        mcached_queue_add(queue, item);
+        n++;
+    }
+    while(mcached_queue_trypop(queue, &item) == EMBED_SUCCESS)
+        mcached_queue_del(queue, item);
+
+    return n;
+}
+
+/*Leave a few items in this thread's magazine and exit*/
+static void *test_magazine_fill(void *arg)
+{
+    return test_magazine_cycle((mcached_queue_t *)arg, 8) == 8 ? NULL : (void *)1;
+}
+
+static void *test_magazine_count(void *arg)
+{
+    return (void *)(long)test_magazine_cycle((mcached_queue_t *)arg, TEST_MAGAZINE_CNT + 1);
+}
+
+/*Per-thread magazines under load, and no item stranded in one*/
+static int test_magazine(void)
+{
+    mcached_queue_attr_t attr;
+    mcached_queue_t queue;
+    pthread_t tid;
+    void *ret;
+
+    mcached_queue_attr_init(&attr);
+    attr.magazine_size = 16;
+    TEST_CHECK(test_mpmc(&attr, 4, 4) == EMBED_SUCCESS);
+
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), TEST_MAGAZINE_CNT, &attr) == EMBED_SUCCESS);
+
+    /*an exiting thread hands its magazine back*/
+    TEST_CHECK(pthread_create(&tid, NULL, test_magazine_fill, &queue) == 0);
+    pthread_join(tid, &ret);
+    TEST_CHECK(ret == NULL);
+    TEST_CHECK(test_magazine_cycle(&queue, TEST_MAGAZINE_CNT + 1) == TEST_MAGAZINE_CNT);
+
+    /*and a flush empties the caller's own for the other threads*/
+    mcached_queue_magazine_flush(&queue);
+    TEST_CHECK(pthread_create(&tid, NULL, test_magazine_count, &queue) == 0);
+    pthread_join(tid, &ret);
+    TEST_CHECK(ret == (void *)TEST_MAGAZINE_CNT);
+
+    mcached_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+/*
+ * Take every slot once: each lies on a slot_align boundary and owns its
+ * whole stride
+ */
+static int test_slab_cycle(mcached_queue_t *queue, int cnt, int align)
+{
+    struct list_head *item;
+    LIST_HEAD(batch);
+
+    TEST_CHECK(mcached_queue_get_idle_items(queue, cnt, &batch) == cnt);
+    list_for_each(item, &batch)
+    {
+        TEST_CHECK(align == 0 || (uintptr_t)item % align == 0);
+        memset(item + 1, 0xa5, queue->item_stride - sizeof(*item));
+    }
+    mcached_queue_put_idle_items(queue, &batch);
+
+    return EMBED_SUCCESS;
+}
+
+/*slot_pad and slot_align shape the stride, slab_flags pick the memory*/
+static int test_slab(void)
+{
+    mcached_queue_attr_t attr;
+    mcached_queue_t queue;
+
+    mcached_queue_attr_init(&attr);
+    attr.slot_pad = 8;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 64, &attr) == EMBED_SUCCESS);
+    TEST_CHECK(queue.item_stride == (int)sizeof(test_item_t) + 8);
+    TEST_CHECK(test_slab_cycle(&queue, 64, 0) == EMBED_SUCCESS);
+    mcached_queue_destroy(&queue);
+
+    attr.slot_align = 128;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 64, &attr) == EMBED_SUCCESS);
+    TEST_CHECK(queue.item_stride == 128);
+    TEST_CHECK(test_slab_cycle(&queue, 64, 128) == EMBED_SUCCESS);
+    mcached_queue_destroy(&queue);
+
+    /*transparent huge pages are a hint, the slab comes up without them*/
+    attr.slot_pad = 0;
+    attr.slot_align = EMBED_CACHE_LINE_SIZE;
+    attr.slab_flags = MCACHED_QUEUE_SLAB_THP;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 4096, &attr) == EMBED_SUCCESS);
+    TEST_CHECK(queue.item_stride == EMBED_CACHE_LINE_SIZE);
+    TEST_CHECK(queue.slab_size % EMBED_HUGE_PAGE_SIZE == 0);
+    TEST_CHECK(test_slab_cycle(&queue, 4096, EMBED_CACHE_LINE_SIZE) == EMBED_SUCCESS);
+    mcached_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+
+
+static const void *test_index_key(struct list_head *item)
+{
+    return &TEST_ITEM(item)->key;
+}
+
+static uint32 test_index_hash(const void *key)
+{
+    uint64 k = *(const uint64 *)key * 0x9e3779b97f4a7c15ULL;
+
+    return (uint32)(k >> 32);
+}
+
+static bool test_index_compare(struct list_head *queue_item, void *find_item)
+{
+    return TEST_ITEM(queue_item)->key == *(uint64 *)find_item;
+}
+
+/*The hash index follows add, del, pop and pop_batch*/
+static int test_index(void)
+{
+    mcached_queue_attr_t attr;
+    mcached_queue_t queue;
+    struct list_head *item, *found;
+    LIST_HEAD(batch);
+    uint32 tokens;
+    uint64 key;
+    int i;
+
+    mcached_queue_attr_init(&attr);
+    attr.index_key = test_index_key;
+    attr.index_hash = test_index_hash;
+    attr.index_compare = test_index_compare;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 512, &attr) == EMBED_SUCCESS);
+
+    for(i = 0; i < 512; i++)
+    {
+        TEST_CHECK(mcached_queue_get_idle_item(&queue, &item) == EMBED_SUCCESS);
+        TEST_ITEM(item)->key = 1000 + i * 7;
+        mcached_queue_add(&queue, item);
+    }
+
+    for(i = 0; i < 512; i++)
+    {
+        key = 1000 + i * 7;
+        TEST_CHECK(mcached_queue_find_by_key(&queue, &key, &found) == EMBED_SUCCESS);
+        TEST_CHECK(TEST_ITEM(found)->key == key);
+    }
+    key = 1001;
+    TEST_CHECK(mcached_queue_find_by_key(&queue, &key, &found) != EMBED_SUCCESS);
+
+    /*del of a queued item, pop and pop_batch all leave the index*/
+    key = 1000 + 100 * 7;
+    TEST_CHECK(mcached_queue_find_by_key(&queue, &key, &found) == EMBED_SUCCESS);
+    mcached_queue_del(&queue, found);
+    TEST_CHECK(mcached_queue_find_by_key(&queue, &key, &found) != EMBED_SUCCESS);
+
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS);
+    key = TEST_ITEM(item)->key;
+    TEST_CHECK(key == 1000);
+    TEST_CHECK(mcached_queue_find_by_key(&queue, &key, &found) != EMBED_SUCCESS);
+    mcached_queue_del(&queue, item);
+
+    TEST_CHECK(mcached_queue_pop_batch(&queue, 50, &batch) == 50);
+    list_for_each(item, &batch)
+    {
+        key = TEST_ITEM(item)->key;
+        TEST_CHECK(mcached_queue_find_by_key(&queue, &key, &found) != EMBED_SUCCESS);
+    }
+    mcached_queue_put_idle_items(&queue, &batch);
+
+    /*pop_batch takes one token per item, del of each only recycles it*/
+    tokens = queue.ready_event->nready;
+    TEST_CHECK(mcached_queue_pop_batch(&queue, 20, &batch) == 20);
+    TEST_CHECK(queue.ready_event->nready == tokens - 20);
+    list_for_each_safe(item, found, &batch)
+        mcached_queue_del(&queue, item);
+    INIT_LIST_HEAD(&batch);
+    TEST_CHECK(queue.taken_cnt == 0);
+    i = 0;
+    list_for_each(item, queue.used_list)
+    {
+        key = TEST_ITEM(item)->key;
+        TEST_CHECK(mcached_queue_find_by_key(&queue, &key, &found) == EMBED_SUCCESS && found == item);
+        i++;
+    }
+    TEST_CHECK(i == 512 - 2 - 50 - 20);
+
+    /*a recycled slot is indexed under its new key only*/
+    TEST_CHECK(mcached_queue_get_idle_item(&queue, &item) == EMBED_SUCCESS);
+    TEST_ITEM(item)->key = 5;
+    mcached_queue_add(&queue, item);
+    key = 5;
+    TEST_CHECK(mcached_queue_find_by_key(&queue, &key, &found) == EMBED_SUCCESS && found == item);
+
+    mcached_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+
+#define TEST_EVENT_WAITERS  4
+#define TEST_EVENT_TOKENS   5000
+
+static void *test_event_waiter(void *arg)
+{
+    embed_ready_event_t *ev = (embed_ready_event_t *)arg;
+    int i;
+
+    for(i = 0; i < TEST_EVENT_TOKENS; i++)
+        embed_ready_event_wait(ev);
+
+    return NULL;
+}
+
+/*
+ * Every token wakes exactly one wait, whether the waiters are still
+ * spinning or already parked in the futex
+ */
+static int test_ready_event(void)
+{
+    static const uint32 spins[] = {0, EMBED_READY_EVENT_SPIN};
+    embed_ready_event_t *ev;
+    struct timespec deadline;
+    pthread_t tid[TEST_EVENT_WAITERS];
+    int i, s, posted;
+
+    for(s = 0; s < (int)(sizeof(spins) / sizeof(spins[0])); s++)
+    {
+        TEST_CHECK(embed_ready_event_create(&ev) == EMBED_SUCCESS);
+        TEST_CHECK(embed_ready_event_set_spin(ev, spins[s]) == EMBED_SUCCESS);
+        TEST_CHECK(embed_ready_event_trywait(ev) != EMBED_SUCCESS);
+        deadline = test_deadline(10);
+        TEST_CHECK(embed_ready_event_timedwait(ev, &deadline) != EMBED_SUCCESS);
+
+        for(i = 0; i < TEST_EVENT_WAITERS; i++)
+            TEST_CHECK(pthread_create(&tid[i], NULL, test_event_waiter, ev) == 0);
+
+        /*single tokens with pauses to let waiters park, and bursts*/
+        for(posted = 0; posted < TEST_EVENT_WAITERS * TEST_EVENT_TOKENS; )
+        {
+            if(posted % 100 == 0)
+            {
+                usleep(100);
+                embed_ready_event_active(ev);
+                posted++;
+            }
+            else
+            {
+                embed_ready_event_active_n(ev, 9);
+                posted += 9;
+            }
+        }
+        TEST_CHECK(posted == TEST_EVENT_WAITERS * TEST_EVENT_TOKENS);
+
+        for(i = 0; i < TEST_EVENT_WAITERS; i++)
+            pthread_join(tid[i], NULL);
+        TEST_CHECK(ev->nready == 0 && ev->waiters == 0);
+
+        embed_ready_event_destroy(ev);
+    }
+
+    return EMBED_SUCCESS;
+}
+
+static int test_readable(int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+/*Add cnt fresh items, one add_batch when batch is set*/
+static int test_eventfd_add(mcached_queue_t *queue, int cnt, int batch)
+{
+    struct list_head *item;
+    LIST_HEAD(items);
+
+    if(batch)
+    {
+        TEST_CHECK(mcached_queue_get_idle_items(queue, cnt, &items) == cnt);
+        return mcached_queue_add_batch(queue, &items);
+    }
+
+    while(cnt-- > 0)
+    {
+        TEST_CHECK(mcached_queue_get_idle_item(queue, &item) == EMBED_SUCCESS);
+        TEST_CHECK(mcached_queue_add(queue, item) == EMBED_SUCCESS);
+    }
+
+    return EMBED_SUCCESS;
+}
+
+/*Counter mode coalesces until ack, semaphore mode counts every item*/
+static int test_eventfd(void)
+{
+    mcached_queue_attr_t attr;
+    mcached_queue_t queue;
+    int fd, i;
+
+    mcached_queue_attr_init(&attr);
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 64, &attr) == EMBED_SUCCESS);
+    TEST_CHECK(mcached_queue_eventfd(&queue) < 0);
+    mcached_queue_destroy(&queue);
+
+    attr.eventfd_mode = MCACHED_QUEUE_EVENTFD_COUNTER;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 64, &attr) == EMBED_SUCCESS);
+    fd = mcached_queue_eventfd(&queue);
+    TEST_CHECK(fd >= 0 && !test_readable(fd));
+
+    TEST_CHECK(test_eventfd_add(&queue, 3, 0) == EMBED_SUCCESS);
+    TEST_CHECK(test_readable(fd));
+    TEST_CHECK(mcached_queue_eventfd_ack(&queue) == 1);
+    TEST_CHECK(!test_readable(fd));
+
+    TEST_CHECK(test_eventfd_add(&queue, 4, 1) == EMBED_SUCCESS);
+    TEST_CHECK(test_readable(fd));
+    TEST_CHECK(mcached_queue_eventfd_ack(&queue) == 1);
+    TEST_CHECK(mcached_queue_eventfd_ack(&queue) == 0);
+    mcached_queue_destroy(&queue);
+
+    attr.eventfd_mode = MCACHED_QUEUE_EVENTFD_SEMAPHORE;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 64, &attr) == EMBED_SUCCESS);
+    fd = mcached_queue_eventfd(&queue);
+    TEST_CHECK(fd >= 0 && !test_readable(fd));
+
+    TEST_CHECK(test_eventfd_add(&queue, 2, 0) == EMBED_SUCCESS);
+    TEST_CHECK(test_eventfd_add(&queue, 5, 1) == EMBED_SUCCESS);
+    for(i = 0; i < 7; i++)
+        TEST_CHECK(mcached_queue_eventfd_ack(&queue) == 1);
+    TEST_CHECK(!test_readable(fd));
+    mcached_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+
+static uint64 test_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *test_pop_waiter(void *arg)
+{
+    struct list_head *item;
+
+    if(mcached_queue_pop((mcached_queue_t *)arg, &item) != EMBED_SUCCESS)
+        return NULL;
+
+    return item;
+}
+
+/*pop parks until an add, timedpop keeps its deadline, trypop leaves no stray token*/
+static int test_pop_mode(mcached_queue_mode_t mode)
+{
+    mcached_queue_attr_t attr;
+    mcached_queue_t queue;
+    struct list_head *item, *got;
+    struct timespec deadline;
+    pthread_t tid;
+    uint64 start;
+    int i;
+
+    mcached_queue_attr_init(&attr);
+    attr.mode = mode;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 16, &attr) == EMBED_SUCCESS);
+
+    start = test_now_ns();
+    deadline = test_deadline(30);
+    TEST_CHECK(mcached_queue_timedpop(&queue, &item, &deadline) != EMBED_SUCCESS);
+    TEST_CHECK(test_now_ns() - start >= 30000000ULL);
+
+    TEST_CHECK(pthread_create(&tid, NULL, test_pop_waiter, &queue) == 0);
+    usleep(20 * 1000);
+    TEST_CHECK(mcached_queue_get_idle_item(&queue, &item) == EMBED_SUCCESS);
+    TEST_ITEM(item)->seq = 42;
+    mcached_queue_add(&queue, item);
+    pthread_join(tid, (void **)&got);
+    TEST_CHECK(got == item && TEST_ITEM(got)->seq == 42);
+    mcached_queue_del(&queue, got);
+
+    /*items taken by trypop drop their tokens, so timedpop must time out*/
+    for(i = 0; i < 8; i++)
+    {
+        TEST_CHECK(mcached_queue_get_idle_item(&queue, &item) == EMBED_SUCCESS);
+        mcached_queue_add(&queue, item);
+    }
+    for(i = 0; i < 8; i++)
+    {
+        TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS);
+        mcached_queue_del(&queue, item);
+    }
+    deadline = test_deadline(10);
+    TEST_CHECK(mcached_queue_timedpop(&queue, &item, &deadline) != EMBED_SUCCESS);
+    TEST_CHECK(queue.ready_event->nready == 0);
+
+    mcached_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+
+static int test_pop(void)
+{
+    TEST_CHECK(test_pop_mode(MCACHED_QUEUE_MODE_LIST) == EMBED_SUCCESS);
+    TEST_CHECK(test_pop_mode(MCACHED_QUEUE_MODE_MPMC_RING) == EMBED_SUCCESS);
+    TEST_CHECK(test_pop_mode(MCACHED_QUEUE_MODE_SPSC) == EMBED_SUCCESS);
+
+    return EMBED_SUCCESS;
+}
+
+static int test_prio_add(mcached_queue_t *queue, uint64 key, int prio)
+{
+    struct list_head *item;
+
+    TEST_CHECK(mcached_queue_get_idle_item(queue, &item) == EMBED_SUCCESS);
+    TEST_ITEM(item)->key = key;
+    if(prio < 0)
+        mcached_queue_add(queue, item);
+    else
+        TEST_CHECK(mcached_queue_add_prio(queue, item, prio) == EMBED_SUCCESS);
+
+    return EMBED_SUCCESS;
+}
+
+/*most urgent level first, FIFO within a level, aged heads move up*/
+static int test_prio(void)
+{
+    static const uint64 order[] = {1, 4, 2, 5, 3, 6};
+    mcached_queue_attr_t attr;
+    mcached_queue_t queue;
+    struct list_head *item;
+    int i;
+
+    mcached_queue_attr_init(&attr);
+    attr.prio_levels = 3;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 16, &attr) == EMBED_SUCCESS);
+
+    /*plain add goes to the least urgent level*/
+    TEST_CHECK(test_prio_add(&queue, 3, -1) == EMBED_SUCCESS);
+    TEST_CHECK(test_prio_add(&queue, 2, 1) == EMBED_SUCCESS);
+    TEST_CHECK(test_prio_add(&queue, 1, 0) == EMBED_SUCCESS);
+    TEST_CHECK(test_prio_add(&queue, 4, 0) == EMBED_SUCCESS);
+    TEST_CHECK(test_prio_add(&queue, 5, 1) == EMBED_SUCCESS);
+    TEST_CHECK(test_prio_add(&queue, 6, 2) == EMBED_SUCCESS);
+
+    for(i = 0; i < (int)(sizeof(order) / sizeof(order[0])); i++)
+    {
+        TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS);
+        TEST_CHECK(TEST_ITEM(item)->key == order[i]);
+        mcached_queue_del(&queue, item);
+    }
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) != EMBED_SUCCESS);
+    mcached_queue_destroy(&queue);
+
+    /*a bulk item that waited prio_age_ns overtakes later urgent ones*/
+    attr.prio_levels = 2;
+    attr.prio_age_ns = 5000000ULL;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 16, &attr) == EMBED_SUCCESS);
+
+    TEST_CHECK(test_prio_add(&queue, 10, 1) == EMBED_SUCCESS);
+    TEST_CHECK(test_prio_add(&queue, 1, 0) == EMBED_SUCCESS);
+    usleep(10 * 1000);
+
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS);
+    TEST_CHECK(TEST_ITEM(item)->key == 1);
+    mcached_queue_del(&queue, item);
+    TEST_CHECK(test_prio_add(&queue, 2, 0) == EMBED_SUCCESS);
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS);
+    TEST_CHECK(TEST_ITEM(item)->key == 10);
+    mcached_queue_del(&queue, item);
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS);
+    TEST_CHECK(TEST_ITEM(item)->key == 2);
+    mcached_queue_del(&queue, item);
+
+    mcached_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+
+#if MCACHED_QUEUE_STATS
+static void *test_stats_worker(void *arg)
+{
+    mcached_queue_t *queue = (mcached_queue_t *)arg;
+    struct list_head *item;
+    int i;
+
+    for(i = 0; i < 1000; i++)
+    {
+        if(mcached_queue_get_idle_item(queue, &item) != EMBED_SUCCESS)
+            continue;
+        mcached_queue_add(queue, item);
+        if(mcached_queue_trypop(queue, &item) == EMBED_SUCCESS)
+            mcached_queue_del(queue, item);
+    }
+
+    return NULL;
+}
+
+/*per-thread counters sum up, also those of threads that already exited*/
+static int test_stats(void)
+{
+    mcached_queue_t queue;
+    mcached_queue_stats_t stats;
+    struct list_head *item;
+    pthread_t tid[4];
+    int i;
+
+    TEST_CHECK(mcached_queue_init(&queue, sizeof(test_item_t), 8) == EMBED_SUCCESS);
+
+    for(i = 0; i < 4; i++)
+        TEST_CHECK(pthread_create(&tid[i], NULL, test_stats_worker, &queue) == 0);
+    for(i = 0; i < 4; i++)
+        pthread_join(tid[i], NULL);
+
+    TEST_CHECK(mcached_queue_get_stats(&queue, &stats) == EMBED_SUCCESS);
+    TEST_CHECK(stats.enqueue == 4000 && stats.dequeue == 4000);
+    TEST_CHECK(stats.queued == 0 && stats.full == 0 && stats.empty == 0);
+    TEST_CHECK(stats.lock_acquired >= 8000);
+    TEST_CHECK(stats.max_item_cnt == 8 && stats.threads == 0);
+
+    /*a full slab and an empty queue are both counted*/
+    for(i = 0; i < 8; i++)
+    {
+        TEST_CHECK(mcached_queue_get_idle_item(&queue, &item) == EMBED_SUCCESS);
+        mcached_queue_add(&queue, item);
+    }
+    TEST_CHECK(mcached_queue_get_idle_item(&queue, &item) != EMBED_SUCCESS);
+    for(i = 0; i < 8; i++)
+    {
+        TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS);
+        mcached_queue_del(&queue, item);
+    }
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) != EMBED_SUCCESS);
+
+    TEST_CHECK(mcached_queue_get_stats(&queue, &stats) == EMBED_SUCCESS);
+    TEST_CHECK(stats.enqueue == 4008 && stats.dequeue == 4008);
+    TEST_CHECK(stats.full == 1 && stats.empty == 1);
+    TEST_CHECK(stats.used_item_hwm == 8 && stats.threads == 1);
+
+    mcached_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+#endif
+
+/*every way out of the queue records how long the item stayed in it*/
+static int test_residency_mode(mcached_queue_mode_t mode)
+{
+    mcached_queue_attr_t attr;
+    mcached_queue_t queue;
+    mcached_hist_t snap;
+    struct list_head *item;
+    LIST_HEAD(batch);
+    int i;
+
+    mcached_queue_attr_init(&attr);
+    attr.mode = mode;
+    attr.residency_hist = 1;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 16, &attr) == EMBED_SUCCESS);
+
+    for(i = 0; i < 4; i++)
+    {
+        TEST_CHECK(mcached_queue_get_idle_item(&queue, &item) == EMBED_SUCCESS);
+        mcached_queue_add(&queue, item);
+    }
+    usleep(20 * 1000);
+
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS);
+    mcached_queue_del(&queue, item);
+    TEST_CHECK(mcached_queue_pop_batch(&queue, 2, &batch) == 2);
+    mcached_queue_put_idle_items(&queue, &batch);
+    if(mode == MCACHED_QUEUE_MODE_LIST)
+    {
+        item = queue.used_list->next;
+        mcached_queue_del(&queue, item);
+    }
+    else
+    {
+        TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS);
+        mcached_queue_del(&queue, item);
+    }
+
+    TEST_CHECK(mcached_queue_residency(&queue, &snap) == EMBED_SUCCESS);
+    TEST_CHECK(snap.count == 4);
+    TEST_CHECK(mcached_hist_percentile(&snap, 0.0) >= 18000000ULL);
+    TEST_CHECK(snap.max < 10000000000ULL);
+
+    TEST_CHECK(mcached_queue_residency_reset(&queue) == EMBED_SUCCESS);
+    TEST_CHECK(mcached_queue_residency(&queue, &snap) == EMBED_SUCCESS);
+    TEST_CHECK(snap.count == 0);
+
+    mcached_queue_destroy(&queue);
+
+    /*without residency_hist there is nothing to read*/
+    TEST_CHECK(mcached_queue_init(&queue, sizeof(test_item_t), 16) == EMBED_SUCCESS);
+    TEST_CHECK(mcached_queue_residency(&queue, &snap) != EMBED_SUCCESS);
+    mcached_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+
+static int test_residency(void)
+{
+    TEST_CHECK(test_residency_mode(MCACHED_QUEUE_MODE_LIST) == EMBED_SUCCESS);
+    TEST_CHECK(test_residency_mode(MCACHED_QUEUE_MODE_MPMC_RING) == EMBED_SUCCESS);
+    TEST_CHECK(test_residency_mode(MCACHED_QUEUE_MODE_SPSC) == EMBED_SUCCESS);
+
+    return EMBED_SUCCESS;
+}
+
+typedef struct
+{
+    uint64 sum;
+    uint64 cnt;
+}test_parallel_part_t;
+
+static embed_bool_t test_parallel_visit(mcached_queue_t *queue, struct list_head *item, void *part)
+{
+    test_parallel_part_t *p = (test_parallel_part_t *)part;
+
+    (void)queue;
+
+    p->sum += TEST_ITEM(item)->key;
+    p->cnt++;
+
+    return TEST_ITEM(item)->key % 2 == 0;
+}
+
+static embed_bool_t test_parallel_keep(mcached_queue_t *queue, struct list_head *item, void *part)
+{
+    test_parallel_visit(queue, item, part);
+
+    return false;
+}
+
+static void test_parallel_reduce(mcached_queue_t *queue, void *result, void *part)
+{
+    test_parallel_part_t *r = (test_parallel_part_t *)result;
+    test_parallel_part_t *p = (test_parallel_part_t *)part;
+
+    (void)queue;
+
+    r->sum += p->sum;
+    r->cnt += p->cnt;
+}
+
+/*
+ * Every used item is visited once, across all levels and foreign items
+ * included, and true dels it
+ */
+static int test_traverse_parallel(void)
+{
+    static const int nthreads[] = {1, 4, 4, 3};
+    mcached_queue_attr_t attr;
+    mcached_queue_t queue;
+    mcached_shard_queue_t squeue;
+    test_parallel_part_t result;
+    struct list_head *item;
+    uint64 key, sum = 0;
+    int i, left;
+
+    mcached_queue_attr_init(&attr);
+    attr.prio_levels = 2;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 1000, &attr) == EMBED_SUCCESS);
+
+    for(key = 1; key <= 1000; key++)
+    {
+        TEST_CHECK(mcached_queue_get_idle_item(&queue, &item) == EMBED_SUCCESS);
+        TEST_ITEM(item)->key = key;
+        TEST_CHECK(mcached_queue_add_prio(&queue, item, key % 3 == 0 ? 0 : 1) == EMBED_SUCCESS);
+        sum += key;
+    }
+
+    /*the first pass dels the even keys, the later ones see only odd keys*/
+    left = 1000;
+    for(i = 0; i < (int)(sizeof(nthreads) / sizeof(nthreads[0])); i++)
+    {
+        memset(&result, 0, sizeof(result));
+        TEST_CHECK(mcached_queue_traverse_parallel(&queue, test_parallel_visit, nthreads[i],
+                    sizeof(test_parallel_part_t), test_parallel_reduce, &result) == EMBED_SUCCESS);
+        TEST_CHECK(result.cnt == (uint64)left && result.sum == sum);
+        if(i == 0)
+        {
+            left = 500;
+            sum = 500ULL * 500;
+        }
+    }
+
+    for(i = 0; i < left; i++)
+    {
+        TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS);
+        TEST_CHECK(TEST_ITEM(item)->key % 2 == 1);
+        mcached_queue_del(&queue, item);
+    }
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) != EMBED_SUCCESS);
+
+    mcached_queue_destroy(&queue);
+
+    /*stolen items sit on the home list without counting as its slots*/
+    mcached_queue_attr_init(&attr);
+    TEST_CHECK(mcached_shard_queue_init(&squeue, sizeof(test_item_t), 64, 2, &attr) == EMBED_SUCCESS);
+    squeue.steal_batch = 32;
+    for(key = 1; key <= 32; key++)
+    {
+        TEST_CHECK(mcached_queue_get_idle_item(MCACHED_SHARD_QUEUE(&squeue, 1), &item) == EMBED_SUCCESS);
+        TEST_ITEM(item)->key = key;
+        TEST_CHECK(mcached_shard_queue_add(&squeue, item) == EMBED_SUCCESS);
+    }
+    TEST_CHECK(mcached_shard_queue_trypop(&squeue, 0, &item) == EMBED_SUCCESS);
+    mcached_shard_queue_del(&squeue, item);
+    TEST_CHECK(MCACHED_SHARD_QUEUE(&squeue, 0)->used_item_cnt == 0);
+
+    memset(&result, 0, sizeof(result));
+    TEST_CHECK(mcached_queue_traverse_parallel(MCACHED_SHARD_QUEUE(&squeue, 0), test_parallel_keep, 4,
+                sizeof(test_parallel_part_t), test_parallel_reduce, &result) == EMBED_SUCCESS);
+    TEST_CHECK(result.cnt == 31 && result.sum == 32 * 33 / 2 - 1);
+
+    for(i = 0; i < 31; i++)
+    {
+        TEST_CHECK(mcached_shard_queue_trypop(&squeue, 0, &item) == EMBED_SUCCESS);
+        mcached_shard_queue_del(&squeue, item);
+    }
+    mcached_shard_queue_destroy(&squeue);
+
+    return EMBED_SUCCESS;
+}
+
+/*
+ * The look-ahead iterators visit every node once, in order, whether the
+ * list is shorter or longer than LIST_PREFETCH_DISTANCE; ahead never
+ * falls behind pos
+ */
+static int test_list_prefetch(void)
+{
+    static const int lens[] = {0, 1, LIST_PREFETCH_DISTANCE - 1, LIST_PREFETCH_DISTANCE,
+        LIST_PREFETCH_DISTANCE + 1, 5 * LIST_PREFETCH_DISTANCE};
+    test_item_t nodes[5 * LIST_PREFETCH_DISTANCE];
+    struct list_head *pos, *n, *ahead;
+    LIST_HEAD(head);
+    uint64 next;
+    int i, j;
+
+    for(i = 0; i < (int)(sizeof(lens) / sizeof(lens[0])); i++)
+    {
+        INIT_LIST_HEAD(&head);
+        for(j = 0; j < lens[i]; j++)
+        {
+            nodes[j].key = j;
+            list_add_tail(&nodes[j].node, &head);
+        }
+
+        next = 0;
+        list_for_each_prefetch(pos, ahead, &head)
+        {
+            TEST_CHECK(TEST_ITEM(pos)->key == next++);
+            TEST_CHECK(ahead == &head || TEST_ITEM(ahead)->key >= TEST_ITEM(pos)->key);
+        }
+        TEST_CHECK(next == (uint64)lens[i]);
+
+        /*drop the odd keys on the way*/
+        next = 0;
+        list_for_each_safe_prefetch(pos, n, ahead, &head)
+        {
+            TEST_CHECK(TEST_ITEM(pos)->key == next++);
+            if(TEST_ITEM(pos)->key % 2)
+                list_del_init(pos);
+        }
+        TEST_CHECK(next == (uint64)lens[i]);
+
+        next = 0;
+        list_for_each(pos, &head)
+        {
+            TEST_CHECK(TEST_ITEM(pos)->key == next);
+            next += 2;
+        }
+        TEST_CHECK(next == (uint64)(lens[i] + 1) / 2 * 2);
+    }
+
+    return EMBED_SUCCESS;
+}
+
+#define TEST_KEYS_CNT   3000
+
+/*the column spans several scan chunks and follows add, pop, del and reuse*/
+static int test_key_column(void)
+{
+    mcached_queue_attr_t attr;
+    mcached_queue_t queue;
+    struct list_head *item, *items[64];
+    LIST_HEAD(batch);
+    uint64 keys[64];
+    int i;
+
+    mcached_queue_attr_init(&attr);
+    attr.key_column = test_key;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), TEST_KEYS_CNT, &attr) == EMBED_SUCCESS);
+
+    for(i = 0; i < TEST_KEYS_CNT; i++)
+    {
+        TEST_CHECK(mcached_queue_get_idle_item(&queue, &item) == EMBED_SUCCESS);
+        TEST_ITEM(item)->key = 7 + (uint64)i * 3;
+        mcached_queue_add(&queue, item);
+    }
+
+    for(i = 0; i < TEST_KEYS_CNT; i++)
+    {
+        TEST_CHECK(mcached_queue_find_key(&queue, 7 + (uint64)i * 3, &item) == EMBED_SUCCESS);
+        TEST_CHECK(TEST_ITEM(item)->key == 7 + (uint64)i * 3);
+    }
+    TEST_CHECK(mcached_queue_find_key(&queue, 8, &item) != EMBED_SUCCESS);
+
+    /*even entries exist, odd ones fall between two keys*/
+    for(i = 0; i < 64; i++)
+        keys[i] = 7 + (uint64)(TEST_KEYS_CNT - 1 - i * 40) * 3 + (i % 2);
+    TEST_CHECK(mcached_queue_find_keys(&queue, keys, 64, items) == 32);
+    for(i = 0; i < 64; i++)
+        TEST_CHECK(i % 2 ? items[i] == NULL : TEST_ITEM(items[i])->key == keys[i]);
+
+    /*trypop, pop_batch and del of a queued item all drop the key*/
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS);
+    mcached_queue_del(&queue, item);
+    TEST_CHECK(mcached_queue_find_key(&queue, 7, &item) != EMBED_SUCCESS);
+    TEST_CHECK(mcached_queue_pop_batch(&queue, 10, &batch) == 10);
+    mcached_queue_put_idle_items(&queue, &batch);
+    TEST_CHECK(mcached_queue_find_key(&queue, 7 + 10 * 3, &item) != EMBED_SUCCESS);
+    TEST_CHECK(mcached_queue_find_key(&queue, 7 + 2000 * 3, &item) == EMBED_SUCCESS);
+    mcached_queue_del(&queue, item);
+    TEST_CHECK(mcached_queue_find_key(&queue, 7 + 2000 * 3, &item) != EMBED_SUCCESS);
+
+    /*a reused slot is found under its new key only*/
+    TEST_CHECK(mcached_queue_get_idle_item(&queue, &item) == EMBED_SUCCESS);
+    TEST_ITEM(item)->key = 1;
+    mcached_queue_add(&queue, item);
+    TEST_CHECK(mcached_queue_find_key(&queue, 1, items) == EMBED_SUCCESS && items[0] == item);
+
+    mcached_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+#define TEST_DRAIN_CNT  256
+
+static int test_drain_add(mcached_queue_t *queue, int cnt, uint64 *seq)
+{
+    struct list_head *item;
+    int i;
+
+    for(i = 0; i < cnt; i++)
+    {
+        TEST_CHECK(mcached_queue_get_idle_item(queue, &item) == EMBED_SUCCESS);
+        TEST_ITEM(item)->key = *seq;
+        TEST_ITEM(item)->seq = ~*seq;
+        (*seq)++;
+        mcached_queue_add(queue, item);
+    }
+
+    return EMBED_SUCCESS;
+}
+
+/*read cnt payloads off fd, they must carry keys from *next on*/
+static int test_drain_read(int fd, int cnt, uint64 *next)
+{
+    uint64 buf[2];
+    int i;
+
+    for(i = 0; i < cnt; i++)
+    {
+        TEST_CHECK(read(fd, buf, sizeof(buf)) == sizeof(buf));
+        TEST_CHECK(buf[0] == *next && buf[1] == ~*next);
+        (*next)++;
+    }
+
+    return EMBED_SUCCESS;
+}
+
+/*read and drop everything buffered in a non-blocking fd*/
+static long test_drain_flush(int fd)
+{
+    char buf[4096];
+    long total = 0;
+    ssize_t n;
+
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+        total += n;
+
+    return total;
+}
+
+/*
+ * Payloads leave in FIFO order and limits hold. drain never waits, items
+ * it could not write stay at the head, and one cut short is handed over
+ */
+static int test_drain(void)
+{
+    mcached_queue_attr_t attr;
+    mcached_queue_t queue;
+    struct list_head *item, *partial;
+    struct rlimit fsize, small;
+    char path[] = "/tmp/mcached_drain_XXXXXX";
+    char pad[512];
+    uint64 seq = 0, next = 0, buf[2];
+    size_t off;
+    long filled;
+    int fds[2], fd;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGXFSZ, SIG_IGN);
+    TEST_CHECK(mcached_queue_init(&queue, sizeof(test_item_t), TEST_DRAIN_CNT) == EMBED_SUCCESS);
+
+    /*stream: max_items and max_bytes both cut the burst*/
+    TEST_CHECK(pipe(fds) == 0);
+    TEST_CHECK(test_drain_add(&queue, 10, &seq) == EMBED_SUCCESS);
+    TEST_CHECK(mcached_queue_drain_to_fd(&queue, fds[1], 4, 0, &partial, &off) == 4);
+    TEST_CHECK(mcached_queue_drain_to_fd(&queue, fds[1], 10, 40, &partial, &off) == 2);
+    TEST_CHECK(mcached_queue_drain_to_fd(&queue, fds[1], 10, 0, &partial, &off) == 4);
+    TEST_CHECK(partial == NULL && off == 0);
+    TEST_CHECK(mcached_queue_drain_to_fd(&queue, fds[1], 10, 0, &partial, &off) == 0);
+    TEST_CHECK(test_drain_read(fds[0], 10, &next) == EMBED_SUCCESS);
+    TEST_CHECK(queue.ready_event->nready == 0);
+
+    /*a full non-blocking pipe fails at once and every item stays queued*/
+    TEST_CHECK(fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK) == 0);
+    TEST_CHECK(fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK) == 0);
+    memset(pad, 0, sizeof(pad));
+    for(filled = 0; write(fds[1], pad, sizeof(pad)) == sizeof(pad); filled += sizeof(pad))
+        ;
+    TEST_CHECK(errno == EAGAIN);
+    TEST_CHECK(test_drain_add(&queue, 4, &seq) == EMBED_SUCCESS);
+    TEST_CHECK(mcached_queue_drain_to_fd(&queue, fds[1], 10, 0, &partial, &off) == -1 && errno == EAGAIN);
+    TEST_CHECK(partial == NULL && queue.ready_event->nready == 4);
+    TEST_CHECK(test_drain_flush(fds[0]) == filled);
+    TEST_CHECK(mcached_queue_drain_to_fd(&queue, fds[1], 10, 0, &partial, &off) == 4);
+    TEST_CHECK(test_drain_read(fds[0], 4, &next) == EMBED_SUCCESS);
+
+    /*a closed reader fails the drain and the items stay at the head*/
+    close(fds[0]);
+    TEST_CHECK(test_drain_add(&queue, 3, &seq) == EMBED_SUCCESS);
+    TEST_CHECK(mcached_queue_drain_to_fd(&queue, fds[1], 10, 0, &partial, &off) == -1 && errno == EPIPE);
+    close(fds[1]);
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS);
+    TEST_CHECK(TEST_ITEM(item)->key == next);
+    mcached_queue_del(&queue, item);
+    next++;
+
+    /*a file size limit cuts the third payload short after 8 bytes*/
+    TEST_CHECK((fd = mkstemp(path)) >= 0);
+    unlink(path);
+    TEST_CHECK(test_drain_add(&queue, 2, &seq) == EMBED_SUCCESS);
+    TEST_CHECK(getrlimit(RLIMIT_FSIZE, &fsize) == 0);
+    small = fsize;
+    small.rlim_cur = 2 * sizeof(buf) + 8;
+    TEST_CHECK(setrlimit(RLIMIT_FSIZE, &small) == 0);
+    TEST_CHECK(mcached_queue_drain_to_fd(&queue, fd, 10, 0, &partial, &off) == 2);
+    TEST_CHECK(setrlimit(RLIMIT_FSIZE, &fsize) == 0);
+    TEST_CHECK(partial != NULL && off == 8 && TEST_ITEM(partial)->key == next + 2);
+    TEST_CHECK(queue.ready_event->nready == 1);
+
+    /*the caller finishes the item, the next one is still queued*/
+    TEST_CHECK(write(fd, (char *)(partial + 1) + off, sizeof(buf) - off) == (ssize_t)(sizeof(buf) - off));
+    mcached_queue_del(&queue, partial);
+    TEST_CHECK(lseek(fd, 0, SEEK_SET) == 0);
+    TEST_CHECK(test_drain_read(fd, 3, &next) == EMBED_SUCCESS);
+    close(fd);
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS);
+    TEST_CHECK(TEST_ITEM(item)->key == next);
+    mcached_queue_del(&queue, item);
+    next++;
+
+    /*datagram: one message per item*/
+    TEST_CHECK(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == 0);
+    TEST_CHECK(test_drain_add(&queue, 2, &seq) == EMBED_SUCCESS);
+    TEST_CHECK(mcached_queue_drain_to_fd(&queue, fds[1], 10, 0, &partial, &off) == 2);
+    TEST_CHECK(test_drain_read(fds[0], 2, &next) == EMBED_SUCCESS);
+    close(fds[0]);
+    close(fds[1]);
+
+    mcached_queue_destroy(&queue);
+
+    /*the SPSC consumer drains its ring, the shared ring refuses*/
+    mcached_queue_attr_init(&attr);
+    attr.mode = MCACHED_QUEUE_MODE_SPSC;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 16, &attr) == EMBED_SUCCESS);
+    TEST_CHECK(pipe(fds) == 0);
+    TEST_CHECK(test_drain_add(&queue, 5, &seq) == EMBED_SUCCESS);
+    TEST_CHECK(mcached_queue_drain_to_fd(&queue, fds[1], 3, 0, &partial, &off) == 3);
+    TEST_CHECK(mcached_queue_drain_to_fd(&queue, fds[1], 3, 0, &partial, &off) == 2);
+    TEST_CHECK(test_drain_read(fds[0], 5, &next) == EMBED_SUCCESS);
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) != EMBED_SUCCESS);
+    TEST_CHECK(test_drain_add(&queue, 16, &seq) == EMBED_SUCCESS);
+    close(fds[0]);
+    close(fds[1]);
+    mcached_queue_destroy(&queue);
+
+    attr.mode = MCACHED_QUEUE_MODE_MPMC_RING;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 16, &attr) == EMBED_SUCCESS);
+    TEST_CHECK(mcached_queue_drain_to_fd(&queue, 1, 1, 0, &partial, &off) == -1 && errno == ENOTSUP);
+    mcached_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+
+
+/*
+ * Add cnt items round robin over the shards of squeue, then pop everything
+ * from shard 0 only: every item must come back once, through steals.
+ */
+static int test_shard_drain(mcached_queue_attr_t *attr, int cnt)
+{
+    mcached_shard_queue_t squeue;
+    struct list_head *item;
+    char seen[64];
+    int i, got = 0;
+
+    TEST_CHECK(cnt <= (int)sizeof(seen));
+    TEST_CHECK(mcached_shard_queue_init(&squeue, sizeof(test_item_t), 64, 2, attr) == EMBED_SUCCESS);
+    squeue.steal_batch = 4;
+
+    for(i = 0; i < cnt; i++)
+    {
+        TEST_CHECK(mcached_shard_queue_get_idle_item(&squeue, MCACHED_SHARD_ROUND_ROBIN, &item) == EMBED_SUCCESS);
+        TEST_ITEM(item)->key = i + 1;
+        TEST_ITEM(item)->seq = i;
+        TEST_CHECK(mcached_shard_queue_add(&squeue, item) == EMBED_SUCCESS);
+    }
+
+    memset(seen, 0, sizeof(seen));
+    while(mcached_shard_queue_trypop(&squeue, 0, &item) == EMBED_SUCCESS)
+    {
+        TEST_CHECK(TEST_ITEM(item)->seq < (uint64)cnt && !seen[TEST_ITEM(item)->seq]);
+        seen[TEST_ITEM(item)->seq] = 1;
+        got++;
+        mcached_shard_queue_del(&squeue, item);
+    }
+    TEST_CHECK(got == cnt);
+
+    mcached_shard_queue_destroy(&squeue);
+
+    return EMBED_SUCCESS;
+}
+
+static int test_shard_steal(void)
+{
+    mcached_queue_attr_t attr;
+
+    mcached_queue_attr_init(&attr);
+    TEST_CHECK(test_shard_drain(&attr, 20) == EMBED_SUCCESS);
+
+    mcached_queue_attr_init(&attr);
+    attr.key_column = test_key;
+    TEST_CHECK(test_shard_drain(&attr, 20) == EMBED_SUCCESS);
+
+    mcached_queue_attr_init(&attr);
+    attr.residency_hist = 1;
+    TEST_CHECK(test_shard_drain(&attr, 20) == EMBED_SUCCESS);
+
+    mcached_queue_attr_init(&attr);
+    attr.lockless_read = 1;
+    TEST_CHECK(test_shard_drain(&attr, 20) == EMBED_SUCCESS);
+
+    mcached_queue_attr_init(&attr);
+    attr.mode = MCACHED_QUEUE_MODE_MPMC_RING;
+    TEST_CHECK(test_shard_drain(&attr, 20) == EMBED_SUCCESS);
+
+    return EMBED_SUCCESS;
+}
+/*an idle item nobody added goes straight back through del*/
+static int test_del_idle_mode(mcached_queue_attr_t *attr)
+{
+    mcached_queue_t queue;
+    struct list_head *item;
+    int i;
+
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 8, attr) == EMBED_SUCCESS);
+
+    for(i = 0; i < 32; i++)
+    {
+        TEST_CHECK(mcached_queue_get_idle_item(&queue, &item) == EMBED_SUCCESS);
+        mcached_queue_del(&queue, item);
+    }
+
+    /*nothing leaked into the used set and every slot is still there*/
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) != EMBED_SUCCESS);
+    for(i = 0; i < 8; i++)
+    {
+        TEST_CHECK(mcached_queue_get_idle_item(&queue, &item) == EMBED_SUCCESS);
+        mcached_queue_add(&queue, item);
+    }
+    for(i = 0; i < 8; i++)
+    {
+        TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS);
+        mcached_queue_del(&queue, item);
+    }
+
+    mcached_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+
+static int test_del_idle(void)
+{
+    mcached_queue_attr_t attr;
+    mcached_shard_queue_t squeue;
+    struct list_head *item;
+    int i;
+
+    mcached_queue_attr_init(&attr);
+    TEST_CHECK(test_del_idle_mode(&attr) == EMBED_SUCCESS);
+    attr.magazine_size = 4;
+    TEST_CHECK(test_del_idle_mode(&attr) == EMBED_SUCCESS);
+
+    mcached_queue_attr_init(&attr);
+    attr.lockless_read = 1;
+    TEST_CHECK(test_del_idle_mode(&attr) == EMBED_SUCCESS);
+
+    mcached_queue_attr_init(&attr);
+    attr.key_column = test_key;
+    attr.prio_levels = 2;
+    TEST_CHECK(test_del_idle_mode(&attr) == EMBED_SUCCESS);
+
+    mcached_queue_attr_init(&attr);
+    attr.mode = MCACHED_QUEUE_MODE_MPMC_RING;
+    TEST_CHECK(test_del_idle_mode(&attr) == EMBED_SUCCESS);
+
+    mcached_queue_attr_init(&attr);
+    TEST_CHECK(mcached_shard_queue_init(&squeue, sizeof(test_item_t), 8, 2, &attr) == EMBED_SUCCESS);
+    for(i = 0; i < 32; i++)
+    {
+        TEST_CHECK(mcached_shard_queue_get_idle_item(&squeue, MCACHED_SHARD_ROUND_ROBIN, &item) == EMBED_SUCCESS);
+        mcached_shard_queue_del(&squeue, item);
+    }
+    TEST_CHECK(mcached_shard_queue_trypop(&squeue, 0, &item) != EMBED_SUCCESS);
+    mcached_shard_queue_destroy(&squeue);
+
+    return EMBED_SUCCESS;
+}
+
+
+/*Fill an elastic queue to its ceiling, then empty it with trypop and del*/
+static int test_elastic_cycle(mcached_queue_t *queue, int max_cnt)
+{
+    struct list_head *item;
+    int i;
+
+    for(i = 0; i < max_cnt; i++)
+    {
+        TEST_CHECK(mcached_queue_get_idle_item(queue, &item) == EMBED_SUCCESS);
+        mcached_queue_add(queue, item);
+    }
+    TEST_CHECK(mcached_queue_get_idle_item(queue, &item) != EMBED_SUCCESS);
+    TEST_CHECK(queue->max_item_cnt == max_cnt);
+
+    while(mcached_queue_trypop(queue, &item) == EMBED_SUCCESS)
+        mcached_queue_del(queue, item);
+
+    return EMBED_SUCCESS;
+}
+
+/*Capacity follows the load up in chunks and all the way back down*/
+static int test_elastic(void)
+{
+    mcached_queue_attr_t attr;
+    mcached_queue_t queue;
+    LIST_HEAD(batch);
+
+    mcached_queue_attr_init(&attr);
+    attr.elastic_max_cnt = 1024;
+    attr.elastic_idle_ms = 0;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 128, &attr) == EMBED_SUCCESS);
+
+    TEST_CHECK(test_elastic_cycle(&queue, 1024) == EMBED_SUCCESS);
+    TEST_CHECK(queue.max_item_cnt == 128);
+
+    /*batches grow and trim the same way*/
+    TEST_CHECK(mcached_queue_get_idle_items(&queue, 600, &batch) == 600);
+    TEST_CHECK(queue.max_item_cnt == 640);
+    mcached_queue_put_idle_items(&queue, &batch);
+    TEST_CHECK(queue.max_item_cnt == 128);
+    mcached_queue_destroy(&queue);
+
+    /*with an idle time nothing goes early, then one shrink releases it all*/
+    attr.elastic_idle_ms = 20;
+    TEST_CHECK(mcached_queue_init_ex(&queue, sizeof(test_item_t), 128, &attr) == EMBED_SUCCESS);
+    TEST_CHECK(test_elastic_cycle(&queue, 1024) == EMBED_SUCCESS);
+    TEST_CHECK(queue.max_item_cnt == 1024);
+
+    usleep(40 * 1000);
+    mcached_queue_shrink(&queue);
+    TEST_CHECK(queue.max_item_cnt == 128);
+
+    /*the released slots can be grown into again*/
+    TEST_CHECK(test_elastic_cycle(&queue, 1024) == EMBED_SUCCESS);
+    mcached_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+
+/*
+ * Items go to the smallest class that fits, spill into larger ones and
+ * leave in FIFO order across classes; used-side attr options stay off the
+ * inner class queues
+ */
+static int test_sized(void)
+{
+    static const int sizes[] = {64, 256, 1024};
+    static const int cnts[] = {4, 4, 4};
+    mcached_queue_attr_t attr;
+    mcached_sized_queue_t squeue;
+    struct list_head *item;
+    struct timespec deadline;
+    int want[] = {1, 64, 65, 256, 1000, 10, 10, 10, 10, 10};
+    int got[] = {64, 64, 256, 256, 1024, 64, 64, 256, 256, 1024};
+    int i, n = sizeof(want) / sizeof(want[0]);
+
+    mcached_queue_attr_init(&attr);
+    attr.key_column = test_key;
+    attr.lockless_read = 1;
+    attr.residency_hist = 1;
+    TEST_CHECK(mcached_sized_queue_init(&squeue, sizes, cnts, 3, &attr) == EMBED_SUCCESS);
+
+    for(i = 0; i < 3; i++)
+    {
+        TEST_CHECK(squeue.classes[i].key_col == NULL);
+        TEST_CHECK(!squeue.classes[i].epoch_enabled);
+        TEST_CHECK(squeue.classes[i].residency == NULL);
+    }
+
+    TEST_CHECK(mcached_sized_queue_get_idle_item(&squeue, 1025, &item) != EMBED_SUCCESS);
+
+    for(i = 0; i < n; i++)
+    {
+        TEST_CHECK(mcached_sized_queue_get_idle_item(&squeue, want[i], &item) == EMBED_SUCCESS);
+        TEST_CHECK(mcached_sized_queue_item_size(&squeue, item) >= want[i]);
+        TEST_ITEM(item)->seq = i;
+        TEST_CHECK(mcached_sized_queue_add(&squeue, item) == EMBED_SUCCESS);
+    }
+
+    /*small items spill upwards once their class is used up*/
+    for(i = 0; i < n; i++)
+    {
+        deadline = test_deadline(1000);
+        if(i % 3 == 0)
+            TEST_CHECK(mcached_sized_queue_pop(&squeue, &item) == EMBED_SUCCESS);
+        else if(i % 3 == 1)
+            TEST_CHECK(mcached_sized_queue_timedpop(&squeue, &item, &deadline) == EMBED_SUCCESS);
+        else
+            TEST_CHECK(mcached_sized_queue_trypop(&squeue, &item) == EMBED_SUCCESS);
+        TEST_CHECK(TEST_ITEM(item)->seq == (uint64)i);
+        TEST_CHECK(mcached_sized_queue_item_size(&squeue, item) == got[i]);
+        mcached_sized_queue_del(&squeue, item);
+    }
+    TEST_CHECK(mcached_sized_queue_trypop(&squeue, &item) != EMBED_SUCCESS);
+    deadline = test_deadline(10);
+    TEST_CHECK(mcached_sized_queue_timedpop(&squeue, &item, &deadline) != EMBED_SUCCESS);
+
+    mcached_sized_queue_destroy(&squeue);
+
+    return EMBED_SUCCESS;
+}
+
+#define TEST_EPOCH_CNT      256
+#define TEST_EPOCH_ROUNDS   100
+#define TEST_EPOCH_LIVE     0x6c697665ULL /*"live"*/
+
+static mcached_queue_t epoch_queue;
+static int epoch_stop;
+static __thread long epoch_visits;
+
+/*Everything a lockless reader reaches must still be queued*/
+static void test_epoch_visit(mcached_queue_t *queue, struct list_head *item)
+{
+    (void)queue;
+
+    if(TEST_ITEM(item)->key != TEST_EPOCH_LIVE || ++epoch_visits > TEST_EPOCH_CNT)
+    {
+        /*a recycled item can lead the walk into idle_list, never back*/
+        fprintf(stderr, "lockless traverse reached a recycled item\n");
+        abort();
+    }
+}
+
+static void *test_epoch_reader(void *arg)
+{
+    (void)arg;
+
+    while(!__atomic_load_n(&epoch_stop, __ATOMIC_RELAXED))
+    {
+        epoch_visits = 0;
+        mcached_queue_traverse(&epoch_queue, test_epoch_visit);
+    }
+
+    return NULL;
+}
+
+/*
+ * Popped items are handed out only after the readers that could see them
+ * are gone, so trypop, a local batch and put_idle_items may recycle them
+ * while traverse runs without mlock
+ */
+static int test_epoch_read(void)
+{
+    mcached_queue_attr_t attr;
+    pthread_t readers[2];
+    struct list_head *item;
+    int round, i;
+
+    mcached_queue_attr_init(&attr);
+    attr.lockless_read = 1;
+    TEST_CHECK(mcached_queue_init_ex(&epoch_queue, sizeof(test_item_t), TEST_EPOCH_CNT, &attr) == EMBED_SUCCESS);
+
+    epoch_stop = 0;
+    for(i = 0; i < 2; i++)
+        TEST_CHECK(pthread_create(&readers[i], NULL, test_epoch_reader, NULL) == 0);
+
+    for(round = 0; round < TEST_EPOCH_ROUNDS; round++)
+    {
+        LIST_HEAD(batch);
+
+        while(mcached_queue_get_idle_item(&epoch_queue, &item) == EMBED_SUCCESS)
+        {
+            TEST_ITEM(item)->key = TEST_EPOCH_LIVE;
+            mcached_queue_add(&epoch_queue, item);
+        }
+
+        for(i = 0; i < TEST_EPOCH_CNT / 2 && mcached_queue_trypop(&epoch_queue, &item) == EMBED_SUCCESS; i++)
+        {
+            TEST_ITEM(item)->key = 0;
+            list_add_tail(item, &batch);
+        }
+        mcached_queue_put_idle_items(&epoch_queue, &batch);
+
+        TEST_CHECK(mcached_queue_pop_batch(&epoch_queue, TEST_EPOCH_CNT / 4, &batch) > 0);
+        list_for_each(item, &batch)
+            TEST_ITEM(item)->key = 0;
+        mcached_queue_put_idle_items(&epoch_queue, &batch);
+
+        while(mcached_queue_trypop(&epoch_queue, &item) == EMBED_SUCCESS)
+        {
+            TEST_ITEM(item)->key = 0;
+            mcached_queue_del(&epoch_queue, item);
+        }
+    }
+
+    __atomic_store_n(&epoch_stop, 1, __ATOMIC_RELAXED);
+    for(i = 0; i < 2; i++)
+        pthread_join(readers[i], NULL);
+
+    mcached_queue_destroy(&epoch_queue);
+
+    return EMBED_SUCCESS;
+}
+
+/*One shard per online node, never one for a hole in the node ids*/
+static int test_shard_numa(void)
+{
+    mcached_shard_queue_t squeue;
+    struct list_head *item;
+    char path[64];
+    int i, home, node = -1;
+
+    TEST_CHECK(mcached_shard_queue_init_numa(&squeue, sizeof(test_item_t), 256, NULL) == EMBED_SUCCESS);
+    TEST_CHECK(squeue.numa && squeue.shard_cnt >= 1);
+
+    for(i = 0; i < squeue.shard_cnt; i++)
+    {
+        TEST_CHECK(MCACHED_SHARD_QUEUE(&squeue, i)->numa_node > node);
+        node = MCACHED_SHARD_QUEUE(&squeue, i)->numa_node;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+        TEST_CHECK(squeue.shard_cnt == 1 || access(path, F_OK) == 0);
+    }
+
+    home = mcached_shard_queue_local(&squeue);
+    TEST_CHECK(home >= 0 && home < squeue.shard_cnt);
+    TEST_CHECK(mcached_shard_queue_get_idle_item(&squeue, home, &item) == EMBED_SUCCESS);
+    TEST_CHECK(MCACHED_QUEUE_HAS_ITEM(MCACHED_SHARD_QUEUE(&squeue, home), item));
+    TEST_CHECK(mcached_shard_queue_add(&squeue, item) == EMBED_SUCCESS);
+    TEST_CHECK(mcached_shard_queue_trypop(&squeue, home, &item) == EMBED_SUCCESS);
+    mcached_shard_queue_del(&squeue, item);
+
+    mcached_shard_queue_destroy(&squeue);
+
+    return EMBED_SUCCESS;
+}
+
+/*Index links: FIFO through every pop flavour, batches and del of queued items*/
+static int test_compact(void)
+{
+    mcached_compact_queue_t queue;
+    struct timespec deadline;
+    void *item, *items[8];
+    int i, n;
+
+    TEST_CHECK(mcached_compact_queue_init(&queue, sizeof(uint64), 16, sizeof(uint32)) == EMBED_SUCCESS);
+
+    for(i = 0; i < 16; i++)
+    {
+        TEST_CHECK(mcached_compact_queue_get_idle_item(&queue, &item) == EMBED_SUCCESS);
+        *(uint64 *)item = i;
+        *(uint32 *)MCACHED_COMPACT_META(&queue, MCACHED_COMPACT_SLOT(&queue, item)) = i * 2;
+        TEST_CHECK(mcached_compact_queue_add(&queue, item) == EMBED_SUCCESS);
+    }
+    TEST_CHECK(mcached_compact_queue_get_idle_item(&queue, &item) != EMBED_SUCCESS);
+
+    deadline = test_deadline(1000);
+    TEST_CHECK(mcached_compact_queue_pop(&queue, &item) == EMBED_SUCCESS && *(uint64 *)item == 0);
+    mcached_compact_queue_del(&queue, item);
+    TEST_CHECK(mcached_compact_queue_timedpop(&queue, &item, &deadline) == EMBED_SUCCESS && *(uint64 *)item == 1);
+    mcached_compact_queue_del(&queue, item);
+    TEST_CHECK(mcached_compact_queue_trypop(&queue, &item) == EMBED_SUCCESS && *(uint64 *)item == 2);
+    mcached_compact_queue_del(&queue, item);
+
+    /*del of a queued item unlinks it*/
+    mcached_compact_queue_del(&queue, MCACHED_COMPACT_ITEM(&queue, 3));
+
+    n = mcached_compact_queue_pop_batch(&queue, 8, items);
+    TEST_CHECK(n == 8);
+    for(i = 0; i < n; i++)
+    {
+        TEST_CHECK(*(uint64 *)items[i] == (uint64)i + 4);
+        TEST_CHECK(*(uint32 *)MCACHED_COMPACT_META(&queue, MCACHED_COMPACT_SLOT(&queue, items[i])) == (uint32)(i + 4) * 2);
+        mcached_compact_queue_del(&queue, items[i]);
+    }
+
+    while(mcached_compact_queue_trypop(&queue, &item) == EMBED_SUCCESS)
+    {
+        TEST_CHECK(*(uint64 *)item == (uint64)i++ + 4);
+        mcached_compact_queue_del(&queue, item);
+    }
+    TEST_CHECK(i == 12);
+
+    deadline = test_deadline(10);
+    TEST_CHECK(mcached_compact_queue_timedpop(&queue, &item, &deadline) != EMBED_SUCCESS);
+    TEST_CHECK(mcached_compact_queue_pop_batch(&queue, 8, items) == 0);
+
+    mcached_compact_queue_destroy(&queue);
+
+    return EMBED_SUCCESS;
+}
+
+#define TEST_PERSIST_CNT 1000
+
+static int test_persist_open(mcached_queue_t *queue, const char *path, int item_cnt)
+{
+    mcached_queue_attr_t attr;
+
+    mcached_queue_attr_init(&attr);
+    attr.persist_path = path;
+    attr.persist_sync = MCACHED_QUEUE_SYNC_PERIODIC;
+    attr.persist_sync_ms = 5;
+
+    return mcached_queue_init_ex(queue, sizeof(test_item_t), item_cnt, &attr);
+}
+
+/*Queue cnt more items, del from the head down to keep, and so on if forever*/
+static void test_persist_writer(const char *path, int cnt, int keep, int forever)
+{
+    mcached_queue_t queue;
+    struct list_head *item;
+    LIST_HEAD(batch);
+    uint64 seq = 0;
+    int i, queued = 0;
+
+    if(test_persist_open(&queue, path, TEST_PERSIST_CNT) != EMBED_SUCCESS)
+        _exit(1);
+
+    do
+    {
+        for(i = 0; i < cnt; i++)
+        {
+            if(mcached_queue_get_idle_item(&queue, &item) != EMBED_SUCCESS)
+                _exit(2);
+            TEST_ITEM(item)->seq = seq++;
+            mcached_queue_add(&queue, item);
+            queued++;
+        }
+        for(; queued > keep; queued--)
+        {
+            if(mcached_queue_trypop(&queue, &item) != EMBED_SUCCESS)
+                _exit(3);
+            mcached_queue_del(&queue, item);
+        }
+    } while(forever);
+
+    /*in flight when the process dies: one popped, five idle, a batch*/
+    mcached_queue_trypop(&queue, &item);
+    for(i = 0; i < 5; i++)
+        mcached_queue_get_idle_item(&queue, &item);
+    mcached_queue_pop_batch(&queue, 5, &batch);
+
+    _exit(0);
+}
+
+/*Reopen and check what is left is one unbroken run of seq, returns its length*/
+static int test_persist_recover(mcached_queue_t *queue, const char *path, uint64 *first)
+{
+    struct list_head *item;
+    LIST_HEAD(batch);
+    int n = 0;
+
+    TEST_CHECK(test_persist_open(queue, path, TEST_PERSIST_CNT) == EMBED_SUCCESS);
+
+    while(mcached_queue_trypop(queue, &item) == EMBED_SUCCESS)
+    {
+        if(n == 0)
+            *first = TEST_ITEM(item)->seq;
+        TEST_CHECK(TEST_ITEM(item)->seq == *first + n);
+        n++;
+        mcached_queue_del(queue, item);
+    }
+
+    /*every slot the dead process held is idle again*/
+    TEST_CHECK(mcached_queue_get_idle_items(queue, TEST_PERSIST_CNT + 1, &batch) == TEST_PERSIST_CNT);
+    mcached_queue_put_idle_items(queue, &batch);
+
+    return n;
+}
+
+/*A persistent queue survives the death of its process, in order*/
+static int test_persist(void)
+{
+    mcached_queue_t queue;
+    struct list_head *item;
+    char path[64];
+    uint64 first = 0;
+    pid_t pid;
+    int status, n;
+
+    snprintf(path, sizeof(path), "/tmp/mcached_test_persist.%d", (int)getpid());
+    unlink(path);
+
+    /*a clean exit with items in flight*/
+    pid = fork();
+    TEST_CHECK(pid >= 0);
+    if(pid == 0)
+        test_persist_writer(path, 100, 90, 0);
+    TEST_CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    n = test_persist_recover(&queue, path, &first);
+    TEST_CHECK(n == 84 && first == 16);
+
+    TEST_CHECK(mcached_queue_get_idle_item(&queue, &item) == EMBED_SUCCESS);
+    TEST_ITEM(item)->seq = 7;
+    mcached_queue_add(&queue, item);
+    mcached_queue_destroy(&queue);
+
+    /*reattach after a clean destroy*/
+    TEST_CHECK(test_persist_open(&queue, path, TEST_PERSIST_CNT) == EMBED_SUCCESS);
+    TEST_CHECK(mcached_queue_trypop(&queue, &item) == EMBED_SUCCESS && TEST_ITEM(item)->seq == 7);
+    mcached_queue_del(&queue, item);
+    mcached_queue_destroy(&queue);
+
+    /*a file made for another geometry is refused*/
+    TEST_CHECK(test_persist_open(&queue, path, TEST_PERSIST_CNT - 1) != EMBED_SUCCESS);
+    unlink(path);
+
+    /*SIGKILL at some point in the middle of adds and dels*/
+    pid = fork();
+    TEST_CHECK(pid >= 0);
+    if(pid == 0)
+        test_persist_writer(path, 50, 500, 1);
+    usleep(50 * 1000);
+    kill(pid, SIGKILL);
+    TEST_CHECK(waitpid(pid, &status, 0) == pid && WIFSIGNALED(status));
+
+    n = test_persist_recover(&queue, path, &first);
+    TEST_CHECK(n > 0 && n <= TEST_PERSIST_CNT);
+    mcached_queue_destroy(&queue);
+    unlink(path);
+
+    return EMBED_SUCCESS;
+}
+
+typedef struct
+{
+    mcached_shm_link_t link;
+    uint64 seq;
+}test_shm_item_t;
+
+#define TEST_SHM_CNT 1000
+
+/*A child process fills an anonymous region, the parent pops in order*/
+static int test_shm(void)
+{
+    mcached_shm_queue_t queue;
+    mcached_shm_link_t *item;
+    struct timespec deadline;
+    pid_t pid;
+    int i, status;
+
+    TEST_CHECK(mcached_shm_queue_create(&queue, NULL, sizeof(test_shm_item_t), 64) == EMBED_SUCCESS);
+
+    deadline = test_deadline(10);
+    TEST_CHECK(mcached_shm_queue_timedpop(&queue, &item, &deadline) != EMBED_SUCCESS);
+    TEST_CHECK(mcached_shm_queue_trypop(&queue, &item) != EMBED_SUCCESS);
+
+    pid = fork();
+    TEST_CHECK(pid >= 0);
+    if(pid == 0)
+    {
+        for(i = 0; i < TEST_SHM_CNT; i++)
+        {
+            while(mcached_shm_queue_get_idle_item(&queue, &item) != EMBED_SUCCESS)
+                usleep(100);
+            ((test_shm_item_t *)item)->seq = i;
+            mcached_shm_queue_add(&queue, item);
+        }
+        _exit(0);
+    }
+
+    for(i = 0; i < TEST_SHM_CNT; i++)
+    {
+        if(i % 3 == 0)
+        {
+            TEST_CHECK(mcached_shm_queue_pop(&queue, &item) == EMBED_SUCCESS);
+        }
+        else if(i % 3 == 1)
+        {
+            deadline = test_deadline(5000);
+            TEST_CHECK(mcached_shm_queue_timedpop(&queue, &item, &deadline) == EMBED_SUCCESS);
+        }
+        else
+        {
+            while(mcached_shm_queue_trypop(&queue, &item) != EMBED_SUCCESS)
+                usleep(10);
+        }
+        TEST_CHECK(((test_shm_item_t *)item)->seq == (uint64)i);
+        mcached_shm_queue_del(&queue, item);
+    }
+
+    TEST_CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    TEST_CHECK(queue.hdr->queued_cnt == 0);
+    TEST_CHECK(queue.hdr->ready_event.nready == 0);
+    mcached_shm_queue_detach(&queue);
+
+    return EMBED_SUCCESS;
+}
+
+static const struct
+{
+    const char *name;
+    test_case_cb run;
+}test_cases[] = {
+    {"ring",            test_ring},
+    {"spsc",            test_spsc},
+    {"batch",           test_batch},
+    {"magazine",        test_magazine},
+    {"slab",            test_slab},
+    {"index",           test_index},
+    {"ready_event",     test_ready_event},
+    {"eventfd",         test_eventfd},
+    {"pop",             test_pop},
+    {"prio",            test_prio},
+#if MCACHED_QUEUE_STATS
+    {"stats",           test_stats},
+#endif
+    {"residency",       test_residency},
+    {"shard_steal",     test_shard_steal},
+    {"del_idle",        test_del_idle},
+    {"shard_numa",      test_shard_numa},
+    {"elastic",         test_elastic},
+    {"sized",           test_sized},
+    {"shm",             test_shm},
+    {"persist",         test_persist},
+    {"compact",         test_compact},
+    {"epoch_read",      test_epoch_read},
+    {"traverse_parallel", test_traverse_parallel},
+    {"list_prefetch",   test_list_prefetch},
+    {"key_column",      test_key_column},
+    {"drain",           test_drain},
+};
+
+static int test_selected(const char *name, int argc, char **argv)
+{
+    int i;
+
+    if(argc < 2)
+        return 1;
+
+    for(i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], name) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int i, fails = 0;
+
+    for(i = 0; i < (int)(sizeof(test_cases) / sizeof(test_cases[0])); i++)
+    {
+        if(!test_selected(test_cases[i].name, argc, argv))
+            continue;
+
+        if(test_cases[i].run() != EMBED_SUCCESS)
+        {
+            printf("FAIL %s\n", test_cases[i].name);
+            fails++;
+        }
+        else
+        {
+            printf("ok   %s\n", test_cases[i].name);
+        }
+        fflush(stdout);
+    }
+
+    return fails ? 1 : 0;
+}